@@ -0,0 +1,93 @@
+// directory bucket codec, see dir_bucket.h
+
+#include "dir_bucket.h"
+#include <string.h>
+#include <algorithm>
+
+// FNV-1a with a final avalanche, tables are indexed by the low bits
+uint32_t
+dir_bucket::hash(const std::string &name)
+{
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < name.size(); i++)
+    h = (h ^ (unsigned char) name[i]) * 16777619U;
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return h;
+}
+
+std::string
+dir_bucket::encode_record(const std::string &name, extent_protocol::extentid_t inum)
+{
+  record r;
+  r.inum = inum;
+  r.hash = hash(name);
+  r.namelen = name.size();
+  r.live = 1;
+  std::string out((const char *) &r, sizeof(r));
+  out += name;
+  return out;
+}
+
+std::string
+dir_bucket::encode(const std::vector<entry> &entries, uint32_t depth)
+{
+  std::string out(sizeof(header), '\0');
+  for (size_t i = 0; i < entries.size(); i++)
+    out += encode_record(entries[i].name, entries[i].inum);
+  header h;
+  h.depth = depth;
+  h.nentries = entries.size();
+  h.end = out.size();
+  h.dead = 0;
+  memcpy(&out[0], &h, sizeof(h));
+  return out;
+}
+
+bool
+dir_bucket::read_header(const std::string &data, header &h)
+{
+  if (data.size() < sizeof(h))
+    return false;
+  memcpy(&h, data.data(), sizeof(h));
+  if (h.end > data.size())
+    h.end = data.size();
+  return true;
+}
+
+void
+dir_bucket::parse(const std::string &data, std::vector<entry> &entries)
+{
+  header h;
+  if (!read_header(data, h))
+    return;
+  size_t pos = sizeof(h);
+  while (pos + sizeof(record) <= h.end) {
+    record r;
+    memcpy(&r, data.data() + pos, sizeof(r));
+    if (pos + sizeof(r) + r.namelen > h.end)
+      break;
+    if (r.live)
+      entries.push_back(entry(data.substr(pos + sizeof(r), r.namelen), r.inum));
+    pos += sizeof(r) + r.namelen;
+  }
+}
+
+bool
+dir_bucket::find(const std::string &data, const header &h, const std::string &name,
+                 size_t &pos, record &r)
+{
+  uint32_t hv = hash(name);
+  pos = sizeof(header);
+  while (pos + sizeof(r) <= h.end) {
+    memcpy(&r, data.data() + pos, sizeof(r));
+    if (r.live && r.hash == hv && r.namelen == name.size()
+        && data.compare(pos + sizeof(r), r.namelen, name) == 0)
+      return true;
+    pos += sizeof(r) + r.namelen;
+  }
+  return false;
+}
@@ -0,0 +1,58 @@
+// bucket format of hashed directories
+
+#ifndef dir_bucket_h
+#define dir_bucket_h
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "extent_protocol.h"
+
+// A bucket of a yfs_dir hash table: a header followed by records of inum,
+// name hash and name. Records are appended; removing one clears its live
+// flag and counts its bytes as dead until the bucket is rewritten.
+//
+// The codec is shared by yfs_dir, which works on cached buckets, and by
+// extent_server, which adds, removes and looks up single entries in place
+// so a client does not have to fetch a bucket to change one name in it.
+class dir_bucket {
+ public:
+  // buckets are split once they would grow past this
+  static const uint32_t max_bytes = extent_protocol::blocksize;
+  // past this depth full buckets simply grow, only many equal hashes get here
+  static const uint32_t max_depth = 18;
+
+  struct header {
+    uint32_t depth;
+    uint32_t nentries;
+    uint32_t end;   // bytes in use, header included
+    uint32_t dead;  // bytes of removed records
+  };
+
+  struct record {
+    uint64_t inum;
+    uint32_t hash;
+    uint16_t namelen;
+    uint16_t live;
+  };
+
+  struct entry {
+    std::string name;
+    extent_protocol::extentid_t inum;
+    entry() : inum(0) {}
+    entry(const std::string &n, extent_protocol::extentid_t i) : name(n), inum(i) {}
+  };
+
+  static uint32_t hash(const std::string &name);
+  static std::string encode(const std::vector<entry> &, uint32_t depth);
+  static std::string encode_record(const std::string &name, extent_protocol::extentid_t inum);
+  // the header of a bucket, false if data is too short to hold one
+  static bool read_header(const std::string &data, header &);
+  // appends the live entries
+  static void parse(const std::string &data, std::vector<entry> &);
+  // the live record for name, and where it starts
+  static bool find(const std::string &data, const header &, const std::string &name,
+                   size_t &pos, record &);
+};
+
+#endif
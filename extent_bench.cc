@@ -0,0 +1,2122 @@
+//
+// extent server / extent client benchmarks
+//
+// runs an extent_server in-process behind a real rpcs listener and drives
+// it through extent_client, so the numbers include marshalling and the
+// loopback round trips. the storage benchmarks use extent_store directly.
+// the yfs_client tests add a lock server in-process as well and run two
+// clients against it, so locks really move between them.
+//
+
+#include "extent_protocol.h"
+#include "extent_client.h"
+#include "extent_server.h"
+#include "extent_store.h"
+#include "yfs_dir.h"
+#include "yfs_client.h"
+#include "rsm_protocol.h"
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <sstream>
+#include <map>
+#include <set>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <atomic>
+
+std::string dst;
+std::string tmpdir;
+int port;
+extent_server *es;
+
+// every bench that listens gets ports of its own, from port + 10 * bench
+// on, so running them all in one process never finds one still bound
+int
+bench_port(int bench)
+{
+  return port + 10 * bench;
+}
+
+// an extent server behind its own rpcs listener, the same as extent_smain.
+// the listener is handed back if asked for, to be deleted before the server.
+extent_server *
+start_server(int port, std::string dir, rpcs **listener = NULL)
+{
+  rpcs *server = new rpcs(port);
+  if (listener)
+    *listener = server;
+  extent_server *es = new extent_server(dir);
+  server->reg(extent_protocol::get, es, &extent_server::get);
+  server->reg(extent_protocol::getattr, es, &extent_server::getattr);
+  server->reg(extent_protocol::put, es, &extent_server::put);
+  server->reg(extent_protocol::remove, es, &extent_server::remove);
+  server->reg(extent_protocol::read, es, &extent_server::read);
+  server->reg(extent_protocol::write, es, &extent_server::write);
+  server->reg(extent_protocol::resize, es, &extent_server::resize);
+  server->reg(extent_protocol::list, es, &extent_server::list);
+  server->reg(extent_protocol::restore, es, &extent_server::restore);
+  server->reg(extent_protocol::multiget, es, &extent_server::multiget);
+  server->reg(extent_protocol::multigetattr, es, &extent_server::multigetattr);
+  server->reg(extent_protocol::multiput, es, &extent_server::multiput);
+  server->reg(extent_protocol::multiremove, es, &extent_server::multiremove);
+  server->reg(extent_protocol::readattr, es, &extent_server::readattr);
+  server->reg(extent_protocol::get_if_changed, es, &extent_server::get_if_changed);
+  server->reg(extent_protocol::add_entry, es, &extent_server::add_entry);
+  server->reg(extent_protocol::remove_entry, es, &extent_server::remove_entry);
+  server->reg(extent_protocol::lookup_entry, es, &extent_server::lookup_entry);
+  server->reg(extent_protocol::alloc, es, &extent_server::alloc);
+  return es;
+}
+
+double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+check(bool ok, const char *what)
+{
+  if (!ok) {
+    fprintf(stderr, "error: %s\n", what);
+    exit(1);
+  }
+}
+
+// ranged reads and writes must agree with a whole-content model of the file
+void
+test_ranges(extent_client *ec)
+{
+  printf("ranged read/write/resize\n");
+  extent_protocol::extentid_t eid = 0x80000001ULL;
+  const unsigned int bs = extent_protocol::blocksize;
+  std::string model;
+
+  check(ec->put(eid, "") == extent_protocol::OK, "put");
+  for (int i = 0; i < 200; i++) {
+    unsigned long long off = random() % (6 * bs);
+    std::string buf(random() % (2 * bs) + 1, 'a' + i % 26);
+    check(ec->write(eid, off, buf) == extent_protocol::OK, "write");
+    if (model.size() < off + buf.size())
+      model.resize(off + buf.size(), '\0');
+    model.replace(off, buf.size(), buf);
+    if (i % 7 == 0) {
+      unsigned long long size = random() % (7 * bs);
+      check(ec->resize(eid, size) == extent_protocol::OK, "resize");
+      model.resize(size, '\0');
+    }
+    if (i % 13 == 0)
+      check(ec->flush(eid) == extent_protocol::OK, "flush");
+
+    std::string got;
+    unsigned long long off2 = random() % (7 * bs);
+    unsigned int len = random() % (3 * bs);
+    check(ec->read(eid, off2, len, got) == extent_protocol::OK, "read");
+    std::string want = off2 < model.size() ? model.substr(off2, len) : "";
+    check(got == want, "read returned wrong data");
+  }
+
+  // appends of all sizes, mostly back to back so they collect in the tail
+  for (int i = 0; i < 400; i++) {
+    std::string buf(random() % 3 ? random() % 600 + 1 : random() % (3 * bs) + 1, 'A' + i % 26);
+    check(ec->write(eid, model.size(), buf) == extent_protocol::OK, "append");
+    model += buf;
+    if (i % 17 == 0) {
+      unsigned long long size = model.size() - random() % (model.size() / 4 + 1);
+      check(ec->resize(eid, size) == extent_protocol::OK, "resize");
+      model.resize(size);
+    }
+    if (i % 29 == 0)
+      check(ec->flush(eid) == extent_protocol::OK, "flush");
+    if (i % 5 == 0) {
+      std::string got;
+      unsigned long long off2 = model.size() - random() % (model.size() + 1);
+      check(ec->read(eid, off2, 2 * bs, got) == extent_protocol::OK, "read");
+      check(got == model.substr(off2, 2 * bs), "read after append returned wrong data");
+    }
+  }
+  check(ec->flush(eid) == extent_protocol::OK, "flush");
+
+  std::string whole;
+  check(ec->get(eid, whole) == extent_protocol::OK, "get");
+  check(whole == model, "server copy differs after flush");
+  check(ec->remove(eid) == extent_protocol::OK, "remove");
+  check(ec->flush(eid) == extent_protocol::OK, "flush");
+  printf("  ok\n");
+}
+
+// write files of growing size in 4 KB chunks; the time per MB should stay flat
+void
+bench_seqwrite(extent_client *ec)
+{
+  printf("sequential 4 KB writes\n");
+  printf("  %8s %10s %12s %12s\n", "MB", "seconds", "us/write", "MB/s");
+  std::string chunk(4096, 'x');
+  for (unsigned int mb = 1; mb <= 64; mb *= 2) {
+    extent_protocol::extentid_t eid = 0x80000000ULL | (0x100 + mb);
+    unsigned long long size = (unsigned long long) mb << 20;
+    ec->put(eid, "");
+    ec->flush(eid);
+
+    double start = now();
+    for (unsigned long long off = 0; off < size; off += chunk.size())
+      check(ec->write(eid, off, chunk) == extent_protocol::OK, "write");
+    check(ec->flush(eid) == extent_protocol::OK, "flush");
+    double elapsed = now() - start;
+
+    extent_protocol::attr a;
+    check(ec->getattr(eid, a) == extent_protocol::OK && a.size == size, "size after flush");
+    printf("  %8u %10.3f %12.2f %12.1f\n", mb, elapsed,
+           elapsed * 1e6 / (size / chunk.size()), mb / elapsed);
+
+    ec->remove(eid);
+    ec->flush(eid);
+  }
+}
+
+void
+check_store(extent_store *st, std::map<extent_protocol::extentid_t, std::string> &model,
+            extent_protocol::extentid_t max_id)
+{
+  for (extent_protocol::extentid_t id = 2; id < max_id; id++) {
+    extent_protocol::attr a;
+    shared_buf got;
+    if (!model.count(id)) {
+      check(st->getattr(id, a) == extent_protocol::NOENT, "removed extent came back");
+      continue;
+    }
+    check(st->getattr(id, a) == extent_protocol::OK, "extent lost");
+    check(st->read(id, 0, a.size, got, time(NULL)) == extent_protocol::OK, "read");
+    check(got.str() == model[id], "extent content differs");
+  }
+}
+
+// overwrite, truncate and remove until most of the log is garbage, then
+// compaction must shrink it without changing what recovery sees
+void
+test_compaction()
+{
+  printf("log compaction and recovery\n");
+  std::string dir = tmpdir + "/compact";
+  extent_store *st = new extent_store(dir, false, 1 << 20);
+  std::map<extent_protocol::extentid_t, std::string> model;
+  const extent_protocol::extentid_t n = 1000;
+
+  for (int round = 0; round < 4; round++) {
+    for (extent_protocol::extentid_t id = 2; id < n; id++) {
+      if (round > 0 && random() % 4 == 0)
+        continue;
+      std::string data(random() % 9000, 'a' + (id + round) % 26);
+      check(st->put(id, data, time(NULL)) == extent_protocol::OK, "put");
+      model[id] = data;
+      if (random() % 5 == 0) {
+        unsigned long long size = random() % 9000;
+        check(st->resize(id, size, time(NULL)) == extent_protocol::OK, "resize");
+        model[id].resize(size, '\0');
+      }
+      if (random() % 3 == 0) {
+        std::string more(random() % 5000, 'A' + round);
+        unsigned long long off = random() % 10000;
+        check(st->write(id, off, more, time(NULL)) == extent_protocol::OK, "write");
+        if (model[id].size() < off + more.size())
+          model[id].resize(off + more.size(), '\0');
+        model[id].replace(off, more.size(), more);
+      }
+    }
+  }
+  for (extent_protocol::extentid_t id = 2; id < n; id += 7) {
+    check(st->remove(id) == extent_protocol::OK, "remove");
+    model.erase(id);
+  }
+
+  extent_store::stats before, after;
+  st->get_stats(before);
+  while (st->compact())
+    ;
+  st->get_stats(after);
+  printf("  %u segments %llu bytes -> %u segments %llu bytes (%llu live)\n",
+         before.segments, before.disk_bytes, after.segments, after.disk_bytes,
+         after.live_bytes);
+  check(after.disk_bytes < before.disk_bytes, "compaction reclaimed nothing");
+  check_store(st, model, n);
+
+  delete st;
+  st = new extent_store(dir, false, 1 << 20);
+  check_store(st, model, n);
+  delete st;
+  printf("  ok\n");
+}
+
+// put throughput and the time to rebuild the index on restart
+void
+bench_store()
+{
+  printf("log-structured store, 4 KB puts\n");
+  printf("  %8s %10s %10s %12s %10s\n", "extents", "puts/s", "MB/s", "recovery ms", "segments");
+  std::string data(4096, 'x');
+  for (unsigned int n = 1000; n <= 256000; n *= 4) {
+    std::ostringstream ost;
+    ost << tmpdir << "/store" << n;
+    extent_store *st = new extent_store(ost.str());
+
+    double start = now();
+    for (unsigned int i = 0; i < n; i++) {
+      memcpy(&data[0], &i, sizeof(i));
+      check(st->put(i + 2, data, time(NULL)) == extent_protocol::OK, "put");
+    }
+    double elapsed = now() - start;
+    delete st;
+
+    start = now();
+    st = new extent_store(ost.str());
+    double recovery = now() - start;
+
+    extent_store::stats stats;
+    st->get_stats(stats);
+    check(stats.extents == n, "extents lost in recovery");
+    shared_buf got;
+    unsigned int probe = random() % n;
+    check(st->read(probe + 2, 0, data.size(), got, time(NULL)) == extent_protocol::OK, "read");
+    check(memcmp(got.data(), &probe, sizeof(probe)) == 0, "wrong content after recovery");
+    delete st;
+
+    printf("  %8u %10.0f %10.1f %12.1f %10u\n", n, n / elapsed,
+           n * data.size() / elapsed / (1 << 20), recovery * 1000, stats.segments);
+  }
+}
+
+struct reader_arg {
+  unsigned int seed;
+  unsigned int nextents;
+  unsigned long long ops;
+  double stop;
+};
+
+static void *
+reader(void *x)
+{
+  reader_arg *arg = (reader_arg *) x;
+  unsigned long long ops = 0;
+  shared_buf buf;
+  extent_protocol::attr a;
+  while ((ops & 255) || now() < arg->stop) {
+    extent_protocol::extentid_t id = 0x80000000ULL | (rand_r(&arg->seed) % arg->nextents);
+    // mostly stats, as in ls -l or a build checking timestamps
+    if (ops % 4 == 0)
+      check(es->get(id, buf) == extent_protocol::OK, "get");
+    else
+      check(es->getattr(id, a) == extent_protocol::OK, "getattr");
+    ops++;
+  }
+  arg->ops = ops;
+  return 0;
+}
+
+// get/getattr throughput with many server threads calling the handlers
+// directly, as the rpcs thread pool does. it should grow with the cores.
+void
+bench_parallel()
+{
+  const unsigned int nextents = 10000;
+  printf("parallel get/getattr on %u extents, %ld cores\n", nextents,
+         sysconf(_SC_NPROCESSORS_ONLN));
+  printf("  %8s %12s %10s\n", "threads", "ops/s", "speedup");
+  std::string data(4096, 'r');
+  int r;
+  for (unsigned int i = 0; i < nextents; i++)
+    check(es->put(0x80000000ULL | i, data, r) == extent_protocol::OK, "put");
+
+  double base = 0;
+  for (unsigned int n = 1; n <= 16; n *= 2) {
+    std::vector<pthread_t> th(n);
+    std::vector<reader_arg> args(n);
+    double start = now();
+    for (unsigned int i = 0; i < n; i++) {
+      args[i].seed = random();
+      args[i].nextents = nextents;
+      args[i].stop = start + 1;
+      check(pthread_create(&th[i], NULL, reader, &args[i]) == 0, "pthread_create");
+    }
+    unsigned long long ops = 0;
+    for (unsigned int i = 0; i < n; i++) {
+      pthread_join(th[i], NULL);
+      ops += args[i].ops;
+    }
+    double rate = ops / (now() - start);
+    if (n == 1)
+      base = rate;
+    printf("  %8u %12.0f %10.2f\n", n, rate, rate / base);
+  }
+
+  for (unsigned int i = 0; i < nextents; i++)
+    es->remove(0x80000000ULL | i, r);
+}
+
+// whole-extent gets over the loopback rpc, first with every payload copied
+// into the marshall buffer, then with large ones spliced in by writev
+void
+bench_getcopy()
+{
+  printf("rpc get throughput and payload bytes copied per byte read\n");
+  printf("  %8s %8s %10s %12s\n", "KB", "splice", "MB/s", "copies/byte");
+  sockaddr_in dstsock;
+  make_sockaddr(dst.c_str(), &dstsock);
+  rpcc *cl = new rpcc(dstsock);
+  check(cl->bind() == 0, "bind");
+
+  unsigned int saved = rpc_splice_min;
+  for (unsigned int kb = 64; kb <= 8192; kb *= 8) {
+    extent_protocol::extentid_t eid = 0x80000000ULL | (0x200 + kb);
+    int r;
+    check(es->put(eid, std::string(kb << 10, 'g'), r) == extent_protocol::OK, "put");
+    for (int splice = 0; splice < 2; splice++) {
+      rpc_splice_min = splice ? saved : ~0U;
+      unsigned long long copied = rpc_bytes_copied;
+      unsigned long long bytes = 0;
+      double start = now();
+      while (now() - start < 1) {
+        std::string buf;
+        check(cl->call(extent_protocol::get, eid, buf) == extent_protocol::OK, "get");
+        check(buf.size() == (kb << 10), "short get");
+        bytes += buf.size();
+      }
+      double elapsed = now() - start;
+      printf("  %8u %8s %10.1f %12.2f\n", kb, splice ? "yes" : "no",
+             bytes / elapsed / (1 << 20), (double) (rpc_bytes_copied - copied) / bytes);
+    }
+    es->remove(eid, r);
+  }
+  rpc_splice_min = saved;
+  delete cl;
+}
+
+unsigned int
+count_extents(extent_server *s)
+{
+  std::vector<extent_protocol::extentid_t> ids;
+  unsigned int n = 0;
+  for (unsigned int b = 0; s->list(b, ids) == extent_protocol::OK; b++)
+    for (size_t i = 0; i < ids.size(); i++)
+      n += ids[i] != 1;
+  return n;
+}
+
+std::string
+shard_content(extent_protocol::extentid_t eid)
+{
+  std::ostringstream ost;
+  ost << "extent " << eid << " ";
+  return std::string(eid % 5000, 'z') + ost.str();
+}
+
+// extents spread over two servers, then a third one is added while the
+// data is being read. only the extents the new server owns may move.
+void
+test_sharding()
+{
+  printf("sharding over extent servers\n");
+  const unsigned int n = 3000;
+  extent_server *s[3];
+  rpcs *listeners[3];
+  std::ostringstream names;
+  for (int i = 0; i < 3; i++) {
+    std::ostringstream dir;
+    dir << tmpdir << "/shard" << i;
+    s[i] = start_server(bench_port(7) + i, dir.str(), &listeners[i]);
+    if (i < 2)
+      names << (i ? "," : "") << "127.0.0.1:" << bench_port(7) + i;
+  }
+  std::ostringstream third;
+  third << "127.0.0.1:" << bench_port(7) + 2;
+
+  extent_client *c = new extent_client(names.str());
+  for (unsigned int i = 0; i < n; i++) {
+    extent_protocol::extentid_t eid = 0x80000000ULL | i;
+    check(c->put(eid, shard_content(eid)) == extent_protocol::OK, "put");
+    check(c->flush(eid) == extent_protocol::OK, "flush");
+  }
+  unsigned int before[3], after[3];
+  for (int i = 0; i < 3; i++)
+    before[i] = count_extents(s[i]);
+  check(before[0] + before[1] == n, "extents missing before rebalance");
+
+  double start = now();
+  c->add_server(third.str());
+  unsigned int steps = 0;
+  bool more = true;
+  while (more) {
+    more = c->rebalance(100);
+    steps++;
+    // reads in between find extents wherever they are
+    for (int k = 0; k < 20; k++) {
+      extent_protocol::extentid_t eid = 0x80000000ULL | (random() % n);
+      std::string buf;
+      check(c->get(eid, buf) == extent_protocol::OK, "get during rebalance");
+      check(buf == shard_content(eid), "wrong content during rebalance");
+      c->flush(eid);
+    }
+  }
+  double elapsed = now() - start;
+
+  for (int i = 0; i < 3; i++)
+    after[i] = count_extents(s[i]);
+  check(after[0] + after[1] + after[2] == n, "extents lost in rebalance");
+  check(after[0] <= before[0] && after[1] <= before[1], "extents moved between old servers");
+  for (unsigned int i = 0; i < n; i++) {
+    extent_protocol::extentid_t eid = 0x80000000ULL | i;
+    std::string buf;
+    check(c->get(eid, buf) == extent_protocol::OK, "get after rebalance");
+    check(buf == shard_content(eid), "wrong content after rebalance");
+    c->flush(eid);
+  }
+  printf("  before %u/%u, after %u/%u/%u: moved %u of %u (%.1f%%) in %u steps, %.2f s\n",
+         before[0], before[1], after[0], after[1], after[2], after[2], n,
+         100.0 * after[2] / n, steps, elapsed);
+  delete c;
+  for (int i = 0; i < 3; i++) {
+    delete listeners[i];
+    delete s[i];
+  }
+  printf("  ok\n");
+}
+
+// the same small extents written back, stat'ed and read one RPC per extent
+// and then with the multi-extent RPCs
+void
+bench_batch()
+{
+  printf("batched multi-extent RPCs\n");
+  const unsigned int n = 2000;
+  std::vector<extent_protocol::extentid_t> eids;
+  for (unsigned int i = 0; i < n; i++)
+    eids.push_back(0x80000000ULL | (100000 + i));
+
+  for (int batched = 0; batched < 2; batched++) {
+    extent_client *c = new extent_client(dst);
+    double t0 = now();
+    for (unsigned int i = 0; i < n; i++)
+      check(c->put(eids[i], shard_content(eids[i])) == extent_protocol::OK, "put");
+    if (batched) {
+      check(c->flush(eids) == extent_protocol::OK, "flush");
+    } else {
+      for (unsigned int i = 0; i < n; i++)
+        check(c->flush(eids[i]) == extent_protocol::OK, "flush");
+    }
+    double t1 = now();
+
+    // a fresh client starts cold
+    delete c;
+    c = new extent_client(dst);
+    std::map<extent_protocol::extentid_t, extent_protocol::attr> attrs;
+    if (batched) {
+      check(c->getattr(eids, attrs) == extent_protocol::OK, "getattr");
+    } else {
+      for (unsigned int i = 0; i < n; i++)
+        check(c->getattr(eids[i], attrs[eids[i]]) == extent_protocol::OK, "getattr");
+    }
+    double t2 = now();
+    check(attrs.size() == n, "attributes missing");
+
+    delete c;
+    c = new extent_client(dst);
+    std::map<extent_protocol::extentid_t, std::string> bufs;
+    if (batched) {
+      check(c->get(eids, bufs) == extent_protocol::OK, "get");
+    } else {
+      for (unsigned int i = 0; i < n; i++)
+        check(c->get(eids[i], bufs[eids[i]]) == extent_protocol::OK, "get");
+    }
+    double t3 = now();
+    check(bufs.size() == n, "extents missing");
+    for (unsigned int i = 0; i < n; i++) {
+      check(attrs[eids[i]].size == shard_content(eids[i]).size(), "wrong size");
+      check(bufs[eids[i]] == shard_content(eids[i]), "wrong content");
+    }
+
+    for (unsigned int i = 0; i < n; i++)
+      check(c->remove(eids[i]) == extent_protocol::OK, "remove");
+    check(c->flush(eids) == extent_protocol::OK, "flush removes");
+    double t4 = now();
+    delete c;
+
+    printf("  %s: %u extents, put+flush %.1f ms, cold getattr %.1f ms, "
+           "cold get %.1f ms, remove+flush %.1f ms\n",
+           batched ? "batched" : "single ", n, (t1 - t0) * 1000,
+           (t2 - t1) * 1000, (t3 - t2) * 1000, (t4 - t3) * 1000);
+  }
+  extent_protocol::attr a;
+  check(es->getattr(eids[0], a) == extent_protocol::NOENT, "extent not removed");
+  printf("  ok\n");
+}
+
+// cold "ls -l" of a big directory: the listing plus the attributes of every
+// entry, and a cold read of every file. the old client fetched attributes
+// and content with separate getattr and read calls, replayed here on a raw
+// rpcc; extent_client now gets both with one readattr.
+void
+bench_coldls()
+{
+  printf("cold ls -l and cat of a 10000 entry directory\n");
+  const unsigned int n = 10000;
+  const extent_protocol::extentid_t dir = 0x300000;
+  std::vector<extent_protocol::extentid_t> files;
+  std::ostringstream listing;
+  int r;
+  for (unsigned int i = 0; i < n; i++) {
+    extent_protocol::extentid_t eid = 0x80000000ULL | (0x300000 + i);
+    files.push_back(eid);
+    listing << eid << ":file" << i << "\n";
+    check(es->put(eid, shard_content(eid), r) == extent_protocol::OK, "put");
+  }
+  check(es->put(dir, listing.str(), r) == extent_protocol::OK, "put dir");
+
+  sockaddr_in dstsock;
+  make_sockaddr(dst.c_str(), &dstsock);
+  rpcc *cl = new rpcc(dstsock);
+  check(cl->bind() == 0, "bind");
+
+  for (int combined = 0; combined < 2; combined++) {
+    extent_client *c = new extent_client(dst);
+    std::string buf;
+    extent_protocol::attr a;
+    double t0 = now();
+    if (combined) {
+      check(c->get(dir, buf) == extent_protocol::OK, "get dir");
+    } else {
+      check(cl->call(extent_protocol::getattr, dir, a) == extent_protocol::OK, "getattr dir");
+      check(cl->call(extent_protocol::read, dir, 0ULL, a.size, buf) == extent_protocol::OK, "read dir");
+    }
+    check(buf == listing.str(), "wrong listing");
+    for (unsigned int i = 0; i < n; i++) {
+      if (combined)
+        check(c->getattr(files[i], a) == extent_protocol::OK, "getattr");
+      else
+        check(cl->call(extent_protocol::getattr, files[i], a) == extent_protocol::OK, "getattr");
+    }
+    double t1 = now();
+
+    delete c;
+    c = new extent_client(dst);
+    double t2 = now();
+    for (unsigned int i = 0; i < n; i++) {
+      if (combined) {
+        check(c->get(files[i], buf) == extent_protocol::OK, "get");
+      } else {
+        check(cl->call(extent_protocol::getattr, files[i], a) == extent_protocol::OK, "getattr");
+        check(cl->call(extent_protocol::read, files[i], 0ULL, a.size, buf) == extent_protocol::OK, "read");
+      }
+      check(buf == shard_content(files[i]), "wrong content");
+    }
+    double t3 = now();
+    delete c;
+
+    printf("  %s: ls -l %.1f ms (%u round trips), cat * %.1f ms (%u round trips)\n",
+           combined ? "readattr     " : "getattr+read ", (t1 - t0) * 1000,
+           n + 2 - combined, (t3 - t2) * 1000, combined ? n : 2 * n);
+  }
+  delete cl;
+
+  for (unsigned int i = 0; i < n; i++)
+    es->remove(files[i], r);
+  es->remove(dir, r);
+  printf("  ok\n");
+}
+
+// two clients take turns on the same files, each releasing its locks
+// (flushing) at the end of its turn. the reader keeps what it cached and
+// revalidates it; the writer changes a tenth of the files per turn.
+void
+bench_retention()
+{
+  printf("cache retention across lock release\n");
+  const unsigned int n = 1000, rounds = 5;
+  std::vector<extent_protocol::extentid_t> eids;
+  int r;
+  for (unsigned int i = 0; i < n; i++)
+    eids.push_back(0x80000000ULL | (0x400000 + i));
+
+  for (int keep = 0; keep < 2; keep++) {
+    extent_client *reader = new extent_client(dst);
+    extent_client *writer = new extent_client(dst);
+    std::map<extent_protocol::extentid_t, std::string> model;
+    for (unsigned int i = 0; i < n; i++) {
+      model[eids[i]] = shard_content(eids[i]);
+      check(es->put(eids[i], model[eids[i]], r) == extent_protocol::OK, "put");
+    }
+    double busy = 0;
+    for (unsigned int round = 0; round < rounds; round++) {
+      // without retention the reader starts from an empty cache, the same
+      // as when flush discarded every entry
+      if (!keep) {
+        delete reader;
+        reader = new extent_client(dst);
+      }
+      double t0 = now();
+      for (unsigned int i = 0; i < n; i++) {
+        std::string buf;
+        check(reader->get(eids[i], buf) == extent_protocol::OK, "get");
+        check(buf == model[eids[i]], "stale content");
+        reader->flush(eids[i]);
+      }
+      busy += now() - t0;
+
+      for (unsigned int i = round; i < n; i += 10) {
+        std::ostringstream ost;
+        ost << "round " << round;
+        check(writer->write(eids[i], 0, ost.str()) == extent_protocol::OK, "write");
+        model[eids[i]].replace(0, ost.str().size(), ost.str());
+        writer->flush(eids[i]);
+      }
+    }
+    extent_client::stats st;
+    reader->get_stats(st);
+    printf("  %s: %u rounds of %u gets, %.1f ms per round, %llu of %llu revalidations hit (%.1f%%)\n",
+           keep ? "kept     " : "discarded", rounds, n, busy / rounds * 1000,
+           st.revalidation_hits, st.revalidations,
+           st.revalidations ? 100.0 * st.revalidation_hits / st.revalidations : 0.0);
+    delete reader;
+    delete writer;
+  }
+
+  for (unsigned int i = 0; i < n; i++)
+    es->remove(eids[i], r);
+  printf("  ok\n");
+}
+
+// create with the old text directory format: decode everything, scan it
+// for the name, append and encode everything again
+static void
+text_create(extent_client *c, extent_protocol::extentid_t dir, const std::string &name,
+            extent_protocol::extentid_t inum)
+{
+  std::string text;
+  check(c->get(dir, text) == extent_protocol::OK, "get dir");
+  std::vector<yfs_dir::entry> entries;
+  std::istringstream ist(text);
+  std::string line;
+  while (std::getline(ist, line)) {
+    size_t colon = line.find(':');
+    yfs_dir::entry e;
+    std::istringstream(line.substr(0, colon)) >> e.inum;
+    e.name = line.substr(colon + 1);
+    check(e.name != name, "name exists");
+    entries.push_back(e);
+  }
+  entries.push_back(yfs_dir::entry(name, inum));
+  std::ostringstream ost;
+  for (size_t i = 0; i < entries.size(); i++)
+    ost << entries[i].inum << ":" << entries[i].name << "\n";
+  check(c->put(dir, ost.str()) == extent_protocol::OK, "put dir");
+}
+
+// a directory's attributes, once the clock has passed its times, so that
+// a change to it has to move them
+static void
+dir_times(extent_client *c, extent_protocol::extentid_t dir, extent_protocol::attr &a)
+{
+  check(c->getattr(dir, a) == extent_protocol::OK, "getattr dir");
+  while (time(nullptr) <= (time_t) a.mtime || time(nullptr) <= (time_t) a.ctime)
+    usleep(10 * 1000);
+}
+
+// create 100k names in one directory, each an insert of a new name as
+// yfs_client::create does, and write the directory back every 1000 creates as a lock
+// revocation would. reports the mean create latency as the directory grows,
+// for the hashed format and, up to 10k entries, the old text format.
+void
+bench_bigdir()
+{
+  printf("creates in one growing directory\n");
+  const unsigned int n = 100000, text_max = 10000;
+  const unsigned int marks[] = { 1000, 2000, 5000, 10000, 20000, 50000, 100000 };
+  printf("  %8s %14s %14s %14s %14s\n", "entries", "text us/op", "hashed us/op",
+         "flush ms/1000", "lookup us/op");
+  // lookups run right after a write-back, so they refetch the blocks they touch
+
+  extent_client *c = new extent_client(dst);
+  const extent_protocol::extentid_t text_dir = 0x500000, hashed_dir = 0x500001;
+  check(c->put(text_dir, "") == extent_protocol::OK, "put");
+  check(c->put(hashed_dir, "") == extent_protocol::OK, "put");
+  yfs_dir dir(c, hashed_dir);
+
+  unsigned int done = 0;
+  for (size_t m = 0; m < sizeof(marks) / sizeof(marks[0]); m++) {
+    unsigned int from = done;
+    double text_time = 0;
+    if (marks[m] <= text_max) {
+      double t0 = now();
+      for (unsigned int i = from; i < marks[m]; i++) {
+        std::ostringstream name;
+        name << "file" << i;
+        text_create(c, text_dir, name.str(), 0x80000000ULL | i);
+        if (i % 1000 == 999)
+          c->flush(text_dir);
+      }
+      text_time = now() - t0;
+    }
+
+    double t0 = now(), flush_time = 0;
+    for (unsigned int i = from; i < marks[m]; i++) {
+      std::ostringstream name;
+      name << "file" << i;
+      extent_protocol::extentid_t inum = 0x80000000ULL | i;
+      check(dir.insert(name.str(), inum) == extent_protocol::OK, "insert");
+      check(inum == (0x80000000ULL | i), "name exists");
+      if (i % 1000 == 999) {
+        double f0 = now();
+        c->flush(hashed_dir);
+        flush_time += now() - f0;
+      }
+    }
+    double hashed_time = now() - t0;
+
+    t0 = now();
+    const unsigned int lookups = 1000;
+    for (unsigned int k = 0; k < lookups; k++) {
+      unsigned int i = random() % marks[m];
+      std::ostringstream name;
+      name << "file" << i;
+      extent_protocol::extentid_t inum;
+      check(dir.lookup(name.str(), inum) == extent_protocol::OK, "lookup");
+      check(inum == (0x80000000ULL | i), "wrong inum");
+    }
+    double lookup_time = now() - t0;
+    done = marks[m];
+
+    char text_us[32] = "-";
+    if (marks[m] <= text_max)
+      snprintf(text_us, sizeof(text_us), "%.1f", text_time / (done - from) * 1e6);
+    printf("  %8u %14s %14.1f %14.2f %14.1f\n", done, text_us,
+           hashed_time / (done - from) * 1e6, flush_time / (done - from) * 1e6,
+           lookup_time / lookups * 1e6);
+  }
+
+  // a create and a remove that only change a bucket extent still move
+  // the directory's times. bench_inplace checks the same for buckets the
+  // server changes.
+  extent_protocol::attr before, after;
+  extent_protocol::extentid_t extra = 0x80000000ULL | n;
+  yfs_dir::in_place = false;
+  dir_times(c, hashed_dir, before);
+  check(dir.insert("extra", extra) == extent_protocol::OK, "insert");
+  check(c->getattr(hashed_dir, after) == extent_protocol::OK, "getattr dir");
+  check(after.mtime > before.mtime && after.ctime > before.ctime,
+        "create left the directory's times");
+  dir_times(c, hashed_dir, before);
+  check(dir.remove("extra", extra) == extent_protocol::OK, "remove");
+  check(c->getattr(hashed_dir, after) == extent_protocol::OK, "getattr dir");
+  check(after.mtime > before.mtime && after.ctime > before.ctime,
+        "remove left the directory's times");
+  yfs_dir::in_place = true;
+
+  // another client sees everything once the directory is written back,
+  // and its removals are seen by the first one after it flushes
+  check(c->flush(hashed_dir) == extent_protocol::OK, "flush");
+  extent_client *c2 = new extent_client(dst);
+  check(c2->getattr(hashed_dir, before) == extent_protocol::OK && before.mtime >= after.mtime,
+        "directory times not written back");
+  yfs_dir dir2(c2, hashed_dir);
+  std::vector<yfs_dir::entry> entries;
+  double t0 = now();
+  check(dir2.list(entries) == extent_protocol::OK, "list");
+  printf("  cold listing of %u entries: %.1f ms\n", n, (now() - t0) * 1000);
+  check(entries.size() == n, "entries missing");
+  for (unsigned int i = 0; i < n; i += 2) {
+    std::ostringstream name;
+    name << "file" << i;
+    extent_protocol::extentid_t inum;
+    check(dir2.remove(name.str(), inum) == extent_protocol::OK, "remove");
+    check(inum == (0x80000000ULL | i), "wrong inum removed");
+  }
+  check(c2->flush(hashed_dir) == extent_protocol::OK, "flush");
+  delete c2;
+  check(dir.list(entries) == extent_protocol::OK, "list");
+  check(entries.size() == n / 2, "wrong count after remove");
+  for (unsigned int i = 0; i < n; i++) {
+    std::ostringstream name;
+    name << "file" << i;
+    extent_protocol::extentid_t inum;
+    check(dir.lookup(name.str(), inum) == (i % 2 ? extent_protocol::OK : extent_protocol::NOENT),
+          "lookup after remove");
+  }
+
+  // a directory in the old format converts on first use
+  yfs_dir old(c, text_dir);
+  extent_protocol::extentid_t inum;
+  check(old.lookup("file1234", inum) == extent_protocol::OK && inum == (0x80000000ULL | 1234),
+        "text directory lookup");
+  check(old.list(entries) == extent_protocol::OK && entries.size() == text_max, "text directory list");
+
+  c->remove(text_dir);
+  c->remove(hashed_dir);
+  c->flush(text_dir);
+  c->flush(hashed_dir);
+  delete c;
+  printf("  ok\n");
+}
+
+// a client that does not hold the directory cached adds, looks up and
+// removes names in a directory of 20k entries, writing it back every 10
+// operations as if the lock kept moving between clients, the way an untar
+// into a shared directory goes. compares fetching the buckets with having
+// the server change them in place. bytes count both directions, the server
+// runs in this process.
+void
+bench_inplace()
+{
+  printf("entry operations on a directory the client has not cached\n");
+  const unsigned int n = 20000, ops = 2000, per_lock = 10;
+  printf("  %8s %10s %14s %14s\n", "mode", "op", "us/op", "bytes/op");
+
+  for (int mode = 0; mode < 2; mode++) {
+    yfs_dir::in_place = mode;
+    const extent_protocol::extentid_t dirid = 0x600000 + mode;
+    extent_client *c = new extent_client(dst);
+    check(c->put(dirid, "") == extent_protocol::OK, "put");
+    yfs_dir dir(c, dirid);
+    for (unsigned int i = 0; i < n; i++) {
+      std::ostringstream name;
+      name << "file" << i;
+      check(dir.add(name.str(), 0x80000000ULL | i) == extent_protocol::OK, "add");
+    }
+    check(c->flush(dirid) == extent_protocol::OK, "flush");
+    delete c;
+
+    extent_client *c2 = new extent_client(dst);
+    yfs_dir dir2(c2, dirid);
+    const char *what[] = { "create", "lookup", "remove" };
+    for (int op = 0; op < 3; op++) {
+      unsigned long long bytes0 = rpc_bytes_sent.load();
+      double t0 = now();
+      for (unsigned int i = 0; i < ops; i++) {
+        std::ostringstream name;
+        name << "new" << i;
+        extent_protocol::extentid_t inum;
+        if (op == 0) {
+          inum = 0x90000000ULL | i;
+          check(dir2.insert(name.str(), inum) == extent_protocol::OK, "insert");
+          check(inum == (0x90000000ULL | i), "name exists");
+        } else if (op == 1) {
+          check(dir2.lookup(name.str(), inum) == extent_protocol::OK, "lookup");
+          check(inum == (0x90000000ULL | i), "wrong inum");
+        } else {
+          check(dir2.remove(name.str(), inum) == extent_protocol::OK, "remove");
+          check(inum == (0x90000000ULL | i), "wrong inum removed");
+        }
+        if (i % per_lock == per_lock - 1)
+          check(c2->flush(dirid) == extent_protocol::OK, "flush");
+      }
+      double t = now() - t0;
+      printf("  %8s %10s %14.1f %14llu\n", mode ? "in place" : "fetch", what[op],
+             t / ops * 1e6, (rpc_bytes_sent.load() - bytes0) / ops);
+    }
+
+    // the directory's times move either way
+    extent_protocol::attr before, after;
+    extent_protocol::extentid_t extra = 0x90000000ULL | ops;
+    dir_times(c2, dirid, before);
+    check(dir2.insert("extra", extra) == extent_protocol::OK, "insert");
+    check(c2->getattr(dirid, after) == extent_protocol::OK, "getattr dir");
+    check(after.mtime > before.mtime && after.ctime > before.ctime,
+          "create left the directory's times");
+    dir_times(c2, dirid, before);
+    check(dir2.remove("extra", extra) == extent_protocol::OK, "remove");
+    check(c2->getattr(dirid, after) == extent_protocol::OK, "getattr dir");
+    check(after.mtime > before.mtime && after.ctime > before.ctime,
+          "remove left the directory's times");
+
+    // nothing lost either way
+    std::vector<yfs_dir::entry> entries;
+    check(dir2.list(entries) == extent_protocol::OK, "list");
+    check(entries.size() == n, "wrong count");
+    check(dir2.destroy() == extent_protocol::OK, "destroy");
+    c2->remove(dirid);
+    c2->flush(dirid);
+    delete c2;
+  }
+  yfs_dir::in_place = true;
+  printf("  ok\n");
+}
+
+// two clients allocating ids the way creates do. every id must be new,
+// bit 31 stays clear for the file flag, and the ids of one client are
+// dense. the allocator must not repeat itself across a server restart.
+void
+bench_alloc()
+{
+  printf("id allocation\n");
+  const unsigned int n = 100000;
+  extent_client *c[2] = { new extent_client(dst), new extent_client(dst) };
+  std::set<extent_protocol::extentid_t> ids;
+  extent_protocol::extentid_t lo[2] = { ~0ULL, ~0ULL }, hi[2] = { 0, 0 };
+  double t0 = now();
+  for (unsigned int i = 0; i < 2 * n; i++) {
+    extent_protocol::extentid_t id;
+    check(c[i % 2]->alloc(id) == extent_protocol::OK, "alloc");
+    check(!(id & 0x80000000ULL), "bit 31 set");
+    check(id > 1, "reserved id");
+    check(ids.insert(id).second, "id handed out twice");
+    lo[i % 2] = std::min(lo[i % 2], id);
+    hi[i % 2] = std::max(hi[i % 2], id);
+  }
+  double t = now() - t0;
+  for (int k = 0; k < 2; k++) {
+    extent_client::stats st;
+    c[k]->get_stats(st);
+    printf("  client %d: %u ids in [%llu, %llu], %llu allocator RPCs, %.2f us/id\n",
+           k, n, lo[k], hi[k], st.alloc_rpcs, t / (2 * n) * 1e6);
+    delete c[k];
+  }
+
+  std::string dir = tmpdir + "/alloc";
+  unsigned long long first, again;
+  extent_server *s = new extent_server(dir);
+  check(s->alloc(10, first) == extent_protocol::OK, "alloc");
+  delete s;
+  s = new extent_server(dir);
+  check(s->alloc(10, again) == extent_protocol::OK && again == first + 10, "alloc after restart");
+  delete s;
+  printf("  ok\n");
+}
+
+// ls -l of a 10000 entry directory by a client that has nothing cached:
+// the listing, then a lookup and a getattr per entry as fuse sends them,
+// against the listing plus the attributes in batches as readdirplus does.
+// in yfs_client each per-entry getattr also takes the inode's lock, which
+// this leaves out.
+void
+bench_lsl()
+{
+  printf("cold ls -l of a 10000 entry directory\n");
+  const unsigned int n = 10000;
+  extent_client *c = new extent_client(dst);
+  extent_protocol::extentid_t dirid;
+  check(c->alloc(dirid) == extent_protocol::OK, "alloc");
+  check(c->put(dirid, "") == extent_protocol::OK, "put");
+  yfs_dir dir(c, dirid);
+  std::vector<extent_protocol::extentid_t> owners(1, dirid);
+  for (unsigned int i = 0; i < n; i++) {
+    extent_protocol::extentid_t inum;
+    check(c->alloc(inum) == extent_protocol::OK, "alloc");
+    inum |= 0x80000000ULL;
+    std::ostringstream name;
+    name << "file" << i;
+    check(c->put(inum, std::string(i % 100, 'x')) == extent_protocol::OK, "put");
+    check(dir.add(name.str(), inum) == extent_protocol::OK, "add");
+    owners.push_back(inum);
+  }
+  check(c->flush(owners) == extent_protocol::OK, "flush");
+  delete c;
+
+  for (int plus = 0; plus < 2; plus++) {
+    c = new extent_client(dst);
+    yfs_dir cold(c, dirid);
+    unsigned long long bytes0 = rpc_bytes_sent.load();
+    double t0 = now();
+    std::vector<yfs_dir::entry> entries;
+    check(cold.list(entries) == extent_protocol::OK, "list");
+    check(entries.size() == n, "wrong count");
+    unsigned long long total = 0;
+    if (plus) {
+      std::vector<extent_protocol::extentid_t> eids;
+      for (size_t i = 0; i < entries.size(); i++)
+        eids.push_back(entries[i].inum);
+      std::map<extent_protocol::extentid_t, extent_protocol::attr> attrs;
+      check(c->peek_attrs(eids, attrs) == extent_protocol::OK, "peek_attrs");
+      check(attrs.size() == n, "attributes missing");
+      for (auto &a : attrs)
+        total += a.second.size;
+    } else {
+      for (size_t i = 0; i < entries.size(); i++) {
+        extent_protocol::extentid_t inum;
+        extent_protocol::attr a;
+        check(cold.lookup(entries[i].name, inum) == extent_protocol::OK, "lookup");
+        check(c->getattr(inum, a) == extent_protocol::OK, "getattr");
+        total += a.size;
+      }
+    }
+    double t = now() - t0;
+    check(total == (unsigned long long) (n / 100) * 4950, "wrong sizes");
+    printf("  %s: %.1f ms, %llu KB sent\n", plus ? "readdirplus        " : "lookup+getattr each",
+           t * 1000, (rpc_bytes_sent.load() - bytes0) / 1024);
+    delete c;
+  }
+
+  c = new extent_client(dst);
+  yfs_dir d(c, dirid);
+  for (size_t i = 1; i < owners.size(); i++)
+    c->remove(owners[i]);
+  check(d.destroy() == extent_protocol::OK, "destroy");
+  c->remove(dirid);
+  check(c->flush(owners) == extent_protocol::OK, "flush");
+  delete c;
+  printf("  ok\n");
+}
+
+struct cat_arg {
+  extent_client *c;
+  const std::vector<extent_protocol::extentid_t> *files;
+  unsigned int first, step;
+  unsigned long long bytes;
+};
+
+static void *
+cat_files(void *x)
+{
+  cat_arg *a = (cat_arg *) x;
+  for (size_t i = a->first; i < a->files->size(); i += a->step) {
+    std::string buf;
+    check(a->c->get((*a->files)[i], buf) == extent_protocol::OK, "get");
+    a->bytes += buf.size();
+  }
+  return NULL;
+}
+
+// the reads of es behind a link with a fixed round trip delay, counted
+struct slow_link {
+  unsigned int delay_us;
+  std::atomic<unsigned int> calls;
+  // content sent back
+  std::atomic<unsigned long long> bytes;
+  int readattr(extent_protocol::extentid_t id, unsigned long long off, unsigned int size,
+               extent_protocol::extent &x) {
+    calls++;
+    usleep(delay_us);
+    int ret = es->readattr(id, off, size, x);
+    bytes += x.data.size();
+    return ret;
+  }
+  int read(extent_protocol::extentid_t id, unsigned long long off, unsigned int size,
+           shared_buf &buf) {
+    calls++;
+    usleep(delay_us);
+    int ret = es->read(id, off, size, buf);
+    bytes += buf.size();
+    return ret;
+  }
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a) {
+    calls++;
+    usleep(delay_us);
+    return es->getattr(id, a);
+  }
+  int get_if_changed(extent_protocol::extentid_t id, unsigned long long version,
+                     extent_protocol::extent &x) {
+    calls++;
+    usleep(delay_us);
+    int ret = es->get_if_changed(id, version, x);
+    bytes += x.data.size();
+    return ret;
+  }
+  int multigetattr(std::vector<extent_protocol::extentid_t> ids,
+                   std::map<extent_protocol::extentid_t, extent_protocol::attr> &attrs) {
+    calls++;
+    usleep(delay_us);
+    return es->multigetattr(ids, attrs);
+  }
+  int multiget(std::vector<extent_protocol::extentid_t> ids,
+               std::map<extent_protocol::extentid_t, shared_buf> &bufs) {
+    calls++;
+    usleep(delay_us);
+    int ret = es->multiget(ids, bufs);
+    for (auto &b : bufs)
+      bytes += b.second.size();
+    return ret;
+  }
+};
+
+// cat of 2000 files of 64 KB by threads sharing one cold client, the way
+// the fuse workers share yfs_client. each thread reads its own files, as
+// under their own locks. the server answers after 1 ms, so a single
+// thread spends most of its time waiting on round trips.
+void
+bench_parallel_cat()
+{
+  const unsigned int n = 2000, size = 64 << 10;
+  printf("parallel cat of %u files of %u KB through one client, 1 ms round trips\n",
+         n, size >> 10);
+  printf("  %8s %12s %10s\n", "threads", "MB/s", "speedup");
+  rpcs *link = new rpcs(bench_port(15));
+  slow_link sl = { 1000 };
+  link->reg(extent_protocol::readattr, &sl, &slow_link::readattr);
+  link->reg(extent_protocol::read, &sl, &slow_link::read);
+  std::ostringstream slow_dst;
+  slow_dst << "127.0.0.1:" << bench_port(15);
+  std::vector<extent_protocol::extentid_t> files;
+  int r;
+  for (unsigned int i = 0; i < n; i++) {
+    files.push_back(0x80000000ULL | (0x700000 + i));
+    check(es->put(files.back(), std::string(size, 'a' + i % 26), r) == extent_protocol::OK, "put");
+  }
+
+  double base = 0;
+  for (unsigned int t = 1; t <= 8; t *= 2) {
+    extent_client *c = new extent_client(slow_dst.str());
+    std::vector<pthread_t> th(t);
+    std::vector<cat_arg> args(t);
+    double start = now();
+    for (unsigned int i = 0; i < t; i++) {
+      args[i].c = c;
+      args[i].files = &files;
+      args[i].first = i;
+      args[i].step = t;
+      args[i].bytes = 0;
+      check(pthread_create(&th[i], NULL, cat_files, &args[i]) == 0, "pthread_create");
+    }
+    unsigned long long bytes = 0;
+    for (unsigned int i = 0; i < t; i++) {
+      pthread_join(th[i], NULL);
+      bytes += args[i].bytes;
+    }
+    double rate = bytes / (now() - start) / (1 << 20);
+    check(bytes == (unsigned long long) n * size, "short read");
+    if (t == 1)
+      base = rate;
+    printf("  %8u %12.1f %10.2f\n", t, rate, rate / base);
+    delete c;
+  }
+
+  delete link;
+  for (unsigned int i = 0; i < n; i++)
+    es->remove(files[i], r);
+  printf("  ok\n");
+}
+
+static double
+cpu_seconds()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+    + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// large sequential reads the way fuse serves them, 128 KB at a time and
+// handed to the kernel with one writev (here to /dev/null): copied out of
+// the cache into a string, or as slices of the cached blocks.
+void
+bench_bigread()
+{
+  const unsigned int size = 64 << 20, chunk = 128 << 10, passes = 8;
+  printf("sequential read of a %u MB file in %u KB requests\n", size >> 20, chunk >> 10);
+  printf("  %-8s %-6s %10s %12s\n", "path", "cache", "GB/s", "cpu s/GB");
+  extent_protocol::extentid_t eid = 0x80000000ULL | 0x800000;
+  std::string content(size, 0);
+  for (unsigned int i = 0; i < size; i++)
+    content[i] = 'a' + (i / 4093 + i) % 26;
+  int r;
+  check(es->put(eid, content, r) == extent_protocol::OK, "put");
+  int null = open("/dev/null", O_WRONLY);
+  check(null >= 0, "open /dev/null");
+
+  for (int zero_copy = 0; zero_copy < 2; zero_copy++) {
+    extent_client *c = new extent_client(dst);
+    for (int warm = 0; warm < 2; warm++) {
+      unsigned int n = warm ? passes : 1;
+      unsigned long long bytes = 0;
+      double start = now(), cpu = cpu_seconds();
+      for (unsigned int p = 0; p < n; p++) {
+        for (unsigned int off = 0; off < size; off += chunk) {
+          std::vector<struct iovec> iov;
+          std::string buf;
+          std::vector<shared_buf> bufs;
+          if (zero_copy) {
+            check(c->read(eid, off, chunk, bufs) == extent_protocol::OK, "read");
+            iov.resize(bufs.size());
+            for (size_t i = 0; i < bufs.size(); i++) {
+              iov[i].iov_base = (void *) bufs[i].data();
+              iov[i].iov_len = bufs[i].size();
+            }
+          } else {
+            check(c->read(eid, off, chunk, buf) == extent_protocol::OK, "read");
+            iov.resize(1);
+            iov[0].iov_base = (void *) buf.data();
+            iov[0].iov_len = buf.size();
+          }
+          ssize_t w = writev(null, &iov[0], iov.size());
+          check(w == (ssize_t) chunk, "short read");
+          if (p == 0 && !warm) {
+            for (size_t i = 0, at = off; i < iov.size(); at += iov[i].iov_len, i++)
+              check(memcmp(iov[i].iov_base, content.data() + at, iov[i].iov_len) == 0, "content");
+          }
+          bytes += w;
+        }
+      }
+      double gb = bytes / (double) (1 << 30);
+      printf("  %-8s %-6s %10.2f %12.3f\n", zero_copy ? "slices" : "copy", warm ? "warm" : "cold",
+             gb / (now() - start), (cpu_seconds() - cpu) / gb);
+    }
+    delete c;
+  }
+
+  close(null);
+  es->remove(eid, r);
+  printf("  ok\n");
+}
+
+// appending a file the way a cp through fuse does, in requests of various
+// sizes. small unaligned appends should not cost a block copy each.
+void
+bench_append()
+{
+  const unsigned int size = 64 << 20;
+  const unsigned int sizes[] = { 512, 1000, 4096, 128 << 10 };
+  printf("appending a %u MB file, written back at the end\n", size >> 20);
+  printf("  %8s %12s %12s %12s %12s\n", "write", "us/write", "flush ms", "MB/s", "cpu s/GB");
+  extent_client *c = new extent_client(dst);
+  for (unsigned int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    extent_protocol::extentid_t eid = 0x80000000ULL | (0x900000 + k);
+    std::string chunk(sizes[k], 'a' + k);
+    check(c->put(eid, "") == extent_protocol::OK, "put");
+    check(c->flush(eid) == extent_protocol::OK, "flush");
+
+    unsigned long long off = 0, writes = 0;
+    double start = now(), cpu = cpu_seconds();
+    for (; off < size; off += chunk.size(), writes++)
+      check(c->write(eid, off, chunk) == extent_protocol::OK, "write");
+    double written = now();
+    check(c->flush(eid) == extent_protocol::OK, "flush");
+    double elapsed = now() - start;
+    double gb = off / (double) (1 << 30);
+    printf("  %8u %12.2f %12.1f %12.1f %12.3f\n", sizes[k], (written - start) * 1e6 / writes,
+           (now() - written) * 1e3, off / elapsed / (1 << 20), (cpu_seconds() - cpu) / gb);
+
+    extent_protocol::attr a;
+    shared_buf got;
+    check(es->getattr(eid, a) == extent_protocol::OK && a.size == off, "size after flush");
+    check(es->read(eid, off - 3000, 3000, got) == extent_protocol::OK
+          && got.str() == std::string(3000, 'a' + k), "content after flush");
+    c->remove(eid);
+    c->flush(eid);
+  }
+  delete c;
+  printf("  ok\n");
+}
+
+// a client reading and writing more than its cache budget: what stays
+// resident, how often lookups hit, and that evicted dirty extents reach
+// the server intact
+void
+bench_budget()
+{
+  const unsigned int n = 2000, size = 64 << 10;
+  const size_t budget = 16 << 20;
+  printf("%u files of %u KB through a client with a %zu MB budget\n",
+         n, size >> 10, budget >> 20);
+  printf("  %-22s %10s %10s %12s %10s %10s\n", "phase", "ms", "hit rate",
+         "resident MB", "evicted", "written");
+  extent_client *c = new extent_client(dst);
+  c->set_budget(budget);
+  std::vector<extent_protocol::extentid_t> files;
+  for (unsigned int i = 0; i < n; i++)
+    files.push_back(0x80000000ULL | (0xa00000 + i));
+
+  extent_client::stats last;
+  c->get_stats(last);
+  size_t max_resident = 0;
+  for (int phase = 0; phase < 4; phase++) {
+    // write everything, read everything, then twice over a working set
+    // that fits
+    const char *names[] = { "write all", "read all", "read 1/10, first time", "read 1/10, again" };
+    unsigned int count = phase < 2 ? n : n / 10;
+    double start = now();
+    for (unsigned int i = 0; i < count; i++) {
+      if (phase == 0) {
+        check(c->put(files[i], std::string(size, 'a' + i % 26)) == extent_protocol::OK, "put");
+      } else {
+        std::string buf;
+        check(c->read(files[i], 0, size, buf) == extent_protocol::OK, "read");
+        check(buf == std::string(size, 'a' + i % 26), "content after eviction");
+      }
+      extent_client::stats st;
+      c->get_stats(st);
+      max_resident = std::max(max_resident, st.resident_bytes);
+    }
+    double elapsed = now() - start;
+    extent_client::stats st;
+    c->get_stats(st);
+    unsigned long long lookups = st.hits + st.misses - last.hits - last.misses;
+    char rate[32] = "-";
+    if (lookups)
+      snprintf(rate, sizeof(rate), "%.1f%%", 100.0 * (st.hits - last.hits) / lookups);
+    printf("  %-22s %10.1f %10s %12.1f %10llu %10llu\n", names[phase], elapsed * 1e3, rate,
+           st.resident_bytes / (double) (1 << 20), st.evictions - last.evictions,
+           st.dirty_evictions - last.dirty_evictions);
+    last = st;
+  }
+  check(max_resident <= budget + size + 4096, "cache grew past its budget");
+  check(c->flush(files) == extent_protocol::OK, "flush");
+  for (unsigned int i = 0; i < n; i++) {
+    shared_buf got;
+    check(es->read(files[i], 0, size, got) == extent_protocol::OK
+          && got.str() == std::string(size, 'a' + i % 26), "server copy after eviction");
+    c->remove(files[i]);
+  }
+  c->flush(files);
+  delete c;
+  printf("  most resident: %.1f MB\n", max_resident / (double) (1 << 20));
+  printf("  ok\n");
+}
+
+// how long a lock release takes to flush a big file written just before,
+// with and without the background flushers
+void
+bench_writeback()
+{
+  const unsigned int size = 64 << 20, chunk = 128 << 10;
+  printf("release of a %u MB file written in %u KB requests\n", size >> 20, chunk >> 10);
+  printf("  %-28s %10s %10s %12s %12s\n", "write-back", "write ms", "idle ms",
+         "release ms", "background");
+  struct { const char *name; double age; size_t bytes; double idle; } modes[] = {
+    { "at release only", 1e9, (size_t) -1, 0 },
+    { "by dirty bytes (8 MB)", 1e9, 8 << 20, 0 },
+    { "by age (0.2 s), idle 1 s", 0.2, (size_t) -1, 1 },
+  };
+  std::string data(chunk, 0);
+  for (unsigned int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    extent_client *c = new extent_client(dst);
+    c->set_writeback(modes[m].age, modes[m].bytes);
+    extent_protocol::extentid_t eid = 0x80000000ULL | (0xb00000 + m);
+    check(c->put(eid, "") == extent_protocol::OK, "put");
+
+    double start = now();
+    for (unsigned int off = 0; off < size; off += chunk) {
+      memset(&data[0], 'a' + (off / chunk + m) % 26, chunk);
+      check(c->write(eid, off, data) == extent_protocol::OK, "write");
+    }
+    double written = now();
+    usleep(modes[m].idle * 1e6);
+    double release = now();
+    check(c->flush(eid) == extent_protocol::OK, "flush");
+    double done = now();
+
+    extent_client::stats st;
+    c->get_stats(st);
+    printf("  %-28s %10.1f %10.1f %12.1f %12llu\n", modes[m].name, (written - start) * 1e3,
+           (release - written) * 1e3, (done - release) * 1e3, st.background_writebacks);
+
+    for (unsigned int off = 0; off < size; off += 16 * chunk) {
+      shared_buf got;
+      check(es->read(eid, off, chunk, got) == extent_protocol::OK
+            && got.str() == std::string(chunk, 'a' + (off / chunk + m) % 26), "server copy");
+    }
+    c->remove(eid);
+    c->flush(eid);
+    delete c;
+  }
+  printf("  ok\n");
+}
+
+struct mixed_arg {
+  extent_client *c;
+  // taken around every call to stand for a client with one big lock
+  pthread_mutex_t *big_lock;
+  const std::vector<extent_protocol::extentid_t> *hot, *cold;
+  unsigned int seed;
+  unsigned int ops, miss_pct;
+  // the cold extents this thread reads, so each is a miss
+  unsigned int first, step;
+  unsigned int size;
+  std::vector<double> hit_us;
+};
+
+static void *
+mixed_reads(void *x)
+{
+  mixed_arg *a = (mixed_arg *) x;
+  unsigned int next_cold = a->first;
+  for (unsigned int i = 0; i < a->ops; i++) {
+    bool miss = (unsigned int) (rand_r(&a->seed) % 100) < a->miss_pct
+      && next_cold < a->cold->size();
+    extent_protocol::extentid_t eid;
+    if (miss) {
+      eid = (*a->cold)[next_cold];
+      next_cold += a->step;
+    } else {
+      eid = (*a->hot)[rand_r(&a->seed) % a->hot->size()];
+    }
+    std::string buf;
+    double start = now();
+    if (a->big_lock)
+      pthread_mutex_lock(a->big_lock);
+    check(a->c->read(eid, 0, a->size, buf) == extent_protocol::OK && buf.size() == a->size, "read");
+    if (a->big_lock)
+      pthread_mutex_unlock(a->big_lock);
+    if (!miss)
+      a->hit_us.push_back((now() - start) * 1e6);
+  }
+  return NULL;
+}
+
+struct same_arg {
+  extent_client *c;
+  const std::vector<extent_protocol::extentid_t> *files;
+  unsigned int size;
+};
+
+static void *
+same_reads(void *x)
+{
+  same_arg *a = (same_arg *) x;
+  for (size_t i = 0; i < a->files->size(); i++) {
+    std::string buf;
+    check(a->c->read((*a->files)[i], 0, a->size, buf) == extent_protocol::OK
+          && buf.size() == a->size, "read");
+  }
+  return NULL;
+}
+
+// threads sharing one client, most reads hitting warm extents and the
+// rest missing on cold ones behind 1 ms round trips. hits should not wait
+// for the misses' RPCs, as they do with one lock around the whole client.
+// then threads reading the same cold extents at once, which should cost
+// one fetch per extent however many threads miss on it.
+void
+bench_contention()
+{
+  const unsigned int nhot = 64, ncold = 4000, size = 4096, ops = 2000, miss_pct = 10;
+  printf("threads reading %u B through one client, %u%% misses behind 1 ms round trips\n",
+         size, miss_pct);
+  printf("  %-20s %8s %8s %12s %12s %12s\n", "client", "threads", "misses", "reads/s",
+         "hit avg us", "hit p99 us");
+  rpcs *link = new rpcs(bench_port(20));
+  slow_link sl = { 1000 };
+  link->reg(extent_protocol::readattr, &sl, &slow_link::readattr);
+  link->reg(extent_protocol::read, &sl, &slow_link::read);
+  std::ostringstream slow_dst;
+  slow_dst << "127.0.0.1:" << bench_port(20);
+  std::vector<extent_protocol::extentid_t> hot, cold;
+  int r;
+  for (unsigned int i = 0; i < nhot + ncold; i++) {
+    extent_protocol::extentid_t eid = 0x80000000ULL | (0xc00000 + i);
+    (i < nhot ? hot : cold).push_back(eid);
+    check(es->put(eid, std::string(size, 'a' + i % 26), r) == extent_protocol::OK, "put");
+  }
+
+  pthread_mutex_t big_lock;
+  pthread_mutex_init(&big_lock, NULL);
+  for (int locked = 0; locked < 2; locked++) {
+    for (unsigned int t = 1; t <= 8; t *= 2) {
+      for (unsigned int pct = 0; pct <= miss_pct; pct += miss_pct) {
+        if (pct == 0 && t != 8)
+          continue;
+        extent_client *c = new extent_client(slow_dst.str());
+        for (unsigned int i = 0; i < nhot; i++) {
+          std::string buf;
+          check(c->read(hot[i], 0, size, buf) == extent_protocol::OK, "warm");
+        }
+        std::vector<pthread_t> th(t);
+        std::vector<mixed_arg> args(t);
+        double start = now();
+        for (unsigned int i = 0; i < t; i++) {
+          args[i].c = c;
+          args[i].big_lock = locked ? &big_lock : NULL;
+          args[i].hot = &hot;
+          args[i].cold = &cold;
+          args[i].seed = random();
+          args[i].ops = ops;
+          args[i].miss_pct = pct;
+          args[i].first = i;
+          args[i].step = t;
+          args[i].size = size;
+          check(pthread_create(&th[i], NULL, mixed_reads, &args[i]) == 0, "pthread_create");
+        }
+        std::vector<double> hit_us;
+        for (unsigned int i = 0; i < t; i++) {
+          pthread_join(th[i], NULL);
+          hit_us.insert(hit_us.end(), args[i].hit_us.begin(), args[i].hit_us.end());
+        }
+        double elapsed = now() - start;
+        std::sort(hit_us.begin(), hit_us.end());
+        double sum = 0;
+        for (size_t i = 0; i < hit_us.size(); i++)
+          sum += hit_us[i];
+        printf("  %-20s %8u %7u%% %12.0f %12.1f %12.1f\n",
+               locked ? "one lock around it" : "as is", t, pct, t * ops / elapsed,
+               sum / hit_us.size(), hit_us[hit_us.size() * 99 / 100]);
+        delete c;
+      }
+    }
+  }
+
+  const unsigned int nsame = 20, same_size = 256 << 10, same_threads = 8;
+  std::vector<extent_protocol::extentid_t> same;
+  for (unsigned int i = 0; i < nsame; i++) {
+    same.push_back(0x80000000ULL | (0xc00000 + nhot + ncold + i));
+    check(es->put(same.back(), std::string(same_size, 'a' + i % 26), r) == extent_protocol::OK, "put");
+  }
+  extent_client *c = new extent_client(slow_dst.str());
+  unsigned int calls = sl.calls;
+  std::vector<pthread_t> th(same_threads);
+  std::vector<same_arg> args(same_threads);
+  double start = now();
+  for (unsigned int i = 0; i < same_threads; i++) {
+    args[i].c = c;
+    args[i].files = &same;
+    args[i].size = same_size;
+    check(pthread_create(&th[i], NULL, same_reads, &args[i]) == 0, "pthread_create");
+  }
+  for (unsigned int i = 0; i < same_threads; i++)
+    pthread_join(th[i], NULL);
+  double elapsed = now() - start;
+  extent_client::stats st;
+  c->get_stats(st);
+  calls = sl.calls - calls;
+  printf("  %u threads reading the same %u files of %u KB: %.1f ms, %u RPCs, %llu shared fetches\n",
+         same_threads, nsame, same_size >> 10, elapsed * 1e3, calls, st.shared_fetches);
+  check(calls == nsame, "concurrent misses were not shared");
+  delete c;
+
+  for (unsigned int i = 0; i < hot.size(); i++)
+    es->remove(hot[i], r);
+  for (unsigned int i = 0; i < cold.size(); i++)
+    es->remove(cold[i], r);
+  for (unsigned int i = 0; i < same.size(); i++)
+    es->remove(same[i], r);
+  delete link;
+  printf("  ok\n");
+}
+
+// a client restarted over files that mostly did not change, behind 1 ms
+// round trips: cold, then picking up the disk tier the client before it
+// left. a tenth of the files change on the server between runs.
+void
+bench_diskcache()
+{
+  const unsigned int n = 500, size = 64 << 10;
+  printf("restart over %u files of %u KB, 1 ms round trips\n", n, size >> 10);
+  printf("  %-28s %10s %8s %10s %10s %12s\n", "client", "ms", "RPCs", "MB sent",
+         "disk reads", "revalidated");
+  rpcs *link = new rpcs(bench_port(21));
+  slow_link sl = { 1000 };
+  link->reg(extent_protocol::readattr, &sl, &slow_link::readattr);
+  link->reg(extent_protocol::read, &sl, &slow_link::read);
+  link->reg(extent_protocol::getattr, &sl, &slow_link::getattr);
+  link->reg(extent_protocol::get_if_changed, &sl, &slow_link::get_if_changed);
+  link->reg(extent_protocol::multigetattr, &sl, &slow_link::multigetattr);
+  link->reg(extent_protocol::multiget, &sl, &slow_link::multiget);
+  std::ostringstream slow_dst;
+  slow_dst << "127.0.0.1:" << bench_port(21);
+  std::string dir = tmpdir + "/diskcache";
+
+  std::vector<extent_protocol::extentid_t> files;
+  std::vector<unsigned int> gen(n, 0);
+  int r;
+  for (unsigned int i = 0; i < n; i++) {
+    files.push_back(0x80000000ULL | (0xd00000 + i));
+    check(es->put(files[i], std::string(size, 'a' + i % 26), r) == extent_protocol::OK, "put");
+  }
+
+  // files read one by one as cat does, or in one batched get
+  struct { const char *name; bool disk; bool batched; } runs[] = {
+    { "cold, one by one", false, false },
+    { "cold, batched", false, true },
+    { "cold, filling the disk tier", true, false },
+    { "restart, one by one", true, false },
+    { "restart, batched", true, true },
+  };
+  for (unsigned int run = 0; run < sizeof(runs) / sizeof(runs[0]); run++) {
+    if (run >= 3) {
+      for (unsigned int i = run; i < n; i += 10) {
+        gen[i]++;
+        check(es->put(files[i], std::string(size, 'a' + (i + gen[i]) % 26), r)
+              == extent_protocol::OK, "put");
+      }
+    }
+    extent_client *c = new extent_client(slow_dst.str());
+    if (runs[run].disk)
+      c->set_disk_cache(dir, 1 << 30);
+    unsigned int calls = sl.calls;
+    unsigned long long bytes = sl.bytes;
+    double start = now();
+    if (!runs[run].batched) {
+      for (unsigned int i = 0; i < n; i++) {
+        std::string buf;
+        check(c->read(files[i], 0, size, buf) == extent_protocol::OK
+              && buf == std::string(size, 'a' + (i + gen[i]) % 26), "content");
+      }
+    } else {
+      std::map<extent_protocol::extentid_t, std::string> bufs;
+      check(c->get(files, bufs) == extent_protocol::OK && bufs.size() == n, "get");
+      for (unsigned int i = 0; i < n; i++)
+        check(bufs[files[i]] == std::string(size, 'a' + (i + gen[i]) % 26), "content");
+    }
+    double elapsed = now() - start;
+    extent_client::stats st;
+    c->get_stats(st);
+    printf("  %-28s %10.1f %8u %10.1f %10llu %7llu/%llu\n", runs[run].name, elapsed * 1e3,
+           sl.calls - calls, (sl.bytes - bytes) / (double) (1 << 20), st.disk_reads,
+           st.revalidation_hits, st.revalidations);
+    // the release, and unmounting
+    check(c->flush(files) == extent_protocol::OK, "flush");
+    delete c;
+  }
+
+  delete link;
+  for (unsigned int i = 0; i < n; i++)
+    es->remove(files[i], r);
+  printf("  ok\n");
+}
+
+// a lock server for the yfs_client tests. it speaks what lock_client_cache
+// sends through rsm_client: members, and acquire and release wrapped in
+// invoke, the client named by the address of its revoke and retry
+// listener. lock_server_cache in this tree still expects subscribe and
+// numeric client ids, so it cannot serve these clients.
+//
+// a lock held by one client and wanted by another is revoked from the
+// holder; its release sends a retry to the first one waiting, which then
+// asks again. revokes and retries go out from a thread of their own.
+struct bench_lock_server {
+  struct lock {
+    std::string holder;
+    unsigned int seq;
+    bool revoked;
+    std::list<std::pair<std::string, unsigned int> > waiting;
+    lock() : seq(0), revoked(false) {}
+  };
+  struct message {
+    unsigned int proc;
+    std::string to;
+    lock_protocol::lockid_t lid;
+    unsigned int seq;
+  };
+
+  std::string dst;
+  pthread_mutex_t m;
+  std::map<lock_protocol::lockid_t, lock> locks;
+  std::map<std::string, rpcc *> clients;
+  events_queue<message> outbox;
+
+  void send(unsigned int proc, const std::string &to, lock_protocol::lockid_t lid,
+            unsigned int seq) {
+    message msg = { proc, to, lid, seq };
+    outbox.add(msg);
+  }
+  void sender() {
+    while (true) {
+      message msg = outbox.consume();
+      if (!clients.count(msg.to)) {
+        sockaddr_in sin;
+        make_sockaddr(msg.to.c_str(), &sin);
+        clients[msg.to] = new rpcc(sin);
+        check(clients[msg.to]->bind() == 0, "bind to lock client");
+      }
+      int r;
+      clients[msg.to]->call(msg.proc, msg.lid, msg.seq, r);
+    }
+  }
+
+  int acquire(const std::string &id, lock_protocol::lockid_t lid, unsigned int seq) {
+    ScopedLock ml(&m);
+    lock &l = locks[lid];
+    if (l.holder.empty() || l.holder == id) {
+      l.holder = id;
+      l.seq = seq;
+      l.revoked = !l.waiting.empty();
+      if (l.revoked)
+        send(rlock_protocol::revoke, id, lid, seq);
+      return lock_protocol::OK;
+    }
+    l.waiting.push_back(std::make_pair(id, seq));
+    if (!l.revoked) {
+      l.revoked = true;
+      send(rlock_protocol::revoke, l.holder, lid, l.seq);
+    }
+    return lock_protocol::RETRY;
+  }
+  int release(lock_protocol::lockid_t lid) {
+    ScopedLock ml(&m);
+    lock &l = locks[lid];
+    l.holder.clear();
+    l.revoked = false;
+    if (!l.waiting.empty()) {
+      send(rlock_protocol::retry, l.waiting.front().first, lid, l.waiting.front().second);
+      l.waiting.pop_front();
+    }
+    return lock_protocol::OK;
+  }
+
+  int members(int, std::vector<std::string> &mems) {
+    mems.assign(1, dst);
+    return rsm_client_protocol::OK;
+  }
+  int invoke(int proc, std::string req, std::string &rep) {
+    unmarshall args(req);
+    std::string id;
+    lock_protocol::lockid_t lid;
+    unsigned int seq;
+    args >> id;
+    args >> lid;
+    args >> seq;
+    int ret = proc == lock_protocol::acquire ? acquire(id, lid, seq) : release(lid);
+    marshall r, res;
+    res << 0;
+    r << ret;
+    r << res.str();
+    rep = r.str();
+    return rsm_client_protocol::OK;
+  }
+};
+
+static void *
+lock_sender(void *x)
+{
+  ((bench_lock_server *) x)->sender();
+  return NULL;
+}
+
+// two yfs_clients on the bench's extent server and a bench_lock_server.
+// the first test that needs them starts them, the lock server on
+// bench_port(22), and they are kept for the rest.
+void
+yfs_pair(yfs_client *&a, yfs_client *&b)
+{
+  static yfs_client *pair[2];
+  if (!pair[0]) {
+    std::ostringstream ldst;
+    ldst << "127.0.0.1:" << bench_port(22);
+    bench_lock_server *ls = new bench_lock_server;
+    ls->dst = ldst.str();
+    pthread_mutex_init(&ls->m, NULL);
+    rpcs *server = new rpcs(bench_port(22));
+    server->reg(rsm_client_protocol::members, ls, &bench_lock_server::members);
+    server->reg(rsm_client_protocol::invoke, ls, &bench_lock_server::invoke);
+    pthread_t th;
+    check(pthread_create(&th, NULL, lock_sender, ls) == 0, "pthread_create");
+    for (int i = 0; i < 2; i++)
+      pair[i] = new yfs_client(dst, ldst.str());
+  }
+  a = pair[0];
+  b = pair[1];
+}
+
+// a file whose lock a has, as it is on the extent server
+static yfs_client::inum
+shared_file(yfs_client *a, yfs_client *b, yfs_client::inum dir, const char *name)
+{
+  yfs_client::inum f;
+  std::vector<shared_buf> data;
+  check(a->create(dir, name, 0, f) == yfs_client::OK, "create");
+  // taking the lock over writes a's copy back, taking it back leaves a with it
+  check(b->read(f, 0, 1, data) == yfs_client::OK, "read");
+  check(a->read(f, 0, 1, data) == yfs_client::OK, "read");
+  return f;
+}
+
+// getattr of a file whose lock the other client has. the size is changed
+// on the extent server behind both clients' backs, as a third client's
+// release would.
+void
+test_lease()
+{
+  printf("attribute leases\n");
+  yfs_client *a, *b;
+  yfs_pair(a, b);
+  yfs_client::inum dir;
+  check(a->create(1, "lease", 1, dir) == yfs_client::OK, "create dir");
+  yfs_client::inum f = shared_file(a, b, dir, "f");
+  yfs_client::fileinfo info;
+  yfs_client::stats st0, st;
+  std::vector<shared_buf> data;
+  int r;
+
+  // leased without the lock, and believed for the lease
+  b->set_lease(std::chrono::seconds(60));
+  b->get_stats(st0);
+  check(b->getfile(f, info) == yfs_client::OK && !info.under_lock && info.size == 0, "leased");
+  check(es->put(f, "12345", r) == extent_protocol::OK, "put");
+  check(b->getfile(f, info) == yfs_client::OK && !info.under_lock && info.size == 0,
+        "lease not believed");
+  b->get_stats(st);
+  check(st.unlocked_getattrs - st0.unlocked_getattrs == 2 && st.leases - st0.leases == 1,
+        "lease not cached");
+
+  // with the lock the lease is not used, and losing the lock drops it
+  check(b->read(f, 0, 1, data) == yfs_client::OK, "read");
+  check(b->getfile(f, info) == yfs_client::OK && info.under_lock && info.size == 5,
+        "lease used under the lock");
+  check(a->read(f, 0, 1, data) == yfs_client::OK, "read");
+  check(es->put(f, "1234567", r) == extent_protocol::OK, "put");
+  check(b->getfile(f, info) == yfs_client::OK && !info.under_lock && info.size == 7,
+        "lease kept past the revocation");
+
+  // a lease runs out
+  b->set_lease(std::chrono::milliseconds(200));
+  check(b->read(f, 0, 1, data) == yfs_client::OK, "read");
+  check(a->read(f, 0, 1, data) == yfs_client::OK, "read");
+  check(b->getfile(f, info) == yfs_client::OK && info.size == 7, "leased");
+  check(es->put(f, "123", r) == extent_protocol::OK, "put");
+  check(b->getfile(f, info) == yfs_client::OK && info.size == 7, "lease not believed");
+  usleep(300 * 1000);
+  check(b->getfile(f, info) == yfs_client::OK && !info.under_lock && info.size == 3,
+        "lease did not expire");
+
+  // no lease: the lock is taken
+  b->set_lease(std::chrono::milliseconds(0));
+  check(b->getfile(f, info) == yfs_client::OK && info.under_lock && info.size == 3,
+        "lock not taken without a lease");
+  b->set_lease(std::chrono::milliseconds(yfs_client::default_lease_ms));
+  printf("  ok\n");
+}
+
+// misses in a directory answered without looking in it, while it stays
+// right about names created here and by the other client
+void
+test_negative()
+{
+  printf("negative lookups and directory filters\n");
+  yfs_client *a, *b;
+  yfs_pair(a, b);
+  yfs_client::inum dir, inum, x;
+  yfs_client::stats st0, st;
+  // without dentries, so a's lookups after its creates go to the filter
+  a->set_dentry_limit(0);
+  check(a->create(1, "negative", 1, dir) == yfs_client::OK, "create dir");
+  for (unsigned int i = 0; i < 200; i++) {
+    std::ostringstream name;
+    name << "n" << i;
+    check(a->create(dir, name.str().c_str(), 0, inum) == yfs_client::OK, "create");
+  }
+
+  // a miss is remembered, and a create takes it back
+  check(a->lookup(dir, "x", inum) == yfs_client::NOENT, "lookup");
+  a->get_stats(st0);
+  check(a->lookup(dir, "x", inum) == yfs_client::NOENT, "lookup");
+  a->get_stats(st);
+  check(st.absent_hits - st0.absent_hits == 1 && st.dir_lookups == st0.dir_lookups,
+        "miss not remembered");
+  check(a->create(dir, "x", 0, x) == yfs_client::OK, "create");
+  check(a->lookup(dir, "x", inum) == yfs_client::OK && inum == x, "create left the miss");
+
+  // a listing gives the directory its filter. what it rejects is not
+  // looked up; its false positives are, and still find nothing
+  yfs_client::dirent_lst_t entries;
+  check(a->readdir(dir, entries) == yfs_client::OK, "readdir");
+  const unsigned int probes = 2000;
+  std::vector<std::string> rejected, looked;
+  for (unsigned int i = 0; i < probes; i++) {
+    std::ostringstream name;
+    name << "p" << i;
+    a->get_stats(st0);
+    check(a->lookup(dir, name.str().c_str(), inum) == yfs_client::NOENT, "probe found");
+    a->get_stats(st);
+    if (st.filter_hits > st0.filter_hits)
+      rejected.push_back(name.str());
+    else if (st.dir_lookups > st0.dir_lookups)
+      looked.push_back(name.str());
+  }
+  printf("  %u probes of %u names: %u rejected by the filter, %u false positives looked up\n",
+         probes, (unsigned int) entries.size(), (unsigned int) rejected.size(),
+         (unsigned int) looked.size());
+  check(rejected.size() + looked.size() == probes, "probe answered from elsewhere");
+  check(!looked.empty() && looked.size() < probes / 20, "filter not used");
+
+  // a create takes the name into the filter
+  check(a->create(dir, rejected[0].c_str(), 0, x) == yfs_client::OK, "create");
+  check(a->lookup(dir, rejected[0].c_str(), inum) == yfs_client::OK && inum == x,
+        "create left the name filtered");
+
+  // the other client's creates revoke the directory's lock, which drops
+  // the misses and the filter
+  yfs_client::inum y, z;
+  check(b->create(dir, rejected[1].c_str(), 0, y) == yfs_client::OK, "create");
+  check(b->create(dir, looked[0].c_str(), 0, z) == yfs_client::OK, "create");
+  check(a->lookup(dir, rejected[1].c_str(), inum) == yfs_client::OK && inum == y,
+        "filter kept past the revocation");
+  check(a->lookup(dir, looked[0].c_str(), inum) == yfs_client::OK && inum == z,
+        "miss kept past the revocation");
+  a->get_stats(st0);
+  check(a->lookup(dir, rejected[2].c_str(), inum) == yfs_client::NOENT, "lookup");
+  a->get_stats(st);
+  check(st.dir_lookups - st0.dir_lookups == 1, "filter kept past the revocation");
+
+  // a directory too large to list on every round trip of its lock gets no
+  // filter from its misses, which are still remembered one by one
+  yfs_client::inum big;
+  check(a->create(1, "negative-big", 1, big) == yfs_client::OK, "create dir");
+  const unsigned int nbig = 20000;
+  double t0 = now();
+  for (unsigned int i = 0; i < nbig; i++) {
+    std::ostringstream name;
+    name << "n" << i;
+    check(a->create(big, name.str().c_str(), 0, inum) == yfs_client::OK, "create");
+  }
+  printf("  %u creates: %.1f us/op\n", nbig, (now() - t0) / nbig * 1e6);
+  a->get_stats(st0);
+  // twice what a smaller directory takes to get its filter
+  const unsigned int misses = 16;
+  for (unsigned int i = 0; i < misses; i++) {
+    std::ostringstream name;
+    name << "q" << i;
+    check(a->lookup(big, name.str().c_str(), inum) == yfs_client::NOENT, "probe found");
+  }
+  check(a->lookup(big, "q0", inum) == yfs_client::NOENT, "probe found");
+  a->get_stats(st);
+  check(st.filter_hits == st0.filter_hits && st.dir_lookups - st0.dir_lookups == misses,
+        "large directory filtered");
+  check(st.absent_hits - st0.absent_hits == 1, "miss not remembered");
+  a->set_dentry_limit(65536);
+  printf("  ok\n");
+}
+
+// names looked up or created here answered from the dentry cache, while
+// unlinks here and the other client's changes, which revoke the
+// directory's lock, take them out
+void
+test_dentries()
+{
+  printf("dentry cache\n");
+  yfs_client *a, *b;
+  yfs_pair(a, b);
+  yfs_client::inum dir, inum, x, y;
+  yfs_client::stats st0, st;
+  check(a->create(1, "dentries", 1, dir) == yfs_client::OK, "create dir");
+
+  // a create leaves the name cached, and an unlink here takes it out
+  check(a->create(dir, "x", 0, x) == yfs_client::OK, "create");
+  a->get_stats(st0);
+  check(a->lookup(dir, "x", inum) == yfs_client::OK && inum == x, "lookup");
+  a->get_stats(st);
+  check(st.dentry_hits - st0.dentry_hits == 1 && st.dir_lookups == st0.dir_lookups,
+        "create not cached");
+  check(a->unlink(dir, "x") == yfs_client::OK, "unlink");
+  check(a->lookup(dir, "x", inum) == yfs_client::NOENT, "unlinked name cached");
+
+  // so does a lookup of the other client's create
+  check(b->create(dir, "y", 0, y) == yfs_client::OK, "create");
+  check(a->lookup(dir, "y", inum) == yfs_client::OK && inum == y, "lookup");
+  a->get_stats(st0);
+  check(a->lookup(dir, "y", inum) == yfs_client::OK && inum == y, "lookup");
+  a->get_stats(st);
+  check(st.dentry_hits - st0.dentry_hits == 1 && st.dir_lookups == st0.dir_lookups,
+        "lookup not cached");
+
+  // the other client's unlink revokes the directory's lock, and with it
+  // the names
+  check(b->unlink(dir, "y") == yfs_client::OK, "unlink");
+  check(a->lookup(dir, "y", inum) == yfs_client::NOENT, "name kept past the revocation");
+
+  // and so does its re-create of the name
+  check(a->create(dir, "z", 0, x) == yfs_client::OK, "create");
+  check(a->lookup(dir, "z", inum) == yfs_client::OK && inum == x, "lookup");
+  check(b->unlink(dir, "z") == yfs_client::OK, "unlink");
+  check(b->create(dir, "z", 0, y) == yfs_client::OK, "create");
+  check(y != x, "inum reused");
+  check(a->lookup(dir, "z", inum) == yfs_client::OK && inum == y,
+        "old inum kept past the revocation");
+
+  // a warm path is one dentry a component, and no directory lookups
+  const unsigned int depth = 8;
+  std::vector<yfs_client::inum> path(1, dir);
+  for (unsigned int i = 0; i < depth; i++) {
+    check(a->create(path.back(), "d", 1, inum) == yfs_client::OK, "create");
+    path.push_back(inum);
+  }
+  a->get_stats(st0);
+  yfs_client::inum at = dir;
+  for (unsigned int i = 0; i < depth; i++) {
+    check(a->lookup(at, "d", inum) == yfs_client::OK && inum == path[i + 1], "walk");
+    at = inum;
+  }
+  a->get_stats(st);
+  printf("  %u components: %llu dentry hits, %llu directory lookups\n", depth,
+         st.dentry_hits - st0.dentry_hits, st.dir_lookups - st0.dir_lookups);
+  check(st.dentry_hits - st0.dentry_hits == depth && st.dir_lookups == st0.dir_lookups,
+        "warm path looked up");
+  printf("  ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int bench = 0;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [bench]\n", argv[0]);
+    exit(1);
+  }
+  if (argc == 2)
+    bench = atoi(argv[1]);
+
+  srandom(getpid());
+  port = 20000 + (getpid() % 10000);
+  std::ostringstream ost;
+  ost << "127.0.0.1:" << port;
+  dst = ost.str();
+
+  char tmpl[] = "/tmp/extent_bench.XXXXXX";
+  check(mkdtemp(tmpl) != NULL, "mkdtemp");
+  tmpdir = tmpl;
+
+  es = start_server(port, tmpdir + "/server");
+
+  extent_client *ec = new extent_client(dst);
+
+  if (!bench || bench == 1)
+    test_ranges(ec);
+  if (!bench || bench == 2)
+    bench_seqwrite(ec);
+  if (!bench || bench == 3)
+    test_compaction();
+  if (!bench || bench == 4)
+    bench_store();
+  if (!bench || bench == 5)
+    bench_parallel();
+  if (!bench || bench == 6)
+    bench_getcopy();
+  if (!bench || bench == 7)
+    test_sharding();
+  if (!bench || bench == 8)
+    bench_batch();
+  if (!bench || bench == 9)
+    bench_coldls();
+  if (!bench || bench == 10)
+    bench_retention();
+  if (!bench || bench == 11)
+    bench_bigdir();
+  if (!bench || bench == 12)
+    bench_inplace();
+  if (!bench || bench == 13)
+    bench_alloc();
+  if (!bench || bench == 14)
+    bench_lsl();
+  if (!bench || bench == 15)
+    bench_parallel_cat();
+  if (!bench || bench == 16)
+    bench_bigread();
+  if (!bench || bench == 17)
+    bench_append();
+  if (!bench || bench == 18)
+    bench_budget();
+  if (!bench || bench == 19)
+    bench_writeback();
+  if (!bench || bench == 20)
+    bench_contention();
+  if (!bench || bench == 21)
+    bench_diskcache();
+  if (!bench || bench == 22)
+    test_lease();
+  if (!bench || bench == 23)
+    test_negative();
+  if (!bench || bench == 24)
+    test_dentries();
+
+  std::string rm = "rm -rf " + tmpdir;
+  if (system(rm.c_str()) != 0)
+    fprintf(stderr, "could not remove %s\n", tmpdir.c_str());
+
+  printf("%s: done\n", argv[0]);
+  return 0;
+}
@@ -1,144 +1,1357 @@
 // RPC stubs for clients to talk to extent_server
 
 #include "extent_client.h"
+#include "extent_store.h"
+#include "slock.h"
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <assert.h>
 
-// The calls assume that the caller holds a lock on the extent
+// The calls assume that the caller holds a lock on the extent. Threads
+// using different extents run concurrently; mutex_lock guards the cache
+// and the ring but is never held across an RPC. Threads reading the same
+// extent at once share a single fetch.
+
+// contiguous dirty blocks are written back in RPCs of at most this many blocks
+static const unsigned int flush_chunk_blocks = 64;
+// multi-extent RPCs carry at most this many ids or payload bytes
+static const size_t batch_ids = 4096;
+static const size_t batch_bytes = 4 << 20;
+// ids granted by the allocator at a time
+static const unsigned int alloc_block = 1024;
+// cache budget unless YFS_CACHE_MB says otherwise
+static const size_t default_budget = 256 << 20;
+// background write-back threads, and when they take a dirty entry
+static const unsigned int flusher_threads = 2;
+static const double default_writeback_age = 3;
+static const size_t default_writeback_bytes = 32 << 20;
+// disk tier size unless YFS_DISK_CACHE_MB says otherwise, and how much
+// content may wait for the flushers to save it
+static const size_t default_disk_budget = 1 << 30;
+static const size_t max_save_bytes = 64 << 20;
+// a saved extent starts with the server version of its content
+static const unsigned int disk_header = sizeof(unsigned long long);
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+flusherthread(void *x)
+{
+  extent_client *c = (extent_client *) x;
+  c->flusher();
+  return 0;
+}
 
 extent_client::extent_client(std::string dst)
+  : rebalancing(false), sweep_server(0), sweep_bucket(0), sweeping(false),
+    budget(default_budget), resident_bytes(0), hits(0), misses(0),
+    evictions(0), dirty_evictions(0), shared_fetches(0),
+    dirty_bytes(0), writeback_age(default_writeback_age),
+    writeback_bytes(default_writeback_bytes), stopping(false),
+    background_writebacks(0), writeback_retries(0),
+    revalidations(0), revalidation_hits(0),
+    next_serial(0), end_serial(0), alloc_rpcs(0), allocating(false),
+    disk(NULL), disk_budget(default_disk_budget), disk_bytes(0), save_bytes(0),
+    disk_reads(0), disk_saves(0)
 {
   pthread_mutex_init(&mutex_lock, NULL);
+  const char *mb = getenv("YFS_CACHE_MB");
+  if (mb && atoll(mb) > 0)
+    budget = (size_t) atoll(mb) << 20;
+  std::istringstream ist(dst);
+  std::string one;
+  while (std::getline(ist, one, ',')) {
+    if (one.empty() || servers.count(one))
+      continue;
+    servers[one] = connect(one);
+    ring.add(one);
+  }
+  assert(!ring.empty());
+  old_ring = ring;
+
+  const char *disk_dir = getenv("YFS_DISK_CACHE");
+  if (disk_dir && *disk_dir) {
+    size_t bytes = default_disk_budget;
+    const char *disk_mb = getenv("YFS_DISK_CACHE_MB");
+    if (disk_mb && atoll(disk_mb) > 0)
+      bytes = (size_t) atoll(disk_mb) << 20;
+    set_disk_cache(disk_dir, bytes);
+  }
+
+  pthread_cond_init(&flush_signal, NULL);
+  pthread_cond_init(&inflight_done, NULL);
+  flushers.resize(flusher_threads);
+  for (size_t i = 0; i < flushers.size(); i++) {
+    int r = pthread_create(&flushers[i], NULL, &flusherthread, (void *) this);
+    assert(r == 0);
+  }
+}
+
+extent_client::~extent_client()
+{
+  pthread_mutex_lock(&mutex_lock);
+  // what is clean stays on disk for the next client
+  for (auto &c : cache)
+    save(c.first, c.second);
+  stopping = true;
+  pthread_cond_broadcast(&flush_signal);
+  pthread_mutex_unlock(&mutex_lock);
+  for (size_t i = 0; i < flushers.size(); i++)
+    pthread_join(flushers[i], NULL);
+  delete disk;
+  for (auto &s : servers)
+    delete s.second;
+}
+
+rpcc *
+extent_client::connect(const std::string &dst)
+{
   sockaddr_in dstsock;
-	make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
+  make_sockaddr(dst.c_str(), &dstsock);
+  rpcc *cl = new rpcc(dstsock);
   if (cl->bind() != 0) {
-    printf("extent_client: bind failed\n");
+    printf("extent_client: bind to %s failed\n", dst.c_str());
   }
+  return cl;
 }
 
+rpcc *
+extent_client::server_for(extent_protocol::extentid_t eid)
+{
+  return servers[ring.owner(eid)];
+}
+
+// copy an extent with its times to its new server and drop the old copy.
+// nothing to do if the old server does not have it. the extent is listed
+// in moving meanwhile, and mutex_lock is dropped for the calls.
 extent_protocol::status
-extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
+extent_client::move(extent_protocol::extentid_t eid, rpcc *from, rpcc *to)
 {
-  pthread_mutex_lock(&mutex_lock);
-  
-  extent_protocol::status ret = extent_protocol::OK;
-  
-  // cache hit
-  if (data.find(eid) != data.end()) {
-    
-    // not to be removed
-    if(!to_be_removed[eid]){
-      buf = data[eid];
-    
-    // to be removed
-    } else {
-      ret = extent_protocol::NOENT;
+  moving.insert(eid);
+  extent_protocol::attr a;
+  std::string buf;
+  int r;
+  extent_protocol::status ret = call_unlocked(from, extent_protocol::getattr, eid, a);
+  if (ret == extent_protocol::OK)
+    ret = call_unlocked(from, extent_protocol::get, eid, buf);
+  if (ret == extent_protocol::OK)
+    ret = call_unlocked(to, extent_protocol::restore, eid, a, buf, r);
+  if (ret == extent_protocol::OK)
+    ret = call_unlocked(from, extent_protocol::remove, eid, r);
+  moving.erase(eid);
+  pthread_cond_broadcast(&inflight_done);
+  return ret == extent_protocol::NOENT ? extent_protocol::OK : ret;
+}
+
+// make sure the extent is on the server the current ring names before
+// talking to that server about it. a move already under way is waited for.
+extent_protocol::status
+extent_client::settle(extent_protocol::extentid_t eid)
+{
+  while (rebalancing && !settled.count(eid)) {
+    if (moving.count(eid)) {
+      pthread_cond_wait(&inflight_done, &mutex_lock);
+      continue;
+    }
+    rpcc *from = servers[old_ring.owner(eid)];
+    rpcc *to = server_for(eid);
+    if (from != to) {
+      extent_protocol::status ret = move(eid, from, to);
+      if (ret != extent_protocol::OK)
+        return ret;
+    }
+    settled.insert(eid);
+  }
+  return extent_protocol::OK;
+}
+
+void
+extent_client::add_server(std::string dst)
+{
+  ScopedLock ml(&mutex_lock);
+  // one rebalance at a time
+  while (sweeping || rebalancing) {
+    if (sweeping) {
+      pthread_cond_wait(&inflight_done, &mutex_lock);
+      continue;
+    }
+    sweeping = true;
+    sweep(1024);
+    sweeping = false;
+    pthread_cond_broadcast(&inflight_done);
+  }
+  if (ring.contains(dst))
+    return;
+  old_ring = ring;
+  servers[dst] = connect(dst);
+  ring.add(dst);
+  sweep_servers = old_ring.servers();
+  sweep_server = 0;
+  sweep_bucket = 0;
+  sweep_ids.clear();
+  settled.clear();
+  rebalancing = true;
+}
+
+// one thread sweeps at a time, the others wait for it and then go on
+bool
+extent_client::rebalance(unsigned int max)
+{
+  ScopedLock ml(&mutex_lock);
+  while (sweeping)
+    pthread_cond_wait(&inflight_done, &mutex_lock);
+  sweeping = true;
+  bool more = sweep(max);
+  sweeping = false;
+  pthread_cond_broadcast(&inflight_done);
+  return more;
+}
+
+// the body of rebalance(), true until every extent has moved
+bool
+extent_client::sweep(unsigned int max)
+{
+  unsigned int moved = 0;
+  while (rebalancing && moved < max) {
+    if (sweep_ids.empty()) {
+      if (sweep_server == sweep_servers.size()) {
+        rebalancing = false;
+        old_ring = ring;
+        settled.clear();
+        break;
+      }
+      rpcc *cl = servers[sweep_servers[sweep_server]];
+      extent_protocol::status ret = call_unlocked(cl, extent_protocol::list, sweep_bucket, sweep_ids);
+      if (ret == extent_protocol::NOENT) {
+        sweep_server++;
+        sweep_bucket = 0;
+      } else if (ret == extent_protocol::OK) {
+        sweep_bucket++;
+      } else {
+        return true;
+      }
+      continue;
+    }
+
+    extent_protocol::extentid_t eid = sweep_ids.back();
+    const std::string &name = sweep_servers[sweep_server];
+    // copies a server does not own, like the root every server creates,
+    // are never read and stay where they are
+    if (old_ring.owner(eid) != name || ring.owner(eid) == name || settled.count(eid)) {
+      sweep_ids.pop_back();
+      continue;
     }
-  
-  // cache miss
+    // being moved by a thread that touched it, look again once it is
+    if (moving.count(eid)) {
+      pthread_cond_wait(&inflight_done, &mutex_lock);
+      continue;
+    }
+    if (move(eid, servers[name], server_for(eid)) != extent_protocol::OK)
+      return true;
+    sweep_ids.pop_back();
+    settled.insert(eid);
+    moved++;
+  }
+  return rebalancing;
+}
+
+unsigned int
+extent_client::nservers()
+{
+  ScopedLock ml(&mutex_lock);
+  return ring.servers().size();
+}
+
+// nothing to write back
+bool
+extent_client::clean(const cache_entry &e)
+{
+  return e.has_attr && !e.to_be_removed && !e.overwritten && e.dirty_blocks.empty()
+    && e.tail.empty() && e.base_size == e.attr.size && e.server_size == e.attr.size;
+}
+
+// attributes fresh from the server. a kept entry holds on to its blocks
+// only if the extent has not changed since they were fetched.
+void
+extent_client::got_attr(cache_entry &e, const extent_protocol::attr &a)
+{
+  if (e.stale) {
+    revalidations++;
+    if (a.version == e.attr.version)
+      revalidation_hits++;
+    else
+      clear_blocks(e);
+    e.stale = false;
+  }
+  e.fetches++;
+  e.attr = a;
+  e.has_attr = true;
+  e.base_size = e.server_size = a.size;
+}
+
+// cache the whole blocks of data, which starts at block boundary start.
+// the last block of the extent may be short.
+void
+extent_client::fill_blocks(cache_entry &e, unsigned long long start, const shared_buf &data)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  for (unsigned long long b = start; b < start + data.size(); b += bs) {
+    unsigned long long len = std::min((unsigned long long) bs, (unsigned long long) e.attr.size - b);
+    if (b + len <= start + data.size() && !e.blocks.count(b / bs))
+      set_block(e, b / bs, data.slice(b - start, len));
+  }
+}
+
+// a kept entry that failed to revalidate, typically because the extent was
+// removed meanwhile. it is clean, so it can go.
+void
+extent_client::forget(cache_entry &e)
+{
+  if (!e.stale)
+    return;
+  e.stale = false;
+  e.has_attr = false;
+  clear_blocks(e);
+}
+
+// the entry for eid, created if need be, now the most recently used
+extent_client::cache_entry &
+extent_client::use(extent_protocol::extentid_t eid)
+{
+  auto it = cache.find(eid);
+  if (it == cache.end()) {
+    it = cache.emplace(eid, cache_entry()).first;
+    lru.push_front(eid);
+    it->second.lru_pos = lru.begin();
+    charge(it->second, sizeof(cache_entry) + sizeof(eid));
   } else {
-    
-    // retrieve the data from the server
-    ret = cl->call(extent_protocol::get, eid, buf);
-    data[eid] = buf;
-    
-    extent_protocol::attr &attr = attributes[eid];
-    ret = cl->call(extent_protocol::getattr, eid, attr);
-
-    is_dirty[eid] = false;
-    to_be_removed[eid] = false;
-  }
-  
-  attributes[eid].atime = time(nullptr);
-  
-  pthread_mutex_unlock(&mutex_lock);
-  
-  return ret;
+    lru.splice(lru.begin(), lru, it->second.lru_pos);
+  }
+  return it->second;
 }
 
-extent_protocol::status
-extent_client::getattr(extent_protocol::extentid_t eid, 
-		       extent_protocol::attr &attr)
+void
+extent_client::drop(extent_protocol::extentid_t eid)
 {
-  pthread_mutex_lock(&mutex_lock);
+  auto it = cache.find(eid);
+  if (it == cache.end())
+    return;
+  unlink_dirty(it->second);
+  resident_bytes -= it->second.bytes;
+  lru.erase(it->second.lru_pos);
+  cache.erase(it);
+}
 
-  extent_protocol::status ret = extent_protocol::OK;
+void
+extent_client::charge(cache_entry &e, long long bytes)
+{
+  e.bytes += bytes;
+  resident_bytes += bytes;
+  if (e.listed)
+    dirty_bytes += bytes;
+}
 
-  // cache hit
-  if (attributes.find(eid) != attributes.end()){
+void
+extent_client::set_block(cache_entry &e, unsigned int bno, const shared_buf &b)
+{
+  shared_buf &block = e.blocks[bno];
+  charge(e, (long long) b.size() - (long long) block.size());
+  block = b;
+}
 
-    // not to be removed
-    if(!to_be_removed[eid]) {
-      attr = attributes.at(eid);
+// the blocks from block number from on go, dirty or not
+void
+extent_client::erase_blocks(cache_entry &e, unsigned int from)
+{
+  for (auto it = e.blocks.lower_bound(from); it != e.blocks.end(); it = e.blocks.erase(it))
+    charge(e, -(long long) it->second.size());
+  e.dirty_blocks.erase(e.dirty_blocks.lower_bound(from), e.dirty_blocks.end());
+}
 
-    // to be removed
+void
+extent_client::clear_blocks(cache_entry &e)
+{
+  erase_blocks(e, 0);
+  charge(e, -(long long) e.tail.size());
+  e.tail.clear();
+}
+
+// drop least recently used entries until the cache fits its budget.
+// pinned entries are left alone. dirty ones are written back first, the
+// way the flushers do it, and go afterwards unless some thread took them
+// up meanwhile; the list may have changed by then, so the scan starts over.
+void
+extent_client::evict()
+{
+  auto it = lru.end();
+  while (resident_bytes > budget && it != lru.begin()) {
+    --it;
+    extent_protocol::extentid_t eid = *it;
+    cache_entry &e = cache.find(eid)->second;
+    if (e.pins)
+      continue;
+    if ((e.has_attr || e.to_be_removed) && !e.stale && !clean(e)) {
+      e.pins++;
+      extent_protocol::status ret = settle(eid);
+      bool removal = e.to_be_removed;
+      if (ret == extent_protocol::OK)
+        ret = write_back(eid, e);
+      if (ret == extent_protocol::OK)
+        dirty_evictions++;
+      e.pins--;
+      // the server is unreachable, the next release evicts again
+      if (ret != extent_protocol::OK)
+        return;
+      it = lru.end();
+      if (e.pins || !(removal ? e.to_be_removed : clean(e)))
+        continue;
     } else {
-      ret = extent_protocol::NOENT;
+      ++it;
+      save(eid, e);
     }
+    evictions++;
+    drop(eid);
+  }
+}
+
+extent_client::pin::pin(extent_client *c, extent_protocol::extentid_t eid, bool lookup)
+  : c(c), lookup(lookup), has_first(false)
+{
+  add(eid);
+}
 
-  // cache miss 
+extent_client::pin::pin(extent_client *c, const std::vector<extent_protocol::extentid_t> &eids,
+                        bool lookup)
+  : c(c), lookup(lookup), has_first(false)
+{
+  for (size_t i = 0; i < eids.size(); i++)
+    add(eids[i]);
+}
+
+void
+extent_client::pin::add(extent_protocol::extentid_t eid)
+{
+  cache_entry *e;
+  if (lookup) {
+    e = &c->use(eid);
   } else {
-      
-      // retrieve the attributes from the server
-      extent_protocol::attr &a = attributes[eid];
-      ret = cl->call(extent_protocol::getattr, eid, a);
-      attr = a;
+    auto it = c->cache.find(eid);
+    if (it == c->cache.end())
+      return;
+    e = &it->second;
   }
-  
-  pthread_mutex_unlock(&mutex_lock);
-  
+  e->pins++;
+  if (!has_first) {
+    first = pinned_entry(eid, e->fetches);
+    first_entry = e;
+    has_first = true;
+  } else {
+    rest.push_back(pinned_entry(eid, e->fetches));
+  }
+}
+
+void
+extent_client::pin::release(const pinned_entry &p)
+{
+  auto it = c->cache.find(p.first);
+  if (it == c->cache.end() || it->second.pins == 0) {
+    // dropped by the operation, which had to ask the server
+    if (lookup)
+      c->misses++;
+    return;
+  }
+  cache_entry &e = it->second;
+  e.pins--;
+  if (!lookup)
+    return;
+  if (e.fetches == p.second)
+    c->hits++;
+  else
+    c->misses++;
+  // nothing found, nothing to keep
+  if (!e.pins && !e.has_attr && !e.to_be_removed)
+    c->drop(p.first);
+}
+
+extent_client::pin::~pin()
+{
+  if (has_first)
+    release(first);
+  for (size_t i = 0; i < rest.size(); i++)
+    release(rest[i]);
+  c->evict();
+}
+
+extent_protocol::status
+extent_client::fetch_attr(extent_protocol::extentid_t eid, cache_entry &e)
+{
+  if (e.has_attr && !e.stale)
+    return extent_protocol::OK;
+
+  extent_protocol::status ret = settle(eid);
+  if (ret != extent_protocol::OK)
+    return ret;
+  wait_fetch(e);
+  adopt(eid, e);
+  if (e.has_attr && !e.stale)
+    return extent_protocol::OK;
+  extent_protocol::attr a;
+  e.fetching = true;
+  ret = call_unlocked(server_for(eid), extent_protocol::getattr, eid, a);
+  end_fetch(e);
+  if (ret != extent_protocol::OK) {
+    forget(e);
+    return ret;
+  }
+  got_attr(e, a);
+  return extent_protocol::OK;
+}
+
+// make sure every block overlapping [off, end) is cached. each run of
+// missing blocks is fetched with a single ranged read.
+// attributes plus the blocks covering [off, off + size). an entry without
+// attributes gets both from a single readattr, so a cold read is one round
+// trip; with size 0 that is just the attributes.
+extent_protocol::status
+extent_client::fetch(extent_protocol::extentid_t eid, cache_entry &e,
+                     unsigned long long off, unsigned long long size)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  extent_protocol::status ret = settle(eid);
+  if (ret != extent_protocol::OK)
+    return ret;
+  // whatever another thread is fetching may be what we are missing
+  wait_fetch(e);
+  adopt(eid, e);
+  bool kept = !e.blocks.empty() || on_disk(eid, e);
+  if (e.stale && kept && e.attr.size > flush_chunk_blocks * bs) {
+    // big kept extents revalidate on attributes alone, blocks that are
+    // still missing come below
+    ret = fetch_attr(eid, e);
+    if (ret != extent_protocol::OK)
+      return ret;
+  } else if (e.stale && kept) {
+    // small ones come back whole if they changed
+    extent_protocol::extent x;
+    e.fetching = true;
+    ret = call_unlocked(server_for(eid), extent_protocol::get_if_changed, eid, e.attr.version, x);
+    end_fetch(e);
+    if (ret != extent_protocol::OK) {
+      forget(e);
+      return ret;
+    }
+    got_attr(e, x.a);
+    fill_blocks(e, 0, x.data);
+  } else if (!e.has_attr || e.stale) {
+    unsigned long long start = off / bs * bs;
+    unsigned long long stop = size ? (off + size + bs - 1) / bs * bs : start;
+    extent_protocol::extent x;
+    e.fetching = true;
+    ret = call_unlocked(server_for(eid), extent_protocol::readattr, eid, start,
+                                (unsigned int) std::min(stop - start, 0xffffffffULL), x);
+    end_fetch(e);
+    if (ret != extent_protocol::OK) {
+      forget(e);
+      return ret;
+    }
+    got_attr(e, x.a);
+    fill_blocks(e, start, x.data);
+  }
+  return fetch_blocks(eid, e, off, std::min(off + size, (unsigned long long) e.attr.size));
+}
+
+extent_protocol::status
+extent_client::fetch_blocks(extent_protocol::extentid_t eid, cache_entry &e,
+                            unsigned long long off, unsigned long long end)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  cut_tail(e);
+  if (off >= end)
+    return extent_protocol::OK;
+  extent_protocol::status ret = settle(eid);
+  if (ret != extent_protocol::OK)
+    return ret;
+
+  unsigned int last = (end - 1) / bs;
+  unsigned int bno = off / bs;
+  while (bno <= last) {
+    if (e.blocks.count(bno)) {
+      bno++;
+      continue;
+    }
+    unsigned int run_end = bno;
+    while (run_end + 1 <= last && !e.blocks.count(run_end + 1))
+      run_end++;
+
+    unsigned long long start = (unsigned long long) bno * bs;
+    unsigned long long stop = std::min((unsigned long long) (run_end + 1) * bs,
+                                       (unsigned long long) e.attr.size);
+    unsigned long long remote_stop = std::min(stop, e.base_size);
+    shared_buf buf;
+    if (start < remote_stop) {
+      // the server copy is only current once a background write-back is
+      // in, and a fetch by another thread may bring the run along. either
+      // way the blocks are looked at again afterwards.
+      if (e.writing || e.fetching) {
+        wait_writeback(e);
+        wait_fetch(e);
+        continue;
+      }
+      e.fetching = true;
+      if (on_disk(eid, e) && read_disk(eid, start, remote_stop - start, buf))
+        ret = extent_protocol::OK;
+      else
+        ret = call_unlocked(server_for(eid), extent_protocol::read, eid, start,
+                            (unsigned int) (remote_stop - start), buf);
+      end_fetch(e);
+      if (ret != extent_protocol::OK)
+        return ret;
+    }
+    // anything past what the server holds for us is a hole
+    if (buf.size() < stop - start) {
+      std::string padded = buf.str();
+      padded.resize(stop - start, '\0');
+      buf = shared_buf(std::move(padded));
+    }
+    // the blocks share the reply's storage
+    for (unsigned int b = bno; b <= run_end; b++) {
+      unsigned long long from = (unsigned long long) b * bs - start;
+      set_block(e, b, buf.slice(from, std::min((unsigned long long) bs, stop - start - from)));
+    }
+    e.fetches++;
+    bno = run_end + 1;
+  }
+  return extent_protocol::OK;
+}
+
+// the cached blocks overlapping [off, end), trimmed to the range. they
+// share storage with the cache, nothing is copied.
+void
+extent_client::slice_cached(cache_entry &e, unsigned long long off, unsigned long long end,
+                            std::vector<shared_buf> &bufs)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  for (unsigned int bno = off / bs; (unsigned long long) bno * bs < end; bno++) {
+    const shared_buf &block = e.blocks[bno];
+    unsigned long long block_start = (unsigned long long) bno * bs;
+    unsigned long long from = std::max(off, block_start) - block_start;
+    unsigned long long to = std::min(end - block_start, (unsigned long long) block.size());
+    if (to > from)
+      bufs.push_back(from == 0 && to == block.size() ? block : block.slice(from, to - from));
+  }
+}
+
+std::string
+extent_client::read_cached(cache_entry &e, unsigned long long off, unsigned long long end)
+{
+  std::string buf;
+  if (off >= end)
+    return buf;
+  std::vector<shared_buf> bufs;
+  slice_cached(e, off, end, bufs);
+  buf.reserve(end - off);
+  for (size_t i = 0; i < bufs.size(); i++)
+    buf.append(bufs[i].data(), bufs[i].size());
+  return buf;
+}
+
+void
+extent_client::resize_cached(cache_entry &e, unsigned long long size)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  cut_tail(e);
+  unsigned long long old_size = e.attr.size;
+  if (size < old_size) {
+    erase_blocks(e, (size + bs - 1) / bs);
+    auto last = e.blocks.find(size / bs);
+    if (last != e.blocks.end() && last->second.size() > size % bs)
+      set_block(e, size / bs, last->second.slice(0, size % bs));
+    if (size < e.base_size)
+      e.base_size = size;
+  } else if (size > old_size && old_size > 0) {
+    // the old last block now extends further, with zeros
+    unsigned int bno = (old_size - 1) / bs;
+    auto last = e.blocks.find(bno);
+    if (last != e.blocks.end()) {
+      std::string block = last->second.str();
+      block.resize(std::min((unsigned long long) bs, size - (unsigned long long) bno * bs), '\0');
+      set_block(e, bno, shared_buf(std::move(block)));
+    }
+  }
+  e.attr.size = size;
+}
+
+// add buf at the end of the extent. whole blocks are stored as they come,
+// the rest collects in the tail.
+void
+extent_client::append_cached(cache_entry &e, const std::string &buf)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  size_t done = 0;
+  while (done < buf.size()) {
+    unsigned long long pos = e.attr.size + done;
+    if (e.tail.empty() && pos % bs == 0 && buf.size() - done >= bs) {
+      set_block(e, pos / bs, shared_buf(buf.data() + done, bs));
+      e.dirty_blocks.insert(pos / bs);
+      done += bs;
+      continue;
+    }
+    if (e.tail.empty()) {
+      e.tail.reserve(bs);
+      e.tail_start = pos / bs * bs;
+    }
+    size_t n = std::min((size_t) bs - e.tail.size(), buf.size() - done);
+    e.tail.append(buf, done, n);
+    charge(e, n);
+    done += n;
+    if (e.tail.size() == bs)
+      cut_tail(e);
+  }
+  e.attr.size += buf.size();
+}
+
+// the tail becomes a dirty block, without being copied
+void
+extent_client::cut_tail(cache_entry &e)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  if (e.tail.empty())
+    return;
+  charge(e, -(long long) e.tail.size());
+  set_block(e, e.tail_start / bs, shared_buf(std::move(e.tail)));
+  e.dirty_blocks.insert(e.tail_start / bs);
+  e.tail.clear();
+}
+
+extent_protocol::status
+extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
+{
+  ScopedLock ml(&mutex_lock);
+  pin p(this, eid);
+  cache_entry &e = p.entry();
+
+  // to be removed
+  if (e.to_be_removed)
+    return extent_protocol::NOENT;
+
+  extent_protocol::status ret = fetch(eid, e, 0, ~0U);
+  if (ret != extent_protocol::OK)
+    return ret;
+  buf = read_cached(e, 0, e.attr.size);
+  e.attr.atime = time(nullptr);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::getattr(extent_protocol::extentid_t eid,
+		       extent_protocol::attr &attr)
+{
+  ScopedLock ml(&mutex_lock);
+  pin p(this, eid);
+  cache_entry &e = p.entry();
+
+  if (e.to_be_removed)
+    return extent_protocol::NOENT;
+
+  // retrieve the attributes from the server on a cache miss
+  extent_protocol::status ret = fetch_attr(eid, e);
+  if (ret == extent_protocol::OK)
+    attr = e.attr;
   return ret;
 }
 
 extent_protocol::status
 extent_client::put(extent_protocol::extentid_t eid, std::string buf)
 {
-  pthread_mutex_lock(&mutex_lock);
-  
-  extent_protocol::status ret = extent_protocol::OK;
+  ScopedLock ml(&mutex_lock);
 
-  // insert data
-  data[eid] = buf;
+  const unsigned int bs = extent_protocol::blocksize;
+  cache_entry &e = use(eid);
+
+  // replace the content, the server copy is recreated from scratch on flush
+  clear_blocks(e);
+  shared_buf content(std::move(buf));
+  for (size_t off = 0; off < content.size(); off += bs) {
+    set_block(e, off / bs, content.slice(off, std::min((size_t) bs, content.size() - off)));
+    e.dirty_blocks.insert(off / bs);
+  }
 
   // create and set attributes
-  extent_protocol::attr newAttr;
-  
-  newAttr.size = buf.size();
-  
   time_t currTime = time(nullptr);
-  
-  newAttr.atime = currTime;
-  newAttr.mtime = currTime;
-  newAttr.ctime = currTime;
-  
-  attributes[eid] = newAttr;
+  e.attr.size = content.size();
+  e.attr.atime = currTime;
+  e.attr.mtime = currTime;
+  e.attr.ctime = currTime;
+  e.has_attr = true;
+  e.base_size = e.server_size = 0;
 
   // set dirty flag
-  is_dirty[eid] = true;
-  to_be_removed[eid] = false;
+  e.overwritten = true;
+  e.to_be_removed = false;
+  e.stale = false;
+  mark_dirty(eid, e);
 
-  pthread_mutex_unlock(&mutex_lock);
-  
-  return ret;
+  evict();
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, unsigned long long off,
+                    unsigned int size, std::string &buf)
+{
+  ScopedLock ml(&mutex_lock);
+  pin p(this, eid);
+  cache_entry &e = p.entry();
+  if (e.to_be_removed)
+    return extent_protocol::NOENT;
+
+  extent_protocol::status ret = fetch(eid, e, off, size);
+  if (ret != extent_protocol::OK)
+    return ret;
+  buf = read_cached(e, off, std::min(off + size, (unsigned long long) e.attr.size));
+  e.attr.atime = time(nullptr);
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, unsigned long long off,
+                    unsigned int size, std::vector<shared_buf> &bufs)
+{
+  ScopedLock ml(&mutex_lock);
+  pin p(this, eid);
+  cache_entry &e = p.entry();
+  if (e.to_be_removed)
+    return extent_protocol::NOENT;
+
+  extent_protocol::status ret = fetch(eid, e, off, size);
+  if (ret != extent_protocol::OK)
+    return ret;
+  bufs.clear();
+  slice_cached(e, off, std::min(off + size, (unsigned long long) e.attr.size), bufs);
+  e.attr.atime = time(nullptr);
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, unsigned long long off,
+                     const std::string &buf)
+{
+  ScopedLock ml(&mutex_lock);
+  pin p(this, eid);
+
+  const unsigned int bs = extent_protocol::blocksize;
+  cache_entry &e = p.entry();
+  if (e.to_be_removed)
+    return extent_protocol::NOENT;
+
+  // appends need nothing from the server, unless they start inside a
+  // block that is not in the tail yet
+  time_t currTime = time(nullptr);
+  if (e.has_attr && !e.stale && off == e.attr.size && (!e.tail.empty() || off % bs == 0)) {
+    append_cached(e, buf);
+    e.attr.mtime = currTime;
+    e.attr.ctime = currTime;
+    mark_dirty(eid, e);
+    return extent_protocol::OK;
+  }
+
+  // a cold write into the middle of a block brings that block along
+  extent_protocol::status ret = fetch(eid, e, off, buf.size() && off % bs ? 1 : 0);
+  if (ret != extent_protocol::OK)
+    return ret;
+  if (buf.empty())
+    return extent_protocol::OK;
+
+  if (off == e.attr.size) {
+    // the partial last block becomes the tail
+    if (off % bs) {
+      ret = fetch_blocks(eid, e, off - 1, off);
+      if (ret != extent_protocol::OK)
+        return ret;
+      e.tail.reserve(bs);
+      e.tail.assign(e.blocks[off / bs].data(), e.blocks[off / bs].size());
+      charge(e, e.tail.size());
+      e.tail_start = off / bs * bs;
+      erase_blocks(e, off / bs);
+    }
+    append_cached(e, buf);
+    e.attr.mtime = currTime;
+    e.attr.ctime = currTime;
+    mark_dirty(eid, e);
+    return extent_protocol::OK;
+  }
+
+  unsigned long long end = off + buf.size();
+  if (end > e.attr.size)
+    resize_cached(e, end);
+
+  // only blocks partially covered by the write need their old content
+  if (off % bs)
+    ret = fetch_blocks(eid, e, off, off + 1);
+  if (ret == extent_protocol::OK && end % bs)
+    ret = fetch_blocks(eid, e, end - 1, end);
+  if (ret != extent_protocol::OK)
+    return ret;
+
+  size_t done = 0;
+  while (done < buf.size()) {
+    unsigned long long pos = off + done;
+    unsigned int bno = pos / bs;
+    unsigned int boff = pos % bs;
+    size_t n = std::min((size_t) (bs - boff), buf.size() - done);
+    size_t len = std::min((unsigned long long) bs, e.attr.size - (unsigned long long) bno * bs);
+    if (boff == 0 && n == len) {
+      set_block(e, bno, shared_buf(buf.data() + done, n));
+    } else {
+      // blocks may be shared with readers, change a private copy
+      std::string copy = e.blocks[bno].str();
+      if (copy.size() < boff + n)
+        copy.resize(len, '\0');
+      copy.replace(boff, n, buf, done, n);
+      set_block(e, bno, shared_buf(std::move(copy)));
+    }
+    e.dirty_blocks.insert(bno);
+    done += n;
+  }
+
+  e.attr.mtime = currTime;
+  e.attr.ctime = currTime;
+  mark_dirty(eid, e);
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::resize(extent_protocol::extentid_t eid, unsigned long long size)
+{
+  ScopedLock ml(&mutex_lock);
+  pin p(this, eid);
+  cache_entry &e = p.entry();
+  if (e.to_be_removed)
+    return extent_protocol::NOENT;
+
+  extent_protocol::status ret = fetch_attr(eid, e);
+  if (ret != extent_protocol::OK)
+    return ret;
+  resize_cached(e, size);
+
+  time_t currTime = time(nullptr);
+  e.attr.mtime = currTime;
+  e.attr.ctime = currTime;
+  mark_dirty(eid, e);
+  return extent_protocol::OK;
 }
 
 extent_protocol::status
 extent_client::remove(extent_protocol::extentid_t eid)
 {
-  pthread_mutex_lock(&mutex_lock);
-  
-  extent_protocol::status ret = extent_protocol::OK;
+  ScopedLock ml(&mutex_lock);
 
   // set to be removed flag
-  to_be_removed[eid] = true;
+  cache_entry &e = use(eid);
+  e.to_be_removed = true;
+  e.stale = false;
+  clear_blocks(e);
+  // removals are left for the release
+  unlink_dirty(e);
+  return extent_protocol::OK;
+}
+
+// mark e for the flushers, unless it already waits for them
+void
+extent_client::mark_dirty(extent_protocol::extentid_t eid, cache_entry &e)
+{
+  if (!e.listed) {
+    e.listed = true;
+    e.dirty_since = now();
+    e.dirty_pos = dirty.insert(dirty.end(), eid);
+    dirty_bytes += e.bytes;
+  }
+  if (dirty_bytes > writeback_bytes)
+    pthread_cond_signal(&flush_signal);
+}
+
+void
+extent_client::unlink_dirty(cache_entry &e)
+{
+  if (!e.listed)
+    return;
+  e.listed = false;
+  dirty.erase(e.dirty_pos);
+  dirty_bytes -= e.bytes;
+}
+
+void
+extent_client::wait_writeback(cache_entry &e)
+{
+  while (e.writing)
+    pthread_cond_wait(&inflight_done, &mutex_lock);
+}
+
+// wait for another thread's fetch into e to land; whatever the caller was
+// missing may have come with it
+void
+extent_client::wait_fetch(cache_entry &e)
+{
+  if (e.fetching)
+    shared_fetches++;
+  while (e.fetching)
+    pthread_cond_wait(&inflight_done, &mutex_lock);
+}
+
+void
+extent_client::end_fetch(cache_entry &e)
+{
+  e.fetching = false;
+  pthread_cond_broadcast(&inflight_done);
+}
+
+// mark the pinned entries of eids as being fetched by one batched RPC,
+// except those another thread fetched into since they were found missing
+std::vector<extent_client::cache_entry *>
+extent_client::begin_fetches(const std::vector<extent_protocol::extentid_t> &eids)
+{
+  std::vector<cache_entry *> claimed;
+  for (size_t i = 0; i < eids.size(); i++) {
+    cache_entry &e = cache.find(eids[i])->second;
+    if (!e.fetching) {
+      e.fetching = true;
+      claimed.push_back(&e);
+    }
+  }
+  return claimed;
+}
+
+void
+extent_client::end_fetches(const std::vector<cache_entry *> &es)
+{
+  for (size_t i = 0; i < es.size(); i++)
+    es[i]->fetching = false;
+  pthread_cond_broadcast(&inflight_done);
+}
+
+// what writing back e takes. the entry is clean from here on; what is
+// taken only has to reach the server before the extent's lock is released.
+// if the blocks a whole-extent put needs cannot be fetched, the entry is
+// left dirty and nothing is taken.
+extent_protocol::status
+extent_client::take_writeback(extent_protocol::extentid_t eid, cache_entry &e, writeback &w)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  cut_tail(e);
+  bool whole = !e.to_be_removed && e.has_attr && e.overwritten
+    && e.attr.size <= flush_chunk_blocks * bs;
+  if (whole) {
+    extent_protocol::status ret = fetch_blocks(eid, e, 0, e.attr.size);
+    if (ret != extent_protocol::OK)
+      return ret;
+  }
+  unlink_dirty(e);
+  if (e.to_be_removed) {
+    w.remove = true;
+    return extent_protocol::OK;
+  }
+  if (!e.has_attr)
+    return extent_protocol::OK;
+
+  if (whole) {
+    // small extents are recreated with a single put
+    w.put = true;
+    slice_cached(e, 0, e.attr.size, w.content);
+  } else {
+    w.put = e.overwritten;
+    // drop whatever was truncated away locally before writing new data
+    w.truncate = e.base_size < e.server_size;
+    w.truncate_to = e.base_size;
+    unsigned long long remote_size = e.base_size;
+    auto bit = e.dirty_blocks.begin();
+    while (bit != e.dirty_blocks.end()) {
+      unsigned int first = *bit;
+      std::vector<shared_buf> run;
+      unsigned long long len = 0;
+      while (bit != e.dirty_blocks.end() && *bit == first + run.size()
+             && run.size() < flush_chunk_blocks) {
+        run.push_back(e.blocks[*bit]);
+        len += run.back().size();
+        bit++;
+      }
+      unsigned long long off = (unsigned long long) first * bs;
+      w.runs.push_back(std::make_pair(off, run));
+      remote_size = std::max(remote_size, off + len);
+    }
+    // trailing holes left by a growing resize
+    w.resize = remote_size != e.attr.size;
+    w.size = e.attr.size;
+  }
+  e.overwritten = false;
+  e.dirty_blocks.clear();
+  e.base_size = e.server_size = e.attr.size;
+  return extent_protocol::OK;
+}
+
+void
+extent_client::send_writeback(extent_protocol::extentid_t eid, writeback &w)
+{
+  rpcc *cl = server_for(eid);
+  int r;
+  if (w.remove) {
+    // the extent may never have reached the server
+    call_retry(cl, extent_protocol::remove, extent_protocol::NOENT, eid, r);
+    return;
+  }
+  if (w.put) {
+    std::string content;
+    for (size_t i = 0; i < w.content.size(); i++)
+      content.append(w.content[i].data(), w.content[i].size());
+    call_retry(cl, extent_protocol::put, extent_protocol::OK, eid, content, r);
+  }
+  if (w.truncate)
+    call_retry(cl, extent_protocol::resize, extent_protocol::OK, eid, w.truncate_to, r);
+  for (size_t i = 0; i < w.runs.size(); i++) {
+    std::string buf;
+    for (size_t k = 0; k < w.runs[i].second.size(); k++)
+      buf.append(w.runs[i].second[k].data(), w.runs[i].second[k].size());
+    call_retry(cl, extent_protocol::write, extent_protocol::OK, eid, w.runs[i].first, buf, r);
+  }
+  if (w.resize)
+    call_retry(cl, extent_protocol::resize, extent_protocol::OK, eid, w.size, r);
+}
 
+// write back one cached extent, retrying until the server takes it
+extent_protocol::status
+extent_client::flush_entry(extent_protocol::extentid_t eid, cache_entry &e)
+{
+  writeback w;
+  wait_writeback(e);
+  extent_protocol::status ret = take_writeback(eid, e, w);
+  if (ret != extent_protocol::OK)
+    return ret;
+  send_writeback(eid, w);
+  return extent_protocol::OK;
+}
+
+// the same for an entry the lock holder may go on using meanwhile. the
+// caller has it pinned, and makes sure no write-back of it is in flight.
+extent_protocol::status
+extent_client::write_back(extent_protocol::extentid_t eid, cache_entry &e)
+{
+  writeback w;
+  extent_protocol::status ret = take_writeback(eid, e, w);
+  if (ret != extent_protocol::OK)
+    return ret;
+  e.writing = true;
+  send_writeback(eid, w);
+  e.writing = false;
+  pthread_cond_broadcast(&inflight_done);
+  return extent_protocol::OK;
+}
+
+// the oldest dirty entry that is due, having been dirty for writeback_age
+// or while too much is dirty. entries in use are left for later.
+bool
+extent_client::next_writeback(extent_protocol::extentid_t &eid)
+{
+  double t = now();
+  for (auto it = dirty.begin(); it != dirty.end(); ++it) {
+    cache_entry &e = cache.find(*it)->second;
+    if (dirty_bytes <= writeback_bytes && t - e.dirty_since < writeback_age)
+      return false;
+    if (!e.pins && !e.writing) {
+      eid = *it;
+      return true;
+    }
+  }
+  return false;
+}
+
+// entries are written back while the lock holder may go on using them:
+// what is sent is taken under mutex_lock, and the entry counts as clean
+// from then on. a release, or a fetch from the server, waits for the
+// write-back to land.
+void
+extent_client::flusher()
+{
+  ScopedLock ml(&mutex_lock);
+  while (!stopping) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 100 * 1000 * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&flush_signal, &mutex_lock, &ts);
+
+    extent_protocol::extentid_t eid;
+    while (!stopping && next_writeback(eid)) {
+      if (settle(eid) != extent_protocol::OK)
+        break;
+      // settle may let go of the mutex to move the extent, meanwhile the
+      // entry may have been dropped or written back by someone else
+      auto it = cache.find(eid);
+      if (it == cache.end() || !it->second.listed || it->second.writing)
+        continue;
+      pin p(this, eid, false);
+      if (write_back(eid, it->second) != extent_protocol::OK)
+        break;
+      background_writebacks++;
+    }
+    disk_save s;
+    while (!stopping && next_save(s))
+      write_save(s);
+  }
+
+  // saves still queued are written before the client goes
+  disk_save s;
+  while (next_save(s))
+    write_save(s);
+}
+
+// an entry with nothing in it yet takes the attributes of a saved copy,
+// to be revalidated like one kept across a lock release
+void
+extent_client::adopt(extent_protocol::extentid_t eid, cache_entry &e)
+{
+  if (!disk || e.has_attr || e.to_be_removed)
+    return;
+  auto it = disk_index.find(eid);
+  if (it == disk_index.end())
+    return;
+  e.attr = it->second.attr;
+  e.has_attr = true;
+  e.stale = true;
+  e.base_size = e.server_size = e.attr.size;
+  disk_lru.splice(disk_lru.begin(), disk_lru, it->second.lru_pos);
+}
+
+// whether the disk tier holds the content of e's version
+bool
+extent_client::on_disk(extent_protocol::extentid_t eid, const cache_entry &e)
+{
+  if (!disk)
+    return false;
+  auto it = disk_index.find(eid);
+  return it != disk_index.end() && it->second.attr.version == e.attr.version;
+}
+
+// [off, off + size) of a saved extent, with mutex_lock dropped for the
+// read. false if the save the index names has been replaced meanwhile.
+bool
+extent_client::read_disk(extent_protocol::extentid_t eid, unsigned long long off,
+                         unsigned int size, shared_buf &buf)
+{
+  unsigned long long local = disk_index.find(eid)->second.local;
+  extent_protocol::attr a;
   pthread_mutex_unlock(&mutex_lock);
-  
-  return ret;
+  int ret = disk->read(eid, off + disk_header, size, buf, time(NULL), &a);
+  pthread_mutex_lock(&mutex_lock);
+  if (ret != extent_protocol::OK || a.version != local || buf.size() != size)
+    return false;
+  disk_reads++;
+  return true;
+}
+
+// queue a clean entry that is cached whole for the disk tier, unless the
+// disk has this version already or the flushers are too far behind
+void
+extent_client::save(extent_protocol::extentid_t eid, cache_entry &e)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  if (!disk || !clean(e) || e.writing || on_disk(eid, e)
+      || e.blocks.size() != (e.attr.size + bs - 1) / bs
+      || e.attr.size > disk_budget / 4 || save_bytes + e.attr.size > max_save_bytes)
+    return;
+  saves.push_back(disk_save());
+  disk_save &s = saves.back();
+  s.eid = eid;
+  s.attr = e.attr;
+  slice_cached(e, 0, e.attr.size, s.content);
+  save_bytes += e.attr.size;
+  pthread_cond_signal(&flush_signal);
+}
+
+// the first queued save of an extent no other flusher is writing
+bool
+extent_client::next_save(disk_save &s)
+{
+  for (auto it = saves.begin(); it != saves.end(); ++it) {
+    if (saving.count(it->eid))
+      continue;
+    s = *it;
+    saves.erase(it);
+    saving.insert(s.eid);
+    return true;
+  }
+  return false;
+}
+
+// write a save to disk with mutex_lock dropped, then make room for it by
+// dropping the least recently used ones
+void
+extent_client::write_save(disk_save &s)
+{
+  std::string buf;
+  buf.reserve(disk_header + s.attr.size);
+  buf.append((const char *) &s.attr.version, disk_header);
+  for (size_t i = 0; i < s.content.size(); i++)
+    buf.append(s.content[i].data(), s.content[i].size());
+  s.content.clear();
+
+  extent_protocol::attr a;
+  pthread_mutex_unlock(&mutex_lock);
+  int ret = disk->restore(s.eid, s.attr, buf);
+  if (ret == extent_protocol::OK)
+    ret = disk->getattr(s.eid, a);
+  pthread_mutex_lock(&mutex_lock);
+  save_bytes -= s.attr.size;
+
+  auto it = disk_index.find(s.eid);
+  if (it != disk_index.end()) {
+    disk_bytes -= it->second.attr.size;
+    disk_lru.erase(it->second.lru_pos);
+    disk_index.erase(it);
+  }
+  std::vector<extent_protocol::extentid_t> victims;
+  if (ret == extent_protocol::OK) {
+    disk_entry &d = disk_index[s.eid];
+    d.attr = s.attr;
+    d.local = a.version;
+    d.lru_pos = disk_lru.insert(disk_lru.begin(), s.eid);
+    disk_bytes += s.attr.size;
+    disk_saves++;
+    saving.erase(s.eid);
+  } else {
+    // whatever part of it made it to disk goes
+    victims.push_back(s.eid);
+  }
+  while (disk_bytes > disk_budget && !disk_lru.empty()) {
+    extent_protocol::extentid_t eid = disk_lru.back();
+    auto d = disk_index.find(eid);
+    disk_bytes -= d->second.attr.size;
+    disk_lru.pop_back();
+    disk_index.erase(d);
+    if (saving.insert(eid).second)
+      victims.push_back(eid);
+  }
+  if (victims.empty())
+    return;
+  pthread_mutex_unlock(&mutex_lock);
+  for (size_t i = 0; i < victims.size(); i++)
+    disk->remove(victims[i]);
+  pthread_mutex_lock(&mutex_lock);
+  for (size_t i = 0; i < victims.size(); i++)
+    saving.erase(victims[i]);
 }
 
 extent_protocol::status
@@ -146,24 +1359,441 @@ extent_client::flush(extent_protocol::extentid_t eid) {
     pthread_mutex_lock(&mutex_lock);
 
     extent_protocol::status ret = extent_protocol::OK;
-    
-    int r;
-
-    // cache hit
-    if (data.find(eid) != data.end()) {
-        if (to_be_removed[eid]) {
-            while (cl->call(extent_protocol::remove, eid, r) != extent_protocol::OK);
-        } else if (is_dirty[eid]) {
-            while (cl->call(extent_protocol::put, eid, data[eid], r) != extent_protocol::OK);
-        }
 
-        data.erase(eid);
-        attributes.erase(eid);
-        to_be_removed.erase(eid);
-        is_dirty.erase(eid);
+    // extents tied to this one go along, in one batch
+    if (ties.count(eid)) {
+        pthread_mutex_unlock(&mutex_lock);
+        return flush(std::vector<extent_protocol::extentid_t>(1, eid));
+    }
+
+    {
+        pin p(this, eid, false);
+        auto it = cache.find(eid);
+        if (it != cache.end())
+            wait_writeback(it->second);
+        if (it == cache.end()) {
+            // nothing cached
+        } else if (clean(it->second)) {
+            // clean entries stay, checked against the server version on next use
+            it->second.stale = true;
+            save(eid, it->second);
+        } else if ((ret = settle(eid)) == extent_protocol::OK
+                   && (ret = flush_entry(eid, it->second)) == extent_protocol::OK) {
+            drop(eid);
+        }
     }
 
     pthread_mutex_unlock(&mutex_lock);
-    
+
+    return ret;
+}
+
+// attributes of every listed extent that is not cached yet, one
+// multigetattr per server and batch
+extent_protocol::status
+extent_client::fetch_attrs(const std::vector<extent_protocol::extentid_t> &eids)
+{
+  std::map<rpcc *, std::vector<extent_protocol::extentid_t> > misses;
+  for (size_t i = 0; i < eids.size(); i++) {
+    // the entries are pinned by the caller
+    cache_entry &e = cache.find(eids[i])->second;
+    adopt(eids[i], e);
+    if ((e.has_attr && !e.stale) || e.to_be_removed)
+      continue;
+    extent_protocol::status ret = settle(eids[i]);
+    if (ret != extent_protocol::OK)
+      return ret;
+    wait_fetch(e);
+    if ((e.has_attr && !e.stale) || e.to_be_removed)
+      continue;
+    misses[server_for(eids[i])].push_back(eids[i]);
+  }
+
+  for (auto &m : misses) {
+    for (size_t i = 0; i < m.second.size(); i += batch_ids) {
+      std::vector<extent_protocol::extentid_t> ids(m.second.begin() + i,
+          m.second.begin() + std::min(m.second.size(), i + batch_ids));
+      std::map<extent_protocol::extentid_t, extent_protocol::attr> attrs;
+      std::vector<cache_entry *> claimed = begin_fetches(ids);
+      extent_protocol::status ret = call_unlocked(m.first, extent_protocol::multigetattr, ids, attrs);
+      end_fetches(claimed);
+      if (ret != extent_protocol::OK)
+        return ret;
+      for (size_t k = 0; k < ids.size(); k++) {
+        cache_entry &e = cache.find(ids[k])->second;
+        auto a = attrs.find(ids[k]);
+        if (a != attrs.end())
+          got_attr(e, a->second);
+        else
+          forget(e);
+      }
+    }
+  }
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::getattr(const std::vector<extent_protocol::extentid_t> &eids,
+                       std::map<extent_protocol::extentid_t, extent_protocol::attr> &attrs)
+{
+  ScopedLock ml(&mutex_lock);
+  pin p(this, eids);
+  extent_protocol::status ret = fetch_attrs(eids);
+  if (ret != extent_protocol::OK)
+    return ret;
+  attrs.clear();
+  for (size_t i = 0; i < eids.size(); i++) {
+    auto it = cache.find(eids[i]);
+    if (it != cache.end() && it->second.has_attr && !it->second.to_be_removed)
+      attrs[eids[i]] = it->second.attr;
+  }
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::peek_attrs(const std::vector<extent_protocol::extentid_t> &eids,
+                          std::map<extent_protocol::extentid_t, extent_protocol::attr> &attrs)
+{
+  ScopedLock ml(&mutex_lock);
+  attrs.clear();
+  std::map<rpcc *, std::vector<extent_protocol::extentid_t> > misses;
+  for (size_t i = 0; i < eids.size(); i++) {
+    auto it = cache.find(eids[i]);
+    if (it != cache.end() && !it->second.stale
+        && (it->second.has_attr || it->second.to_be_removed)) {
+      if (!it->second.to_be_removed)
+        attrs[eids[i]] = it->second.attr;
+      continue;
+    }
+    extent_protocol::status ret = settle(eids[i]);
+    if (ret != extent_protocol::OK)
+      return ret;
+    misses[server_for(eids[i])].push_back(eids[i]);
+  }
+
+  for (auto &m : misses) {
+    for (size_t i = 0; i < m.second.size(); i += batch_ids) {
+      std::vector<extent_protocol::extentid_t> ids(m.second.begin() + i,
+          m.second.begin() + std::min(m.second.size(), i + batch_ids));
+      std::map<extent_protocol::extentid_t, extent_protocol::attr> got;
+      extent_protocol::status ret = call_unlocked(m.first, extent_protocol::multigetattr, ids, got);
+      if (ret != extent_protocol::OK)
+        return ret;
+      attrs.insert(got.begin(), got.end());
+    }
+  }
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::get(const std::vector<extent_protocol::extentid_t> &eids,
+                   std::map<extent_protocol::extentid_t, std::string> &bufs)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  ScopedLock ml(&mutex_lock);
+  pin p(this, eids);
+  extent_protocol::status ret = fetch_attrs(eids);
+  if (ret != extent_protocol::OK)
+    return ret;
+
+  // extents with nothing cached come whole in one multiget per server,
+  // anything partly cached goes through the usual ranged reads below
+  std::map<rpcc *, std::vector<std::vector<extent_protocol::extentid_t> > > misses;
+  std::map<rpcc *, size_t> batch_size;
+  for (size_t i = 0; i < eids.size(); i++) {
+    auto it = cache.find(eids[i]);
+    if (it == cache.end() || it->second.to_be_removed)
+      continue;
+    cache_entry &e = it->second;
+    if (e.attr.size == 0 || !e.blocks.empty() || e.base_size != e.attr.size
+        || on_disk(eids[i], e))
+      continue;
+    rpcc *cl = server_for(eids[i]);
+    std::vector<std::vector<extent_protocol::extentid_t> > &batches = misses[cl];
+    if (batches.empty() || batch_size[cl] + e.attr.size > batch_bytes
+        || batches.back().size() >= batch_ids) {
+      batches.push_back(std::vector<extent_protocol::extentid_t>());
+      batch_size[cl] = 0;
+    }
+    batches.back().push_back(eids[i]);
+    batch_size[cl] += e.attr.size;
+  }
+  for (auto &m : misses) {
+    for (size_t i = 0; i < m.second.size(); i++) {
+      std::map<extent_protocol::extentid_t, shared_buf> contents;
+      std::vector<cache_entry *> claimed = begin_fetches(m.second[i]);
+      ret = call_unlocked(m.first, extent_protocol::multiget, m.second[i], contents);
+      end_fetches(claimed);
+      if (ret != extent_protocol::OK)
+        return ret;
+      for (auto &c : contents) {
+        auto it = cache.find(c.first);
+        // the server copy may have changed size since its attributes came
+        if (it == cache.end() || c.second.size() != it->second.attr.size)
+          continue;
+        cache_entry &e = it->second;
+        for (size_t off = 0; off < c.second.size(); off += bs)
+          set_block(e, off / bs, c.second.slice(off, std::min((size_t) bs, c.second.size() - off)));
+        e.fetches++;
+      }
+    }
+  }
+
+  bufs.clear();
+  time_t now = time(nullptr);
+  for (size_t i = 0; i < eids.size(); i++) {
+    auto it = cache.find(eids[i]);
+    if (it == cache.end() || !it->second.has_attr || it->second.to_be_removed)
+      continue;
+    cache_entry &e = it->second;
+    ret = fetch_blocks(eids[i], e, 0, e.attr.size);
+    if (ret != extent_protocol::OK)
+      return ret;
+    bufs[eids[i]] = read_cached(e, 0, e.attr.size);
+    e.attr.atime = now;
+  }
+  return extent_protocol::OK;
+}
+
+// removals and small whole-extent puts go out as one multiremove and one
+// multiput per server, everything else is written back one by one
+extent_protocol::status
+extent_client::flush(const std::vector<extent_protocol::extentid_t> &owners)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  ScopedLock ml(&mutex_lock);
+  int r;
+
+  std::vector<extent_protocol::extentid_t> eids;
+  std::set<extent_protocol::extentid_t> seen;
+  for (size_t i = 0; i < owners.size(); i++) {
+    if (seen.insert(owners[i]).second)
+      eids.push_back(owners[i]);
+    auto t = ties.find(owners[i]);
+    if (t == ties.end())
+      continue;
+    for (auto &tied : t->second)
+      if (seen.insert(tied).second)
+        eids.push_back(tied);
+  }
+
+  pin p(this, eids, false);
+  for (size_t i = 0; i < eids.size(); i++) {
+    auto it = cache.find(eids[i]);
+    if (it != cache.end())
+      wait_writeback(it->second);
+  }
+  std::map<rpcc *, std::vector<extent_protocol::extentid_t> > removes;
+  std::map<rpcc *, std::map<extent_protocol::extentid_t, std::string> > puts;
+  std::map<rpcc *, size_t> put_bytes;
+  std::vector<extent_protocol::extentid_t> done;
+  for (size_t i = 0; i < eids.size(); i++) {
+    extent_protocol::extentid_t eid = eids[i];
+    auto it = cache.find(eid);
+    if (it == cache.end())
+      continue;
+    if (clean(it->second)) {
+      it->second.stale = true;
+      save(eid, it->second);
+      continue;
+    }
+    extent_protocol::status ret = settle(eid);
+    if (ret != extent_protocol::OK)
+      return ret;
+    cache_entry &e = it->second;
+    rpcc *cl = server_for(eid);
+
+    if (e.to_be_removed) {
+      removes[cl].push_back(eid);
+    } else if (e.overwritten && e.attr.size <= flush_chunk_blocks * bs) {
+      ret = fetch_blocks(eid, e, 0, e.attr.size);
+      if (ret != extent_protocol::OK)
+        return ret;
+      if (!puts[cl].empty() && put_bytes[cl] + e.attr.size > batch_bytes) {
+        call_retry(cl, extent_protocol::multiput, extent_protocol::OK, puts[cl], r);
+        puts[cl].clear();
+        put_bytes[cl] = 0;
+      }
+      puts[cl][eid] = read_cached(e, 0, e.attr.size);
+      put_bytes[cl] += e.attr.size;
+    } else {
+      ret = flush_entry(eid, e);
+      if (ret != extent_protocol::OK)
+        return ret;
+    }
+    done.push_back(eid);
+  }
+
+  for (auto &p : puts)
+    if (!p.second.empty())
+      call_retry(p.first, extent_protocol::multiput, extent_protocol::OK, p.second, r);
+  for (auto &rm : removes) {
+    for (size_t i = 0; i < rm.second.size(); i += batch_ids) {
+      std::vector<extent_protocol::extentid_t> ids(rm.second.begin() + i,
+          rm.second.begin() + std::min(rm.second.size(), i + batch_ids));
+      call_retry(rm.first, extent_protocol::multiremove, extent_protocol::OK, ids, r);
+    }
+  }
+
+  for (size_t i = 0; i < done.size(); i++)
+    drop(done[i]);
+  for (size_t i = 0; i < owners.size(); i++)
+    ties.erase(owners[i]);
+  return extent_protocol::OK;
+}
+
+void
+extent_client::tie(extent_protocol::extentid_t eid, extent_protocol::extentid_t owner)
+{
+  ScopedLock ml(&mutex_lock);
+  if (eid != owner)
+    ties[owner].insert(eid);
+}
+
+extent_protocol::status
+extent_client::alloc(extent_protocol::extentid_t &id)
+{
+  ScopedLock ml(&mutex_lock);
+  while (next_serial == end_serial) {
+    // a refill by another thread serves us too
+    if (allocating) {
+      pthread_cond_wait(&inflight_done, &mutex_lock);
+      continue;
+    }
+    extent_protocol::status ret = settle(extent_protocol::alloc_extent);
+    if (ret != extent_protocol::OK)
+      return ret;
+    unsigned long long first;
+    allocating = true;
+    ret = call_unlocked(server_for(extent_protocol::alloc_extent), extent_protocol::alloc,
+                        alloc_block, first);
+    allocating = false;
+    pthread_cond_broadcast(&inflight_done);
+    if (ret != extent_protocol::OK)
+      return ret;
+    alloc_rpcs++;
+    next_serial = first;
+    end_serial = first + alloc_block;
+  }
+  // serials skip bit 31, which marks files
+  unsigned long long s = next_serial++;
+  id = ((s >> 31) << 32) | (s & 0x7fffffffULL);
+  return extent_protocol::OK;
+}
+
+bool
+extent_client::cached(extent_protocol::extentid_t eid)
+{
+  ScopedLock ml(&mutex_lock);
+  return cache.count(eid) > 0;
+}
+
+extent_protocol::status
+extent_client::add_entry(extent_protocol::extentid_t eid, const std::string &name,
+                         extent_protocol::extentid_t inum, extent_protocol::extentid_t &found)
+{
+  ScopedLock ml(&mutex_lock);
+  extent_protocol::status ret = settle(eid);
+  if (ret != extent_protocol::OK)
     return ret;
-}
\ No newline at end of file
+  return call_unlocked(server_for(eid), extent_protocol::add_entry, eid, name, inum, found);
+}
+
+extent_protocol::status
+extent_client::remove_entry(extent_protocol::extentid_t eid, const std::string &name,
+                            extent_protocol::extentid_t &inum)
+{
+  ScopedLock ml(&mutex_lock);
+  extent_protocol::status ret = settle(eid);
+  if (ret != extent_protocol::OK)
+    return ret;
+  return call_unlocked(server_for(eid), extent_protocol::remove_entry, eid, name, inum);
+}
+
+extent_protocol::status
+extent_client::lookup_entry(extent_protocol::extentid_t eid, const std::string &name,
+                            extent_protocol::extentid_t &inum)
+{
+  ScopedLock ml(&mutex_lock);
+  extent_protocol::status ret = settle(eid);
+  if (ret != extent_protocol::OK)
+    return ret;
+  return call_unlocked(server_for(eid), extent_protocol::lookup_entry, eid, name, inum);
+}
+
+void
+extent_client::get_stats(stats &st)
+{
+  ScopedLock ml(&mutex_lock);
+  st.revalidations = revalidations;
+  st.revalidation_hits = revalidation_hits;
+  st.alloc_rpcs = alloc_rpcs;
+  st.hits = hits;
+  st.misses = misses;
+  st.evictions = evictions;
+  st.dirty_evictions = dirty_evictions;
+  st.shared_fetches = shared_fetches;
+  st.resident_bytes = resident_bytes;
+  st.entries = cache.size();
+  st.background_writebacks = background_writebacks;
+  st.dirty_bytes = dirty_bytes;
+  st.writeback_retries = writeback_retries;
+  st.disk_reads = disk_reads;
+  st.disk_saves = disk_saves;
+  st.disk_extents = disk_index.size();
+  st.disk_bytes = disk_bytes;
+}
+
+void
+extent_client::set_budget(size_t bytes)
+{
+  ScopedLock ml(&mutex_lock);
+  budget = bytes;
+  evict();
+}
+
+void
+extent_client::set_writeback(double age, size_t bytes)
+{
+  ScopedLock ml(&mutex_lock);
+  writeback_age = age;
+  writeback_bytes = bytes;
+  pthread_cond_broadcast(&flush_signal);
+}
+
+// the store recovers what an earlier client saved, and the index is
+// rebuilt from the header of every extent in it
+void
+extent_client::set_disk_cache(const std::string &dir, size_t bytes)
+{
+  extent_store *st = new extent_store(dir);
+  std::vector<std::pair<extent_protocol::extentid_t, disk_entry> > found;
+  std::vector<extent_protocol::extentid_t> ids;
+  for (unsigned int bucket = 0; st->list(bucket, ids); bucket++) {
+    for (size_t i = 0; i < ids.size(); i++) {
+      disk_entry d;
+      shared_buf header;
+      if (st->read(ids[i], 0, disk_header, header, time(NULL), &d.attr) != extent_protocol::OK)
+        continue;
+      if (header.size() != disk_header) {
+        st->remove(ids[i]);
+        continue;
+      }
+      d.local = d.attr.version;
+      d.attr.size -= disk_header;
+      memcpy(&d.attr.version, header.data(), disk_header);
+      found.push_back(std::make_pair(ids[i], d));
+    }
+  }
+
+  ScopedLock ml(&mutex_lock);
+  assert(!disk);
+  disk = st;
+  disk_budget = bytes;
+  for (size_t i = 0; i < found.size(); i++) {
+    disk_entry &d = disk_index[found[i].first];
+    d = found[i].second;
+    d.lru_pos = disk_lru.insert(disk_lru.end(), found[i].first);
+    disk_bytes += d.attr.size;
+  }
+}
@@ -4,31 +4,406 @@
 #define extent_client_h
 
 #include <string>
+#include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <unistd.h>
 #include "extent_protocol.h"
+#include "extent_ring.h"
 #include "rpc.h"
 
+class extent_store;
+
 class extent_client {
  private:
-  rpcc *cl;
-  
+  // extents are spread over the servers by consistent hashing on their id
+  std::map<std::string, rpcc *> servers;
+  extent_ring ring;
+
+  // while the extents taken over by an added server are being moved, the
+  // ring before the addition says where they still are. an extent is moved
+  // the first time it is touched, and rebalance() sweeps the rest.
+  bool rebalancing;
+  extent_ring old_ring;
+  std::set<extent_protocol::extentid_t> settled;
+  std::vector<std::string> sweep_servers;
+  size_t sweep_server;
+  unsigned int sweep_bucket;
+  std::vector<extent_protocol::extentid_t> sweep_ids;
+  // a thread is running the sweep, which others wait out
+  bool sweeping;
+  // extents some thread is moving right now
+  std::set<extent_protocol::extentid_t> moving;
+
   pthread_mutex_t mutex_lock;
-  
-  std::map<extent_protocol::extentid_t, std::string> data;
-  std::map<extent_protocol::extentid_t, extent_protocol::attr> attributes;
-  std::map<extent_protocol::extentid_t, bool> is_dirty;
-  std::map<extent_protocol::extentid_t, bool> to_be_removed;
+
+  // cached state of one extent. file content is cached block by block so
+  // that reads and writes only move the blocks they touch.
+  struct cache_entry {
+    extent_protocol::attr attr;
+    bool has_attr;
+    // block number -> block content, always min(blocksize, size - block start) long
+    // blocks are never changed in place: a write installs a new buffer, so
+    // slices handed out by read() stay valid however long they are kept.
+    std::map<unsigned int, shared_buf> blocks;
+    std::set<unsigned int> dirty_blocks;
+    // the partial last block while the extent is being appended to. it is
+    // changed in place, so small appends do not copy the block each time,
+    // and goes into blocks once full or when anything else touches it.
+    std::string tail;
+    unsigned long long tail_start;
+    // leading bytes of the extent whose server copy is still valid for us.
+    // blocks past it read as zeros and server_size is trimmed down to it on flush.
+    unsigned long long base_size;
+    unsigned long long server_size;
+    // whole content replaced by put(), written back with a single put
+    bool overwritten;
+    bool to_be_removed;
+    // clean entry kept across a lock release. it is revalidated against
+    // the server's version the next time it is used.
+    bool stale;
+    // what the entry counts against the budget: its blocks, its tail and
+    // a fixed overhead
+    size_t bytes;
+    // operations using the entry across an unlocked RPC, see pin
+    unsigned int pins;
+    // RPCs that brought attributes or data into the entry
+    unsigned int fetches;
+    std::list<extent_protocol::extentid_t>::iterator lru_pos;
+    // on the dirty list since dirty_since, waiting for the flushers
+    bool listed;
+    double dirty_since;
+    std::list<extent_protocol::extentid_t>::iterator dirty_pos;
+    // a background write-back of the entry is in flight
+    bool writing;
+    // an RPC bringing attributes or blocks into the entry is in flight.
+    // other threads missing on the entry wait for it instead of asking too.
+    bool fetching;
+    // attr starts zeroed: the server never hands out version 0, so an
+    // entry that never had its attributes from it always revalidates
+    cache_entry() : attr(), has_attr(false), tail_start(0), base_size(0), server_size(0),
+                    overwritten(false), to_be_removed(false), stale(false),
+                    bytes(0), pins(0), fetches(0), listed(false), dirty_since(0),
+                    writing(false), fetching(false) {}
+  };
+
+  // what writing back an entry sends, taken from it under mutex_lock. the
+  // entry counts as clean from then on.
+  struct writeback {
+    bool remove;
+    // recreate the extent, with content if it fits in one put
+    bool put;
+    std::vector<shared_buf> content;
+    // trim the server copy to what is still valid
+    bool truncate;
+    unsigned long long truncate_to;
+    // runs of dirty blocks, by offset
+    std::vector<std::pair<unsigned long long, std::vector<shared_buf> > > runs;
+    // the final size, if the writes do not reach it
+    bool resize;
+    unsigned long long size;
+    writeback() : remove(false), put(false), truncate(false), truncate_to(0),
+                  resize(false), size(0) {}
+  };
+  std::unordered_map<extent_protocol::extentid_t, cache_entry> cache;
+  // every cached id, most recently used first
+  std::list<extent_protocol::extentid_t> lru;
+  size_t budget;
+  size_t resident_bytes;
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+  unsigned long long dirty_evictions;
+  // misses that waited for another thread's fetch of the same entry
+  unsigned long long shared_fetches;
+
+  // entries written by put, write or resize that the flushers have not
+  // taken yet, oldest first, and the bytes they hold
+  std::list<extent_protocol::extentid_t> dirty;
+  size_t dirty_bytes;
+  double writeback_age;
+  size_t writeback_bytes;
+  std::vector<pthread_t> flushers;
+  pthread_cond_t flush_signal;
+  // broadcast whenever a fetch, write-back, move or allocation that other
+  // threads may be waiting for is done
+  pthread_cond_t inflight_done;
+  bool stopping;
+  unsigned long long background_writebacks;
+  unsigned long long writeback_retries;
+  unsigned long long revalidations;
+  unsigned long long revalidation_hits;
+  // serials of the block granted by the allocator that are still unused
+  unsigned long long next_serial;
+  unsigned long long end_serial;
+  unsigned long long alloc_rpcs;
+  bool allocating;
+  // extents covered by another extent's lock, see tie()
+  std::map<extent_protocol::extentid_t, std::set<extent_protocol::extentid_t> > ties;
+
+  // the disk tier: whole clean extents saved in a local extent_store, each
+  // behind the server version it had, so they survive a restart. an entry
+  // taken from it is kept like one across a lock release: revalidated by
+  // version on first use, then its blocks are read from disk.
+  extent_store *disk;
+  struct disk_entry {
+    // attributes with the server's version of the saved content
+    extent_protocol::attr attr;
+    // the store's own version of the record, checked by every read so
+    // it never mixes two saves
+    unsigned long long local;
+    std::list<extent_protocol::extentid_t>::iterator lru_pos;
+  };
+  std::unordered_map<extent_protocol::extentid_t, disk_entry> disk_index;
+  // every saved id, most recently saved or used first
+  std::list<extent_protocol::extentid_t> disk_lru;
+  size_t disk_budget;
+  size_t disk_bytes;
+  // content waiting for the flushers to write it to disk
+  struct disk_save {
+    extent_protocol::extentid_t eid;
+    extent_protocol::attr attr;
+    std::vector<shared_buf> content;
+  };
+  std::list<disk_save> saves;
+  size_t save_bytes;
+  // ids being written to disk by a flusher
+  std::set<extent_protocol::extentid_t> saving;
+  unsigned long long disk_reads;
+  unsigned long long disk_saves;
+
+  // every RPC goes out with mutex_lock dropped, so one slow call does not
+  // hold up other threads. what it works on is marked as in flight
+  // (fetching, writing, moving, allocating) and pinned, and threads that
+  // need the same wait on inflight_done rather than sending their own call.
+  template<class... Args>
+  int call_unlocked(rpcc *cl, unsigned int proc, Args &&... args) {
+    pthread_mutex_unlock(&mutex_lock);
+    int ret = cl->call(proc, std::forward<Args>(args)...);
+    pthread_mutex_lock(&mutex_lock);
+    return ret;
+  }
+
+  // write-back calls are retried until the server takes them, backing off
+  // from 1 ms to at most a second between attempts. also_ok is a failure
+  // that is as good as success.
+  template<class... Args>
+  int call_retry(rpcc *cl, unsigned int proc, int also_ok, Args &... args) {
+    useconds_t delay = 1000;
+    while (true) {
+      int ret = call_unlocked(cl, proc, args...);
+      if (ret == extent_protocol::OK || ret == also_ok)
+        return ret;
+      writeback_retries++;
+      pthread_mutex_unlock(&mutex_lock);
+      usleep(delay);
+      pthread_mutex_lock(&mutex_lock);
+      delay = std::min(delay * 2, (useconds_t) 1000000);
+    }
+  }
+
+  // an operation's entries stay in the cache while it uses them, even when
+  // it drops mutex_lock for an RPC. a lookup creates missing entries and
+  // is counted as a hit if none of them needed an RPC. the pin is taken
+  // and released with mutex_lock held; the release evicts down to the
+  // budget, which may drop mutex_lock to write entries back, so nothing
+  // found before it can be relied on after it.
+  class pin {
+   private:
+    typedef std::pair<extent_protocol::extentid_t, unsigned int> pinned_entry;
+    extent_client *c;
+    bool lookup;
+    // the usual single entry, then any others with their fetch counts
+    bool has_first;
+    pinned_entry first;
+    cache_entry *first_entry;
+    std::vector<pinned_entry> rest;
+    void add(extent_protocol::extentid_t eid);
+    void release(const pinned_entry &p);
+   public:
+    pin(extent_client *c, extent_protocol::extentid_t eid, bool lookup = true);
+    pin(extent_client *c, const std::vector<extent_protocol::extentid_t> &eids, bool lookup = true);
+    ~pin();
+    // the entry of a single id lookup
+    cache_entry &entry() { return *first_entry; }
+  };
+
+  rpcc *connect(const std::string &dst);
+  rpcc *server_for(extent_protocol::extentid_t eid);
+  extent_protocol::status settle(extent_protocol::extentid_t eid);
+  bool sweep(unsigned int max);
+  extent_protocol::status move(extent_protocol::extentid_t eid, rpcc *from, rpcc *to);
+
+  extent_protocol::status fetch_attr(extent_protocol::extentid_t eid, cache_entry &e);
+  extent_protocol::status fetch_attrs(const std::vector<extent_protocol::extentid_t> &eids);
+  extent_protocol::status fetch(extent_protocol::extentid_t eid, cache_entry &e,
+                                unsigned long long off, unsigned long long size);
+  extent_protocol::status fetch_blocks(extent_protocol::extentid_t eid, cache_entry &e,
+                                       unsigned long long off, unsigned long long end);
+  void slice_cached(cache_entry &e, unsigned long long off, unsigned long long end,
+                    std::vector<shared_buf> &bufs);
+  std::string read_cached(cache_entry &e, unsigned long long off, unsigned long long end);
+  void resize_cached(cache_entry &e, unsigned long long size);
+  void append_cached(cache_entry &e, const std::string &buf);
+  void cut_tail(cache_entry &e);
+  void wait_fetch(cache_entry &e);
+  void end_fetch(cache_entry &e);
+  std::vector<cache_entry *> begin_fetches(const std::vector<extent_protocol::extentid_t> &eids);
+  void end_fetches(const std::vector<cache_entry *> &es);
+  extent_protocol::status flush_entry(extent_protocol::extentid_t eid, cache_entry &e);
+  static bool clean(const cache_entry &e);
+  void got_attr(cache_entry &e, const extent_protocol::attr &a);
+  void fill_blocks(cache_entry &e, unsigned long long start, const shared_buf &data);
+  void forget(cache_entry &e);
+
+  cache_entry &use(extent_protocol::extentid_t eid);
+  void drop(extent_protocol::extentid_t eid);
+  void charge(cache_entry &e, long long bytes);
+  void set_block(cache_entry &e, unsigned int bno, const shared_buf &b);
+  void erase_blocks(cache_entry &e, unsigned int from);
+  void clear_blocks(cache_entry &e);
+  void evict();
+
+  void mark_dirty(extent_protocol::extentid_t eid, cache_entry &e);
+  void unlink_dirty(cache_entry &e);
+  void wait_writeback(cache_entry &e);
+  extent_protocol::status take_writeback(extent_protocol::extentid_t eid, cache_entry &e,
+                                         writeback &w);
+  void send_writeback(extent_protocol::extentid_t eid, writeback &w);
+  extent_protocol::status write_back(extent_protocol::extentid_t eid, cache_entry &e);
+  bool next_writeback(extent_protocol::extentid_t &eid);
+
+  void adopt(extent_protocol::extentid_t eid, cache_entry &e);
+  bool on_disk(extent_protocol::extentid_t eid, const cache_entry &e);
+  bool read_disk(extent_protocol::extentid_t eid, unsigned long long off,
+                 unsigned int size, shared_buf &buf);
+  void save(extent_protocol::extentid_t eid, cache_entry &e);
+  bool next_save(disk_save &s);
+  void write_save(disk_save &s);
 
  public:
+  struct stats {
+    // kept entries checked against the server, and those found unchanged
+    unsigned long long revalidations;
+    unsigned long long revalidation_hits;
+    // blocks of ids fetched from the allocator
+    unsigned long long alloc_rpcs;
+    // lookups served from the cache and those that needed an RPC
+    unsigned long long hits;
+    unsigned long long misses;
+    // entries dropped to stay within the budget, and those of them that
+    // had to be written back first
+    unsigned long long evictions;
+    unsigned long long dirty_evictions;
+    // misses served by another thread's fetch of the same extent
+    unsigned long long shared_fetches;
+    size_t resident_bytes;
+    size_t entries;
+    // entries written back by the flushers ahead of their lock's release,
+    // what is dirty now, and write-back calls that had to be retried
+    unsigned long long background_writebacks;
+    size_t dirty_bytes;
+    unsigned long long writeback_retries;
+    // block runs read from the disk tier instead of the server, extents
+    // written to it, and what it holds
+    unsigned long long disk_reads;
+    unsigned long long disk_saves;
+    size_t disk_extents;
+    size_t disk_bytes;
+  };
+
+  // dst is a comma separated list of extent servers
   extent_client(std::string dst);
+  ~extent_client();
 
-  extent_protocol::status get(extent_protocol::extentid_t eid, 
+  extent_protocol::status get(extent_protocol::extentid_t eid,
 			      std::string &buf);
-  extent_protocol::status getattr(extent_protocol::extentid_t eid, 
+  extent_protocol::status getattr(extent_protocol::extentid_t eid,
 				  extent_protocol::attr &a);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
   extent_protocol::status flush(extent_protocol::extentid_t eid);
+
+  // the same for many extents at once. misses and write-backs are grouped
+  // into one multi-extent RPC per server; ids that do not exist are left
+  // out of the result.
+  extent_protocol::status get(const std::vector<extent_protocol::extentid_t> &eids,
+                              std::map<extent_protocol::extentid_t, std::string> &bufs);
+  extent_protocol::status getattr(const std::vector<extent_protocol::extentid_t> &eids,
+                                  std::map<extent_protocol::extentid_t, extent_protocol::attr> &attrs);
+  extent_protocol::status flush(const std::vector<extent_protocol::extentid_t> &eids);
+
+  // attributes for callers that do not hold the extents' locks: valid
+  // cached ones as they are, the rest from one multigetattr per server and
+  // batch. what comes from the servers is not cached, since nothing would
+  // tell us when it changes.
+  extent_protocol::status peek_attrs(const std::vector<extent_protocol::extentid_t> &eids,
+                                     std::map<extent_protocol::extentid_t, extent_protocol::attr> &attrs);
+
+  // eid is only used under owner's lock, so it is written back and marked
+  // for revalidation whenever owner is flushed. the tie lasts until then.
+  void tie(extent_protocol::extentid_t eid, extent_protocol::extentid_t owner);
+
+  // a fresh, never used extent id with bit 31 clear. ids come from blocks
+  // the allocator grants this client, so they are dense and in creation
+  // order, and only one call in alloc_block goes to the server.
+  extent_protocol::status alloc(extent_protocol::extentid_t &id);
+
+  // whether eid has a cached copy, possibly one kept for revalidation
+  bool cached(extent_protocol::extentid_t eid);
+
+  // single directory entries of a dir_bucket extent, changed in place on
+  // the server. only for extents that are not cached, the caller holds the
+  // directory's lock. add_entry returns FBIG if the bucket has to be split,
+  // found is the inum the name has afterwards, which it may have had already.
+  extent_protocol::status add_entry(extent_protocol::extentid_t eid, const std::string &name,
+                                    extent_protocol::extentid_t inum,
+                                    extent_protocol::extentid_t &found);
+  extent_protocol::status remove_entry(extent_protocol::extentid_t eid, const std::string &name,
+                                       extent_protocol::extentid_t &inum);
+  extent_protocol::status lookup_entry(extent_protocol::extentid_t eid, const std::string &name,
+                                       extent_protocol::extentid_t &inum);
+
+  // byte range access, only the blocks overlapping the range are fetched or dirtied
+  extent_protocol::status read(extent_protocol::extentid_t eid, unsigned long long off,
+                               unsigned int size, std::string &buf);
+  // the same without copying: slices of the cached blocks, in order
+  extent_protocol::status read(extent_protocol::extentid_t eid, unsigned long long off,
+                               unsigned int size, std::vector<shared_buf> &bufs);
+  extent_protocol::status write(extent_protocol::extentid_t eid, unsigned long long off,
+                                const std::string &buf);
+  extent_protocol::status resize(extent_protocol::extentid_t eid, unsigned long long size);
+
+  // add a server to the ring. only the extents it takes over move to it,
+  // lazily and through rebalance(); the file system stays usable meanwhile.
+  void add_server(std::string dst);
+  // move up to max extents left behind by add_server, false once done
+  bool rebalance(unsigned int max);
+  unsigned int nservers();
+
+  void get_stats(stats &);
+
+  // bytes of cached attributes and content to stay within. YFS_CACHE_MB
+  // sets it at startup, the default is 256 MB.
+  void set_budget(size_t bytes);
+
+  // the flushers write an entry back once it has been dirty for age
+  // seconds, or earlier while more than bytes are dirty. the defaults are
+  // 3 seconds and 32 MB.
+  void set_writeback(double age, size_t bytes);
+
+  // keep clean extents in dir as well, up to bytes of them, and pick up
+  // what an earlier client left there. YFS_DISK_CACHE names the directory
+  // at startup, YFS_DISK_CACHE_MB the size, 1 GB by default.
+  void set_disk_cache(const std::string &dir, size_t bytes);
+
+  // body of the flusher threads
+  void flusher();
 };
 
-#endif 
+#endif
 
@@ -14,15 +14,45 @@ class extent_protocol {
     put = 0x6001,
     get,
     getattr,
-    remove
+    remove,
+    read,
+    write,
+    resize,
+    list,
+    restore,
+    multiget,
+    multigetattr,
+    multiput,
+    multiremove,
+    readattr,
+    get_if_changed,
+    add_entry,
+    remove_entry,
+    lookup_entry,
+    alloc
   };
   static const unsigned int maxextent = 8192*1000;
+  // extents are stored and cached in blocks of this many bytes
+  static const unsigned int blocksize = 4096;
+  // holds the next serial the id allocator hands out. the server the ring
+  // names for it runs the allocator.
+  static const extentid_t alloc_extent = 0;
+  // files have bit 31 of their id set, directories do not
+  static bool isfile(extentid_t id) { return id & 0x80000000; }
 
   struct attr {
     unsigned int atime;
     unsigned int mtime;
     unsigned int ctime;
     unsigned int size;
+    // changes with every modification of the extent, never repeats
+    unsigned long long version;
+  };
+
+  // a range of an extent together with the attributes it was read under
+  struct extent {
+    attr a;
+    shared_buf data;
   };
 };
 
@@ -33,6 +63,7 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
   u >> a.mtime;
   u >> a.ctime;
   u >> a.size;
+  u >> a.version;
   return u;
 }
 
@@ -43,6 +74,23 @@ operator<<(marshall &m, extent_protocol::attr a)
   m << a.mtime;
   m << a.ctime;
   m << a.size;
+  m << a.version;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::extent &x)
+{
+  u >> x.a;
+  u >> x.data;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::extent &x)
+{
+  m << x.a;
+  m << x.data;
   return m;
 }
 
@@ -0,0 +1,52 @@
+// consistent hash ring, see extent_ring.h
+
+#include "extent_ring.h"
+#include <algorithm>
+#include <assert.h>
+
+// splitmix64 finalizer, spreads dense inode numbers over the whole ring
+uint64_t
+extent_ring::mix(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+void
+extent_ring::add(const std::string &server)
+{
+  if (contains(server))
+    return;
+  members.push_back(server);
+
+  // FNV-1a of the name, then one point per vnode
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < server.size(); i++)
+    h = (h ^ (unsigned char) server[i]) * 1099511628211ULL;
+  for (unsigned int v = 0; v < vnodes; v++) {
+    uint64_t p = mix(h + v);
+    // on the rare collision the earlier server keeps the point
+    if (!points.count(p))
+      points[p] = server;
+  }
+}
+
+bool
+extent_ring::contains(const std::string &server) const
+{
+  return std::find(members.begin(), members.end(), server) != members.end();
+}
+
+const std::string &
+extent_ring::owner(extent_protocol::extentid_t id) const
+{
+  assert(!points.empty());
+  auto it = points.lower_bound(mix(id));
+  if (it == points.end())
+    it = points.begin();
+  return it->second;
+}
@@ -0,0 +1,35 @@
+// consistent hashing of extent ids onto extent servers
+
+#ifndef extent_ring_h
+#define extent_ring_h
+
+#include <string>
+#include <map>
+#include <vector>
+#include <stdint.h>
+#include "extent_protocol.h"
+
+// Every server is hashed to vnodes points on a 64-bit ring, and an extent
+// belongs to the server owning the first point at or after the hash of its
+// id. Adding a server therefore only takes over the extents that fall just
+// before its new points, about 1/n of them, and moves none between the
+// servers that were already there. Servers are named by their "host:port"
+// or "port" string, so every client must be given the same names.
+class extent_ring {
+ public:
+  static const unsigned int vnodes = 128;
+
+  void add(const std::string &server);
+  bool contains(const std::string &server) const;
+  bool empty() const { return points.empty(); }
+  const std::string &owner(extent_protocol::extentid_t id) const;
+  const std::vector<std::string> &servers() const { return members; }
+
+ private:
+  std::map<uint64_t, std::string> points;
+  std::vector<std::string> members;
+
+  static uint64_t mix(uint64_t);
+};
+
+#endif
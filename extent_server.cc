@@ -2,90 +2,263 @@
 
 #include "extent_server.h"
 #include <sstream>
+#include <string.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include "slock.h"
 
-extent_server::extent_server() {
+extent_server::extent_server(std::string dir, bool sync) {
+  pthread_mutex_init(&alloc_lock, NULL);
+  store = new extent_store(dir, sync);
   // root folder with id 1 need to exist
-  int dummy;
-  put(1, std::string(""), dummy);
-  pthread_mutex_init(&map_lock, NULL);
+  if (!store->exists(1)) {
+    int dummy;
+    put(1, std::string(""), dummy);
+  }
+}
+
+extent_server::~extent_server() {
+  delete store;
 }
 
 
 int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
 {
-  pthread_mutex_lock(&map_lock);
+  return store->put(id, buf, time(NULL));
+}
 
-  extent_t extent;
-  extent.data = buf;
-  extent.attr.size = buf.size();
-  extent.attr.atime = extent.attr.mtime = extent.attr.ctime = time(NULL);
-  files[id] = extent;
+int extent_server::get(extent_protocol::extentid_t id, shared_buf &buf)
+{
+  int ret = store->read(id, 0, ~0U, buf, time(NULL));
+  if (ret == extent_protocol::NOENT)
+    printf("ERROR! extent_server: get id %016llx not found\n", id);
+  return ret;
+}
 
-  pthread_mutex_unlock(&map_lock);
+int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
+{
+  if (store->getattr(id, a) != extent_protocol::OK) {
+    printf("ERROR! extent_server: getattr id %016llx not found\n", id);
+    return extent_protocol::NOENT;
+  }
   return extent_protocol::OK;
 }
 
-int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
+int extent_server::remove(extent_protocol::extentid_t id, int &)
 {
-  pthread_mutex_lock(&map_lock);
+  int ret = store->remove(id);
+  if (ret == extent_protocol::NOENT)
+    printf("ERROR! extent_server: remove id %016llx not found\n", id);
+  return ret;
+}
 
-  if (files.find(id) == files.end()) {
-    printf("ERROR! extent_server: get id %016llx not found\n", id);
-    pthread_mutex_unlock(&map_lock);
-    return extent_protocol::NOENT;
+int extent_server::read(extent_protocol::extentid_t id, unsigned long long off, unsigned int size, shared_buf &buf)
+{
+  int ret = store->read(id, off, size, buf, time(NULL));
+  if (ret == extent_protocol::NOENT)
+    printf("ERROR! extent_server: read id %016llx not found\n", id);
+  return ret;
+}
+
+int extent_server::readattr(extent_protocol::extentid_t id, unsigned long long off,
+                            unsigned int size, extent_protocol::extent &x)
+{
+  int ret = store->read(id, off, size, x.data, time(NULL), &x.a);
+  if (ret == extent_protocol::NOENT)
+    printf("ERROR! extent_server: readattr id %016llx not found\n", id);
+  return ret;
+}
+
+int extent_server::get_if_changed(extent_protocol::extentid_t id, unsigned long long version,
+                                  extent_protocol::extent &x)
+{
+  return store->read_if_changed(id, version, x.data, x.a, time(NULL));
+}
+
+int extent_server::write(extent_protocol::extentid_t id, unsigned long long off, std::string buf, int &)
+{
+  int ret = store->write(id, off, buf, time(NULL));
+  if (ret == extent_protocol::NOENT)
+    printf("ERROR! extent_server: write id %016llx not found\n", id);
+  return ret;
+}
+
+int extent_server::resize(extent_protocol::extentid_t id, unsigned long long size, int &)
+{
+  int ret = store->resize(id, size, time(NULL));
+  if (ret == extent_protocol::NOENT)
+    printf("ERROR! extent_server: resize id %016llx not found\n", id);
+  return ret;
+}
+
+int extent_server::list(unsigned int bucket, std::vector<extent_protocol::extentid_t> &ids)
+{
+  return store->list(bucket, ids) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+int extent_server::restore(extent_protocol::extentid_t id, extent_protocol::attr a, std::string buf, int &)
+{
+  return store->restore(id, a, buf);
+}
+
+int extent_server::multiget(std::vector<extent_protocol::extentid_t> ids,
+                            std::map<extent_protocol::extentid_t, shared_buf> &bufs)
+{
+  unsigned int now = time(NULL);
+  for (size_t i = 0; i < ids.size(); i++) {
+    shared_buf buf;
+    if (store->read(ids[i], 0, ~0U, buf, now) == extent_protocol::OK)
+      bufs[ids[i]] = buf;
   }
-  extent_t& extent = files[id];
-  buf = extent.data;
-  extent.attr.atime = time(NULL);
+  return extent_protocol::OK;
+}
 
-  pthread_mutex_unlock(&map_lock);
+int extent_server::multigetattr(std::vector<extent_protocol::extentid_t> ids,
+                                std::map<extent_protocol::extentid_t, extent_protocol::attr> &attrs)
+{
+  for (size_t i = 0; i < ids.size(); i++) {
+    extent_protocol::attr a;
+    if (store->getattr(ids[i], a) == extent_protocol::OK)
+      attrs[ids[i]] = a;
+  }
   return extent_protocol::OK;
 }
 
-int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
+int extent_server::multiput(std::map<extent_protocol::extentid_t, std::string> extents, int &)
 {
-  pthread_mutex_lock(&map_lock);
+  unsigned int now = time(NULL);
+  for (auto &it : extents) {
+    int ret = store->put(it.first, it.second, now);
+    if (ret != extent_protocol::OK)
+      return ret;
+  }
+  return extent_protocol::OK;
+}
 
-  if (files.find(id) == files.end()) {
-    printf("ERROR! extent_server: getattr id %016llx not found\n", id);
-    pthread_mutex_unlock(&map_lock);
-    return extent_protocol::NOENT;
+int extent_server::multiremove(std::vector<extent_protocol::extentid_t> ids, int &)
+{
+  for (size_t i = 0; i < ids.size(); i++) {
+    int ret = store->remove(ids[i]);
+    if (ret != extent_protocol::OK && ret != extent_protocol::NOENT)
+      return ret;
   }
-  extent_t extent = files[id];
-  a.size = extent.attr.size;
-  a.atime = extent.attr.atime;
-  a.mtime = extent.attr.mtime;
-  a.ctime = extent.attr.ctime;
+  return extent_protocol::OK;
+}
 
-  pthread_mutex_unlock(&map_lock);
+int extent_server::read_bucket(extent_protocol::extentid_t id, std::string &data,
+                               dir_bucket::header &h)
+{
+  shared_buf buf;
+  int ret = store->read(id, 0, ~0U, buf, time(NULL));
+  if (ret != extent_protocol::OK)
+    return ret;
+  data = buf.str();
+  if (!dir_bucket::read_header(data, h)) {
+    printf("ERROR! extent_server: %016llx is not a directory bucket\n", id);
+    return extent_protocol::IOERR;
+  }
   return extent_protocol::OK;
 }
 
-int extent_server::remove(extent_protocol::extentid_t id, int &)
+int extent_server::add_entry(extent_protocol::extentid_t id, std::string name,
+                             unsigned long long inum, unsigned long long &found)
 {
-  pthread_mutex_lock(&map_lock);
+  std::string data;
+  dir_bucket::header h;
+  int ret = read_bucket(id, data, h);
+  if (ret != extent_protocol::OK)
+    return ret;
+  size_t pos;
+  dir_bucket::record r;
+  if (dir_bucket::find(data, h, name, pos, r)) {
+    found = r.inum;
+    return extent_protocol::OK;
+  }
+  found = inum;
 
-  auto it = files.find(id);
-  if (it == files.end()) {
-    printf("ERROR! extent_server: remove id %016llx not found\n", id);
-    pthread_mutex_unlock(&map_lock);
+  std::string rec = dir_bucket::encode_record(name, inum);
+  if (h.end + rec.size() > dir_bucket::max_bytes && h.depth < dir_bucket::max_depth) {
+    if (h.end - h.dead + rec.size() > dir_bucket::max_bytes)
+      return extent_protocol::FBIG;
+    // dropping the dead records makes room
+    std::vector<dir_bucket::entry> entries;
+    dir_bucket::parse(data, entries);
+    entries.push_back(dir_bucket::entry(name, inum));
+    return store->put(id, dir_bucket::encode(entries, h.depth), time(NULL));
+  }
+
+  // the record and the header that counts it go in one put, so readers
+  // without the directory's lock never see one without the other
+  if (data.size() < h.end + rec.size())
+    data.resize(h.end + rec.size());
+  data.replace(h.end, rec.size(), rec);
+  h.end += rec.size();
+  h.nentries++;
+  data.replace(0, sizeof(h), (const char *) &h, sizeof(h));
+  return store->put(id, data, time(NULL));
+}
+
+int extent_server::remove_entry(extent_protocol::extentid_t id, std::string name,
+                                unsigned long long &inum)
+{
+  std::string data;
+  dir_bucket::header h;
+  int ret = read_bucket(id, data, h);
+  if (ret != extent_protocol::OK)
+    return ret;
+  size_t pos;
+  dir_bucket::record r;
+  if (!dir_bucket::find(data, h, name, pos, r))
     return extent_protocol::NOENT;
+  inum = r.inum;
+
+  unsigned int now = time(NULL);
+  h.nentries--;
+  h.dead += sizeof(r) + r.namelen;
+  memset(&data[pos + offsetof(dir_bucket::record, live)], 0, sizeof(r.live));
+  if (h.dead * 2 > dir_bucket::max_bytes) {
+    std::vector<dir_bucket::entry> entries;
+    dir_bucket::parse(data, entries);
+    return store->put(id, dir_bucket::encode(entries, h.depth), now);
   }
-  files.erase(it);
+  // the dead flag and the header in one put, as in add_entry
+  data.replace(0, sizeof(h), (const char *) &h, sizeof(h));
+  return store->put(id, data, now);
+}
 
-  pthread_mutex_unlock(&map_lock);
+int extent_server::lookup_entry(extent_protocol::extentid_t id, std::string name,
+                                unsigned long long &inum)
+{
+  std::string data;
+  dir_bucket::header h;
+  int ret = read_bucket(id, data, h);
+  if (ret != extent_protocol::OK)
+    return ret;
+  size_t pos;
+  dir_bucket::record r;
+  if (!dir_bucket::find(data, h, name, pos, r))
+    return extent_protocol::NOENT;
+  inum = r.inum;
   return extent_protocol::OK;
 }
 
-
-bool isfile(extent_protocol::extentid_t inum)
+int extent_server::alloc(unsigned int count, unsigned long long &first)
 {
-  if(inum & 0x80000000)
-    return true;
-  return false;
-}
\ No newline at end of file
+  ScopedLock al(&alloc_lock);
+  unsigned long long next = 2;
+  shared_buf buf;
+  int ret = store->read(extent_protocol::alloc_extent, 0, sizeof(next), buf, time(NULL));
+  if (ret == extent_protocol::OK && buf.size() == sizeof(next))
+    memcpy(&next, buf.data(), sizeof(next));
+  else if (ret != extent_protocol::NOENT)
+    return extent_protocol::IOERR;
+
+  first = next;
+  next += count;
+  return store->put(extent_protocol::alloc_extent,
+                    std::string((const char *) &next, sizeof(next)), time(NULL));
+}
@@ -5,27 +5,73 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <pthread.h>
 #include "extent_protocol.h"
-
-struct extent_t {
-  std::string data;
-  extent_protocol::attr attr;
-};
+#include "extent_store.h"
+#include "dir_bucket.h"
 
 class extent_server {
 private:
-  // folder inode stores folder content in format 'inum:folder1/folder2/../filename' separeted by \n
-  // file inode stores the file content as string with null bytes encoded as '\0'
-  pthread_mutex_t map_lock;
-  std::map<extent_protocol::extentid_t, extent_t> files;
+  // a file's extent holds its bytes as they are. a directory's extent
+  // holds the root of a hashed directory and its buckets live in extents
+  // of their own, laid out as yfs_dir.h and dir_bucket.h describe. the
+  // entry RPCs change a single bucket in place.
+  extent_store *store;
 
 public:
-  extent_server();
+  extent_server(std::string dir, bool sync = false);
+  ~extent_server();
 
   int put(extent_protocol::extentid_t id, std::string, int &);
-  int get(extent_protocol::extentid_t id, std::string &);
+  // content is returned in a shared_buf so the reply references it
+  int get(extent_protocol::extentid_t id, shared_buf &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
+  int read(extent_protocol::extentid_t id, unsigned long long off, unsigned int size, shared_buf &);
+  // read plus the attributes, so a cold client needs one round trip
+  int readattr(extent_protocol::extentid_t id, unsigned long long off, unsigned int size,
+               extent_protocol::extent &);
+  // attributes, plus the whole content if the version is not the given one.
+  // lets a client revalidate what it kept cached in one cheap round trip.
+  int get_if_changed(extent_protocol::extentid_t id, unsigned long long version,
+                     extent_protocol::extent &);
+  int write(extent_protocol::extentid_t id, unsigned long long off, std::string buf, int &);
+  int resize(extent_protocol::extentid_t id, unsigned long long size, int &);
+  // ids stored in one bucket of the index, NOENT past the last bucket.
+  // lets clients enumerate a server to rebalance it.
+  int list(unsigned int bucket, std::vector<extent_protocol::extentid_t> &);
+  // put that keeps the given times, for extents moving between servers
+  int restore(extent_protocol::extentid_t id, extent_protocol::attr a, std::string buf, int &);
+
+  // batched calls, one round trip for many extents. ids that do not
+  // exist are left out of the result or skipped.
+  int multiget(std::vector<extent_protocol::extentid_t> ids,
+               std::map<extent_protocol::extentid_t, shared_buf> &);
+  int multigetattr(std::vector<extent_protocol::extentid_t> ids,
+                   std::map<extent_protocol::extentid_t, extent_protocol::attr> &);
+  int multiput(std::map<extent_protocol::extentid_t, std::string> extents, int &);
+  int multiremove(std::vector<extent_protocol::extentid_t> ids, int &);
+
+  // one entry of a directory bucket (see dir_bucket.h), changed in place so
+  // the client sends just the name. the client holds the directory's lock.
+  // add_entry returns FBIG when the bucket is full and must be split by the
+  // client. a name that is there already is left alone; found is the inum
+  // the name has afterwards either way.
+  int add_entry(extent_protocol::extentid_t id, std::string name,
+                unsigned long long inum, unsigned long long &found);
+  int remove_entry(extent_protocol::extentid_t id, std::string name, unsigned long long &inum);
+  int lookup_entry(extent_protocol::extentid_t id, std::string name, unsigned long long &inum);
+
+  // grant count consecutive serials for new ids, starting at first. the
+  // next free one is kept in alloc_extent, so a restart never hands out
+  // the same serial twice. serial 1 is the root directory.
+  int alloc(unsigned int count, unsigned long long &first);
+
+ private:
+  pthread_mutex_t alloc_lock;
+
+  int read_bucket(extent_protocol::extentid_t id, std::string &data, dir_bucket::header &);
 };
 
 #endif 
@@ -10,11 +10,14 @@ int
 main(int argc, char *argv[])
 {
   int count = 0;
+  bool sync = false;
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  if(argc != 2 && argc != 3){
+    fprintf(stderr, "Usage: %s port [datadir]\n", argv[0]);
     exit(1);
   }
+  // extents survive restarts in datadir, one per port by default
+  std::string dir = argc == 3 ? argv[2] : std::string("extents-") + argv[1];
 
   setvbuf(stdout, NULL, _IONBF, 0);
 
@@ -23,13 +26,34 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
+  // fdatasync every mutation instead of leaving it to the page cache
+  char *sync_env = getenv("EXTENT_SYNC");
+  if(sync_env != NULL){
+    sync = atoi(sync_env) != 0;
+  }
+
   rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  extent_server ls(dir, sync);
 
   server.reg(extent_protocol::get, &ls, &extent_server::get);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
+  server.reg(extent_protocol::write, &ls, &extent_server::write);
+  server.reg(extent_protocol::resize, &ls, &extent_server::resize);
+  server.reg(extent_protocol::list, &ls, &extent_server::list);
+  server.reg(extent_protocol::restore, &ls, &extent_server::restore);
+  server.reg(extent_protocol::multiget, &ls, &extent_server::multiget);
+  server.reg(extent_protocol::multigetattr, &ls, &extent_server::multigetattr);
+  server.reg(extent_protocol::multiput, &ls, &extent_server::multiput);
+  server.reg(extent_protocol::multiremove, &ls, &extent_server::multiremove);
+  server.reg(extent_protocol::readattr, &ls, &extent_server::readattr);
+  server.reg(extent_protocol::get_if_changed, &ls, &extent_server::get_if_changed);
+  server.reg(extent_protocol::add_entry, &ls, &extent_server::add_entry);
+  server.reg(extent_protocol::remove_entry, &ls, &extent_server::remove_entry);
+  server.reg(extent_protocol::lookup_entry, &ls, &extent_server::lookup_entry);
+  server.reg(extent_protocol::alloc, &ls, &extent_server::alloc);
 
   while(1)
     sleep(1000);
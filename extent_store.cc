@@ -0,0 +1,883 @@
+// log-structured extent storage, see extent_store.h for the layout
+
+#include "extent_store.h"
+#include "slock.h"
+#include <algorithm>
+#include <vector>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+static const uint32_t record_magic = 0x4c545845;  // "EXTL"
+
+static void *
+compactthread(void *x)
+{
+  extent_store *s = (extent_store *) x;
+  s->compacter();
+  return 0;
+}
+
+static bool
+read_file(const std::string &path, std::string &buf)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  buf.resize(st.st_size);
+  size_t done = 0;
+  while (done < buf.size()) {
+    ssize_t n = pread(fd, &buf[done], buf.size() - done, done);
+    if (n <= 0) {
+      close(fd);
+      return false;
+    }
+    done += n;
+  }
+  close(fd);
+  return true;
+}
+
+static bool
+write_all(int fd, const char *buf, size_t len, off_t off)
+{
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return true;
+}
+
+extent_store::extent_store(std::string _dir, bool _sync, unsigned long long _segment_max)
+  : dir(_dir), sync(_sync), segment_max(_segment_max), stopping(false),
+    compacting(false), active(0), next_version((unsigned long long) time(NULL) << 32)
+{
+  for (unsigned int i = 0; i < nshards; i++)
+    pthread_rwlock_init(&shards[i].lock, NULL);
+  pthread_mutex_init(&append_lock, NULL);
+  pthread_cond_init(&stop_signal, NULL);
+  pthread_rwlock_init(&seg_lock, NULL);
+
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    printf("extent_store: cannot create %s: %s\n", dir.c_str(), strerror(errno));
+    exit(1);
+  }
+  recover();
+
+  int r = pthread_create(&compact_thread, NULL, &compactthread, (void *) this);
+  assert(r == 0);
+}
+
+extent_store::~extent_store()
+{
+  pthread_mutex_lock(&append_lock);
+  stopping = true;
+  pthread_cond_broadcast(&stop_signal);
+  pthread_mutex_unlock(&append_lock);
+  pthread_join(compact_thread, NULL);
+
+  // a clean shutdown leaves hints for the active segment too
+  fdatasync(segments[active].fd);
+  write_hints(active);
+  for (auto &it : segments)
+    close(it.second.fd);
+}
+
+extent_store::shard &
+extent_store::shard_for(extent_protocol::extentid_t id)
+{
+  // fibonacci hashing, so that dense inode numbers spread over all shards
+  return shards[(id * 0x9E3779B97F4A7C15ULL) >> 58];
+}
+
+// entries of the segment map are only erased by compaction once nothing in
+// the index refers to them, so the reference stays valid for the caller
+extent_store::segment &
+extent_store::get_segment(uint32_t id)
+{
+  ScopedReadLock rl(&seg_lock);
+  auto it = segments.find(id);
+  assert(it != segments.end());
+  return it->second;
+}
+
+std::string
+extent_store::seg_path(uint32_t id)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/%08u.seg", id);
+  return dir + name;
+}
+
+std::string
+extent_store::hint_path(uint32_t id)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/%08u.hint", id);
+  return dir + name;
+}
+
+// FNV-1a over the header (with a zero checksum field) and the payload
+uint32_t
+extent_store::checksum(const record_header &h, const char *payload)
+{
+  record_header copy = h;
+  copy.checksum = 0;
+  uint32_t sum = 2166136261u;
+  const unsigned char *p = (const unsigned char *) &copy;
+  for (size_t i = 0; i < sizeof(copy); i++)
+    sum = (sum ^ p[i]) * 16777619u;
+  p = (const unsigned char *) payload;
+  for (size_t i = 0; i < h.len; i++)
+    sum = (sum ^ p[i]) * 16777619u;
+  return sum;
+}
+
+
+void
+extent_store::recover()
+{
+  std::vector<uint32_t> ids;
+  DIR *d = opendir(dir.c_str());
+  assert(d != NULL);
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    std::string name = de->d_name;
+    if (name.size() == 12 && name.compare(8, 4, ".seg") == 0)
+      ids.push_back(atoi(name.substr(0, 8).c_str()));
+  }
+  closedir(d);
+  std::sort(ids.begin(), ids.end());
+
+  for (size_t i = 0; i < ids.size(); i++) {
+    uint32_t id = ids[i];
+    bool last = (i + 1 == ids.size());
+    open_segment(id);
+    if (replay_hints(id, last)) {
+      segments[id].sealed = !last;
+      continue;
+    }
+
+    // the active segment, or a sealed one whose hint file is missing
+    segment &s = segments[id];
+    unsigned long long valid = scan(id);
+    if (valid < s.size) {
+      printf("extent_store: segment %u has a torn tail, truncating %llu -> %llu\n",
+             id, s.size.load(), valid);
+      assert(ftruncate(s.fd, valid) == 0);
+      s.size = valid;
+    }
+    if (!last)
+      seal(id);
+  }
+
+  if (ids.empty()) {
+    active = 1;
+    open_segment(active);
+  } else {
+    active = ids.back();
+    if (segments[active].size >= segment_max) {
+      seal(active);
+      open_segment(++active);
+    }
+  }
+  size_t n = 0;
+  for (unsigned int i = 0; i < nshards; i++)
+    n += shards[i].extents.size();
+  printf("extent_store: recovered %lu extents from %lu segments in %s\n",
+         n, segments.size(), dir.c_str());
+}
+
+// headers of every record of a sealed segment, from its hint file if that
+// is intact, else by scanning the segment itself
+bool
+extent_store::load_headers(uint32_t id, std::string &headers)
+{
+  const size_t hs = sizeof(record_header);
+  if (read_file(hint_path(id), headers) && headers.size() % hs == 0) {
+    unsigned long long pos = 0;
+    for (size_t i = 0; i < headers.size(); i += hs) {
+      record_header h;
+      memcpy(&h, headers.data() + i, hs);
+      if (h.magic != record_magic)
+        break;
+      pos += hs + h.len;
+    }
+    if (pos == get_segment(id).size)
+      return true;
+  }
+
+  std::string buf;
+  headers.clear();
+  if (!read_file(seg_path(id), buf))
+    return false;
+  size_t pos = 0;
+  while (pos + hs <= buf.size()) {
+    record_header h;
+    memcpy(&h, buf.data() + pos, hs);
+    if (h.magic != record_magic || pos + hs + h.len > buf.size()
+        || checksum(h, buf.data() + pos + hs) != h.checksum)
+      break;
+    headers.append(buf.data() + pos, hs);
+    pos += hs + h.len;
+  }
+  // a damaged sealed segment is never compacted away
+  return pos == buf.size();
+}
+
+bool
+extent_store::replay_hints(uint32_t id, bool keep)
+{
+  const size_t hs = sizeof(record_header);
+  std::string headers;
+  if (!read_file(hint_path(id), headers) || headers.size() % hs != 0)
+    return false;
+
+  // make sure the hints describe the whole segment before applying any
+  unsigned long long pos = 0;
+  for (size_t i = 0; i < headers.size(); i += hs) {
+    record_header h;
+    memcpy(&h, headers.data() + i, hs);
+    if (h.magic != record_magic)
+      return false;
+    pos += hs + h.len;
+  }
+  if (pos != segments[id].size)
+    return false;
+
+  pos = 0;
+  for (size_t i = 0; i < headers.size(); i += hs) {
+    record_header h;
+    memcpy(&h, headers.data() + i, hs);
+    apply(h, id, pos + hs);
+    pos += hs + h.len;
+  }
+  if (keep)
+    segments[id].hints.swap(headers);
+  return true;
+}
+
+// apply every intact record of a segment, returns the length of the intact prefix
+unsigned long long
+extent_store::scan(uint32_t id)
+{
+  const size_t hs = sizeof(record_header);
+  segment &s = segments[id];
+  std::string buf;
+  if (!read_file(seg_path(id), buf))
+    return 0;
+
+  size_t pos = 0;
+  while (pos + hs <= buf.size()) {
+    record_header h;
+    memcpy(&h, buf.data() + pos, hs);
+    if (h.magic != record_magic || pos + hs + h.len > buf.size()
+        || checksum(h, buf.data() + pos + hs) != h.checksum)
+      break;
+    apply(h, id, pos + hs);
+    s.hints.append(buf.data() + pos, hs);
+    pos += hs + h.len;
+  }
+  return pos;
+}
+
+void
+extent_store::open_segment(uint32_t id)
+{
+  int fd = open(seg_path(id).c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    printf("extent_store: cannot open segment %u: %s\n", id, strerror(errno));
+    exit(1);
+  }
+  struct stat st;
+  assert(fstat(fd, &st) == 0);
+
+  ScopedWriteLock wl(&seg_lock);
+  segment &s = segments[id];
+  s.fd = fd;
+  s.size = st.st_size;
+  s.live = 0;
+  s.sealed = false;
+  s.hints.clear();
+}
+
+void
+extent_store::seal(uint32_t id)
+{
+  segment &s = segments[id];
+  fdatasync(s.fd);
+  write_hints(id);
+  s.sealed = true;
+  std::string().swap(s.hints);
+}
+
+void
+extent_store::write_hints(uint32_t id)
+{
+  segment &s = segments[id];
+  std::string tmp = hint_path(id) + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    bool ok = write_all(fd, s.hints.data(), s.hints.size(), 0) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), hint_path(id).c_str()) != 0)
+      unlink(tmp.c_str());
+  }
+}
+
+
+void
+extent_store::encode(std::string &out, record_type type, extent_protocol::extentid_t id,
+                     unsigned int bno, const extent_protocol::attr &a,
+                     const char *payload, unsigned int len)
+{
+  record_header h;
+  memset(&h, 0, sizeof(h));
+  h.magic = record_magic;
+  h.type = type;
+  h.bno = bno;
+  h.eid = id;
+  h.len = len;
+  h.atime = a.atime;
+  h.mtime = a.mtime;
+  h.ctime = a.ctime;
+  h.size = a.size;
+  h.checksum = checksum(h, payload);
+  out.append((const char *) &h, sizeof(h));
+  if (len > 0)
+    out.append(payload, len);
+}
+
+// write records to the end of the active segment and apply them to the index.
+// the records belong to a single extent whose shard the caller has write locked.
+bool
+extent_store::append(const std::string &records)
+{
+  const size_t hs = sizeof(record_header);
+  ScopedLock al(&append_lock);
+  // the segment map only changes under append_lock, which we hold
+  segment &s = segments.find(active)->second;
+  unsigned long long end = s.size;
+
+  if (!write_all(s.fd, records.data(), records.size(), end)) {
+    printf("extent_store: append to segment %u failed: %s\n", active, strerror(errno));
+    if (ftruncate(s.fd, end) != 0)
+      printf("extent_store: cannot undo partial append\n");
+    return false;
+  }
+  if (sync)
+    fdatasync(s.fd);
+
+  size_t pos = 0;
+  while (pos < records.size()) {
+    record_header h;
+    memcpy(&h, records.data() + pos, hs);
+    apply(h, active, end + pos + hs);
+    s.hints.append(records.data() + pos, hs);
+    pos += hs + h.len;
+  }
+  s.size = end + records.size();
+
+  if (s.size >= segment_max) {
+    seal(active);
+    open_segment(++active);
+  }
+  return true;
+}
+
+// the single place records change the index, used both live and on recovery
+void
+extent_store::apply(const record_header &h, uint32_t seg, unsigned long long payload_off)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  std::unordered_map<extent_protocol::extentid_t, entry> &index = shard_for(h.eid).extents;
+  extent_protocol::attr a;
+  a.atime = h.atime;
+  a.mtime = h.mtime;
+  a.ctime = h.ctime;
+  a.size = h.size;
+
+  switch (h.type) {
+  case CREATE: {
+    entry &e = index[h.eid];
+    if (!e.version)
+      e.version = ++next_version;
+    for (auto &it : e.blocks)
+      drop_block(it.second);
+    e.blocks.clear();
+    e.attr = a;
+    e.atime = a.atime;
+    break;
+  }
+  case BLOCK: {
+    entry &e = index[h.eid];
+    if (!e.version)
+      e.version = ++next_version;
+    set_attr(e, a);
+    auto it = e.blocks.find(h.bno);
+    if (it != e.blocks.end())
+      drop_block(it->second);
+    block_loc loc;
+    loc.seg = seg;
+    loc.stored = h.len;
+    loc.len = std::min((unsigned long long) h.len,
+                       (unsigned long long) a.size - (unsigned long long) h.bno * bs);
+    loc.off = payload_off;
+    e.blocks[h.bno] = loc;
+    get_segment(seg).live += sizeof(record_header) + h.len;
+    break;
+  }
+  case ATTR: {
+    entry &e = index[h.eid];
+    if (!e.version)
+      e.version = ++next_version;
+    set_attr(e, a);
+    break;
+  }
+  case REMOVE: {
+    auto it = index.find(h.eid);
+    if (it != index.end()) {
+      for (auto &b : it->second.blocks)
+        drop_block(b.second);
+      index.erase(it);
+    }
+    break;
+  }
+  default:
+    printf("extent_store: unknown record type %u\n", h.type);
+    break;
+  }
+}
+
+void
+extent_store::set_attr(entry &e, const extent_protocol::attr &a)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  if (a.size < e.attr.size) {
+    // bytes past the new end must not come back if the extent grows again
+    unsigned int first_gone = ((unsigned long long) a.size + bs - 1) / bs;
+    auto it = e.blocks.lower_bound(first_gone);
+    while (it != e.blocks.end()) {
+      drop_block(it->second);
+      it = e.blocks.erase(it);
+    }
+    auto last = e.blocks.find(a.size / bs);
+    if (last != e.blocks.end() && last->second.len > a.size % bs)
+      last->second.len = a.size % bs;
+  }
+  e.attr = a;
+  e.atime = a.atime;
+}
+
+void
+extent_store::drop_block(const block_loc &loc)
+{
+  ScopedReadLock rl(&seg_lock);
+  auto it = segments.find(loc.seg);
+  if (it != segments.end())
+    it->second.live -= sizeof(record_header) + loc.stored;
+}
+
+void
+extent_store::read_block(const block_loc &loc, unsigned int from, unsigned int n, char *dst)
+{
+  unsigned int avail = from < loc.len ? std::min(n, loc.len - from) : 0;
+  int fd = get_segment(loc.seg).fd;
+  size_t done = 0;
+  while (done < avail) {
+    ssize_t r = pread(fd, dst + done, avail - done, loc.off + from + done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      printf("extent_store: read from segment %u failed\n", loc.seg);
+      break;
+    }
+    done += r;
+  }
+  memset(dst + done, 0, n - done);
+}
+
+
+bool
+extent_store::exists(extent_protocol::extentid_t id)
+{
+  shard &sh = shard_for(id);
+  ScopedReadLock rl(&sh.lock);
+  return sh.extents.count(id) > 0;
+}
+
+int
+extent_store::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
+{
+  shard &sh = shard_for(id);
+  ScopedReadLock rl(&sh.lock);
+  auto it = sh.extents.find(id);
+  if (it == sh.extents.end())
+    return extent_protocol::NOENT;
+  fill_attr(it->second, a);
+  return extent_protocol::OK;
+}
+
+void
+extent_store::fill_attr(entry &e, extent_protocol::attr &a)
+{
+  a = e.attr;
+  a.atime = e.atime;
+  a.version = e.version;
+}
+
+// the caller holds the shard of the extent locked
+void
+extent_store::read_range(entry &e, unsigned long long off, unsigned int size, shared_buf &out)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  unsigned long long end = std::min(off + size, (unsigned long long) e.attr.size);
+  out = shared_buf();
+  if (off >= end)
+    return;
+
+  // holes read back as zeros
+  std::string buf(end - off, '\0');
+  for (auto b = e.blocks.lower_bound(off / bs);
+       b != e.blocks.end() && (unsigned long long) b->first * bs < end; b++) {
+    unsigned long long block_start = (unsigned long long) b->first * bs;
+    unsigned long long from = std::max(off, block_start);
+    unsigned long long to = std::min(end, block_start + bs);
+    read_block(b->second, from - block_start, to - from, &buf[from - off]);
+  }
+  out = shared_buf(std::move(buf));
+}
+
+int
+extent_store::read(extent_protocol::extentid_t id, unsigned long long off,
+                   unsigned int size, shared_buf &out, unsigned int now,
+                   extent_protocol::attr *a)
+{
+  shard &sh = shard_for(id);
+  ScopedReadLock rl(&sh.lock);
+  auto it = sh.extents.find(id);
+  if (it == sh.extents.end())
+    return extent_protocol::NOENT;
+  entry &e = it->second;
+  e.atime = now;
+  if (a)
+    fill_attr(e, *a);
+  read_range(e, off, size, out);
+  return extent_protocol::OK;
+}
+
+int
+extent_store::read_if_changed(extent_protocol::extentid_t id, unsigned long long version,
+                              shared_buf &out, extent_protocol::attr &a, unsigned int now)
+{
+  shard &sh = shard_for(id);
+  ScopedReadLock rl(&sh.lock);
+  auto it = sh.extents.find(id);
+  if (it == sh.extents.end())
+    return extent_protocol::NOENT;
+  entry &e = it->second;
+  e.atime = now;
+  fill_attr(e, a);
+  if (e.version != version)
+    read_range(e, 0, ~0U, out);
+  else
+    out = shared_buf();
+  return extent_protocol::OK;
+}
+
+// a new version after a modification, under the shard write lock
+void
+extent_store::bump(extent_protocol::extentid_t id)
+{
+  auto it = shard_for(id).extents.find(id);
+  if (it != shard_for(id).extents.end())
+    it->second.version = ++next_version;
+}
+
+int
+extent_store::put(extent_protocol::extentid_t id, const std::string &buf, unsigned int now)
+{
+  extent_protocol::attr a;
+  a.atime = a.mtime = a.ctime = now;
+  return restore(id, a, buf);
+}
+
+int
+extent_store::restore(extent_protocol::extentid_t id, const extent_protocol::attr &times,
+                      const std::string &buf)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  ScopedWriteLock wl(&shard_for(id).lock);
+
+  extent_protocol::attr a = times;
+  a.size = buf.size();
+
+  std::string records;
+  encode(records, CREATE, id, 0, a);
+  for (size_t off = 0; off < buf.size(); off += bs)
+    encode(records, BLOCK, id, off / bs, a, buf.data() + off,
+           std::min((size_t) bs, buf.size() - off));
+  if (!append(records))
+    return extent_protocol::IOERR;
+  bump(id);
+  return extent_protocol::OK;
+}
+
+int
+extent_store::write(extent_protocol::extentid_t id, unsigned long long off,
+                    const std::string &buf, unsigned int now)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  shard &sh = shard_for(id);
+  ScopedWriteLock wl(&sh.lock);
+  auto it = sh.extents.find(id);
+  if (it == sh.extents.end())
+    return extent_protocol::NOENT;
+  entry &e = it->second;
+
+  extent_protocol::attr a = e.attr;
+  a.atime = e.atime;
+  if (off + buf.size() > a.size)
+    a.size = off + buf.size();
+  a.mtime = a.ctime = now;
+
+  // every touched block is logged whole, merged with its old content
+  std::string records;
+  std::string block;
+  size_t done = 0;
+  while (done < buf.size()) {
+    unsigned long long pos = off + done;
+    unsigned int bno = pos / bs;
+    unsigned int boff = pos % bs;
+    unsigned int n = std::min((size_t) (bs - boff), buf.size() - done);
+
+    auto old = e.blocks.find(bno);
+    unsigned int old_len = old != e.blocks.end() ? old->second.len : 0;
+    block.assign(std::max(old_len, boff + n), '\0');
+    if (old_len > 0 && (boff > 0 || boff + n < old_len))
+      read_block(old->second, 0, old_len, &block[0]);
+    memcpy(&block[boff], buf.data() + done, n);
+    encode(records, BLOCK, id, bno, a, block.data(), block.size());
+    done += n;
+  }
+  if (records.empty())
+    encode(records, ATTR, id, 0, a);
+  if (!append(records))
+    return extent_protocol::IOERR;
+  bump(id);
+  return extent_protocol::OK;
+}
+
+int
+extent_store::resize(extent_protocol::extentid_t id, unsigned long long size, unsigned int now)
+{
+  shard &sh = shard_for(id);
+  ScopedWriteLock wl(&sh.lock);
+  auto it = sh.extents.find(id);
+  if (it == sh.extents.end())
+    return extent_protocol::NOENT;
+
+  extent_protocol::attr a = it->second.attr;
+  a.atime = it->second.atime;
+  a.size = size;
+  a.mtime = a.ctime = now;
+  std::string records;
+  encode(records, ATTR, id, 0, a);
+  if (!append(records))
+    return extent_protocol::IOERR;
+  bump(id);
+  return extent_protocol::OK;
+}
+
+int
+extent_store::remove(extent_protocol::extentid_t id)
+{
+  shard &sh = shard_for(id);
+  ScopedWriteLock wl(&sh.lock);
+  if (!sh.extents.count(id))
+    return extent_protocol::NOENT;
+
+  extent_protocol::attr a;
+  memset(&a, 0, sizeof(a));
+  std::string records;
+  encode(records, REMOVE, id, 0, a);
+  return append(records) ? extent_protocol::OK : extent_protocol::IOERR;
+}
+
+bool
+extent_store::list(unsigned int bucket, std::vector<extent_protocol::extentid_t> &ids)
+{
+  if (bucket >= nshards)
+    return false;
+  ScopedReadLock rl(&shards[bucket].lock);
+  ids.clear();
+  ids.reserve(shards[bucket].extents.size());
+  for (auto &it : shards[bucket].extents)
+    ids.push_back(it.first);
+  return true;
+}
+
+// log the current state of an extent from scratch at the end of the active
+// segment. the CREATE record makes replay ignore all its older records.
+// the caller holds the shard of the extent write locked.
+bool
+extent_store::rewrite(extent_protocol::extentid_t id)
+{
+  const unsigned int bs = extent_protocol::blocksize;
+  entry &e = shard_for(id).extents[id];
+  extent_protocol::attr a = e.attr;
+  a.atime = e.atime;
+  std::map<unsigned int, block_loc> old = e.blocks;
+
+  std::string records;
+  encode(records, CREATE, id, 0, a);
+  std::string block;
+  for (auto &it : old) {
+    block.resize(it.second.len);
+    read_block(it.second, 0, it.second.len, &block[0]);
+    encode(records, BLOCK, id, it.first, a, block.data(), block.size());
+    // the old records stay readable until the victim is deleted
+    if (records.size() >= 256 * bs) {
+      if (!append(records))
+        return false;
+      records.clear();
+    }
+  }
+  return records.empty() || append(records);
+}
+
+bool
+extent_store::compact(double max_live)
+{
+  const size_t hs = sizeof(record_header);
+  uint32_t victim = 0;
+  {
+    ScopedLock al(&append_lock);
+    if (compacting)
+      return false;
+    double best = 2;
+    for (auto &it : segments) {
+      if (!it.second.sealed || it.first == active)
+        continue;
+      unsigned long long size = it.second.size;
+      double ratio = size ? (double) it.second.live / size : 0;
+      if (ratio < best) {
+        best = ratio;
+        victim = it.first;
+      }
+    }
+    if (victim == 0 || best > max_live)
+      return false;
+    compacting = true;
+  }
+
+  std::string headers;
+  std::set<extent_protocol::extentid_t> ids;
+  bool ok = load_headers(victim, headers);
+  for (size_t i = 0; ok && i + hs <= headers.size(); i += hs) {
+    record_header h;
+    memcpy(&h, headers.data() + i, hs);
+    ids.insert(h.eid);
+  }
+
+  // any extent with a record in the victim is rewritten, so that replay
+  // never depends on what the victim held. removed ones keep a tombstone
+  // while older segments may still resurrect them.
+  for (auto id : ids) {
+    shard &sh = shard_for(id);
+    ScopedWriteLock wl(&sh.lock);
+    bool older;
+    {
+      ScopedReadLock rl(&seg_lock);
+      older = segments.begin()->first < victim;
+    }
+    if (sh.extents.count(id)) {
+      ok = rewrite(id);
+    } else if (older) {
+      extent_protocol::attr a;
+      memset(&a, 0, sizeof(a));
+      std::string records;
+      encode(records, REMOVE, id, 0, a);
+      ok = append(records);
+    }
+    if (!ok)
+      break;
+  }
+
+  // nothing in the index points into the victim any more, and no reader
+  // can still be using it since each rewrite held the extent's shard
+  ScopedLock al(&append_lock);
+  compacting = false;
+  if (ok && fdatasync(segments.find(active)->second.fd) != 0)
+    ok = false;
+  if (!ok) {
+    printf("extent_store: compaction of segment %u failed, keeping it\n", victim);
+    return false;
+  }
+  ScopedWriteLock wl(&seg_lock);
+  segment &s = segments.find(victim)->second;
+  printf("extent_store: compacted segment %u (%llu bytes)\n", victim, s.size.load());
+  close(s.fd);
+  unlink(seg_path(victim).c_str());
+  unlink(hint_path(victim).c_str());
+  segments.erase(victim);
+  return true;
+}
+
+void
+extent_store::compacter()
+{
+  ScopedLock al(&append_lock);
+  while (!stopping) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    pthread_cond_timedwait(&stop_signal, &append_lock, &ts);
+    while (!stopping) {
+      pthread_mutex_unlock(&append_lock);
+      bool more = compact();
+      pthread_mutex_lock(&append_lock);
+      if (!more)
+        break;
+    }
+  }
+}
+
+void
+extent_store::get_stats(stats &st)
+{
+  {
+    ScopedReadLock rl(&seg_lock);
+    st.segments = segments.size();
+    st.disk_bytes = st.live_bytes = 0;
+    for (auto &it : segments) {
+      st.disk_bytes += it.second.size;
+      st.live_bytes += it.second.live;
+    }
+  }
+  st.extents = 0;
+  for (unsigned int i = 0; i < nshards; i++) {
+    ScopedReadLock rl(&shards[i].lock);
+    st.extents += shards[i].extents.size();
+  }
+}
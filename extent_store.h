@@ -0,0 +1,173 @@
+// log-structured, durable storage for extents
+
+#ifndef extent_store_h
+#define extent_store_h
+
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include "extent_protocol.h"
+
+// Every mutation is appended as a record to the active segment file in the
+// store directory. The in-memory index only maps extent ids to attributes and
+// block locations, block content is read back from the segments.
+//
+// A segment is sealed once it grows past segment_max. Sealing (and a clean
+// shutdown) writes a hint file holding just the record headers, so recovery
+// rebuilds the index without reading payloads; only an active segment left
+// by a crash is scanned and has its torn tail cut off. A background thread
+// compacts sealed segments that are mostly garbage by rewriting every extent
+// that has records in them.
+//
+// The index is split into shards by extent id, each with its own
+// reader/writer lock, so reads of different extents run in parallel and
+// only mutations of extents in the same shard contend. Appends to the log
+// are serialized by append_lock; the segment table has its own rwlock.
+// Locks are always taken in the order shard, append_lock, seg_lock.
+//
+// Every extent carries a version that is bumped by each modification. It is
+// kept in memory only; the counter starts from the current time shifted into
+// the upper half, so versions handed out before a restart are never reused
+// and clients holding them simply refetch.
+class extent_store {
+ public:
+  struct stats {
+    unsigned int segments;
+    unsigned long long disk_bytes;
+    unsigned long long live_bytes;
+    unsigned long long extents;
+  };
+
+  extent_store(std::string dir, bool sync = false,
+               unsigned long long segment_max = 64ULL << 20);
+  ~extent_store();
+
+  bool exists(extent_protocol::extentid_t id);
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
+  // reads set the access time, which is kept in memory only. the result is
+  // read from the segments straight into the buffer that the reply sends.
+  // a, if given, gets the attributes as of the same moment.
+  int read(extent_protocol::extentid_t id, unsigned long long off,
+           unsigned int size, shared_buf &, unsigned int now,
+           extent_protocol::attr *a = NULL);
+  // the whole extent, unless its version is still the given one
+  int read_if_changed(extent_protocol::extentid_t id, unsigned long long version,
+                      shared_buf &, extent_protocol::attr &, unsigned int now);
+  int put(extent_protocol::extentid_t id, const std::string &, unsigned int now);
+  // put with the times given in a, size comes from the buffer
+  int restore(extent_protocol::extentid_t id, const extent_protocol::attr &a,
+              const std::string &);
+  int write(extent_protocol::extentid_t id, unsigned long long off,
+            const std::string &, unsigned int now);
+  int resize(extent_protocol::extentid_t id, unsigned long long size, unsigned int now);
+  int remove(extent_protocol::extentid_t id);
+  // ids in one shard of the index, false once bucket is past the last one
+  bool list(unsigned int bucket, std::vector<extent_protocol::extentid_t> &);
+
+  // compact the sealed segment with the least live data if no more than
+  // max_live of it is live. returns false if there was nothing to do.
+  bool compact(double max_live = 0.5);
+  void get_stats(stats &);
+
+  void compacter();
+
+ private:
+  enum record_type { CREATE = 1, BLOCK, ATTR, REMOVE };
+
+  struct record_header {
+    uint32_t magic;
+    uint32_t checksum;
+    uint32_t type;
+    uint32_t bno;
+    uint64_t eid;
+    uint32_t len;
+    uint32_t atime;
+    uint32_t mtime;
+    uint32_t ctime;
+    uint32_t size;
+    uint32_t reserved;
+  };
+
+  struct block_loc {
+    uint32_t seg;
+    uint32_t len;     // valid bytes, less than stored after a truncate
+    uint32_t stored;  // payload bytes in the record
+    uint64_t off;     // payload offset in the segment
+  };
+
+  struct entry {
+    extent_protocol::attr attr;
+    // readers update it under the shared shard lock
+    std::atomic<unsigned int> atime;
+    // under the shard write lock; compaction leaves it alone
+    unsigned long long version;
+    std::map<unsigned int, block_loc> blocks;
+    entry() : version(0) {}
+  };
+
+  struct shard {
+    pthread_rwlock_t lock;
+    std::unordered_map<extent_protocol::extentid_t, entry> extents;
+  };
+  static const unsigned int nshards = 64;
+
+  struct segment {
+    int fd;
+    std::atomic<unsigned long long> size;
+    std::atomic<long long> live;
+    std::atomic<bool> sealed;
+    std::string hints;  // headers of the records appended so far, under append_lock
+  };
+
+  std::string dir;
+  bool sync;
+  unsigned long long segment_max;
+
+  shard shards[nshards];
+
+  pthread_mutex_t append_lock;
+  pthread_cond_t stop_signal;
+  bool stopping;
+  bool compacting;
+  pthread_t compact_thread;
+  uint32_t active;
+  std::atomic<unsigned long long> next_version;
+
+  // the map itself, segment contents are atomics or under append_lock
+  pthread_rwlock_t seg_lock;
+  std::map<uint32_t, segment> segments;
+
+  shard &shard_for(extent_protocol::extentid_t id);
+  segment &get_segment(uint32_t id);
+
+  std::string seg_path(uint32_t id);
+  std::string hint_path(uint32_t id);
+  static uint32_t checksum(const record_header &, const char *payload);
+
+  void recover();
+  bool replay_hints(uint32_t id, bool keep);
+  bool load_headers(uint32_t id, std::string &headers);
+  unsigned long long scan(uint32_t id);
+  void open_segment(uint32_t id);
+  void seal(uint32_t id);
+  void write_hints(uint32_t id);
+
+  void encode(std::string &out, record_type, extent_protocol::extentid_t,
+              unsigned int bno, const extent_protocol::attr &,
+              const char *payload = NULL, unsigned int len = 0);
+  bool append(const std::string &records);
+  void apply(const record_header &, uint32_t seg, unsigned long long payload_off);
+  void set_attr(entry &, const extent_protocol::attr &);
+  void drop_block(const block_loc &);
+  void read_block(const block_loc &, unsigned int from, unsigned int n, char *dst);
+  void read_range(entry &, unsigned long long off, unsigned int size, shared_buf &);
+  void fill_attr(entry &, extent_protocol::attr &);
+  void bump(extent_protocol::extentid_t id);
+  bool rewrite(extent_protocol::extentid_t id);
+};
+
+#endif
@@ -16,19 +16,122 @@
 #include <unistd.h>
 #include <assert.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
 #include "yfs_client.h"
 
 int myid;
 yfs_client *yfs;
 
+// how long the kernel may keep entries and attributes read under a lock
+// this client caches. the revocation of the lock invalidates them sooner.
+const double kernel_cache_timeout = 60.0;
+
+// the kernel's cached attributes and entries of an inode are dropped when
+// its lock is revoked. the notifications go out from a thread of their
+// own: the kernel may hold the directory's i_mutex for a request that
+// waits on the very lock whose revocation asked for the invalidation.
+class kernel_invalidator : public cache_invalidator {
+ private:
+  pthread_mutex_t m;
+  pthread_cond_t pending_cond;
+  std::deque<yfs_client::inum> pending;
+  // names the kernel was given under each directory, up to max_entries
+  // a directory. a client that keeps a directory's lock for long would
+  // otherwise remember every name it ever looked up there.
+  static const size_t max_entries = 4096;
+  std::map<yfs_client::inum, std::set<std::string> > entries;
+  struct fuse_chan *ch;
+
+  static void *
+  run(void *x)
+  {
+    kernel_invalidator *ki = (kernel_invalidator *) x;
+    while (true) {
+      yfs_client::inum inum;
+      std::set<std::string> names;
+      {
+        ScopedLock ml(&ki->m);
+        while (ki->pending.empty())
+          pthread_cond_wait(&ki->pending_cond, &ki->m);
+        inum = ki->pending.front();
+        ki->pending.pop_front();
+        auto it = ki->entries.find(inum);
+        if (it != ki->entries.end()) {
+          names.swap(it->second);
+          ki->entries.erase(it);
+        }
+      }
+      // ENOENT only means the kernel had nothing cached
+      fuse_lowlevel_notify_inval_inode(ki->ch, inum, 0, 0);
+      for (auto &name : names)
+        fuse_lowlevel_notify_inval_entry(ki->ch, inum, name.c_str(), name.size());
+    }
+    return NULL;
+  }
+
+ public:
+  kernel_invalidator(struct fuse_chan *_ch) : ch(_ch)
+  {
+    pthread_mutex_init(&m, NULL);
+    pthread_cond_init(&pending_cond, NULL);
+    pthread_t th;
+    if (pthread_create(&th, NULL, run, this) != 0) {
+      fprintf(stderr, "could not start the invalidation thread\n");
+      exit(1);
+    }
+    pthread_detach(th);
+  }
+
+  // false if the directory has no room for the name, which the revocation
+  // will then not invalidate
+  bool
+  entered(yfs_client::inum parent, const char *name)
+  {
+    ScopedLock ml(&m);
+    std::set<std::string> &names = entries[parent];
+    if (names.size() >= max_entries && !names.count(name))
+      return false;
+    names.insert(name);
+    return true;
+  }
+
+  void
+  invalidate(yfs_client::inum inum)
+  {
+    ScopedLock ml(&m);
+    pending.push_back(inum);
+    pthread_cond_signal(&pending_cond);
+  }
+};
+
+kernel_invalidator *invalidator;
+
+// an entry reply the kernel may keep until the parent's lock is revoked.
+// one the revocation would not invalidate is kept for the lease only.
+void
+entry_reply(struct fuse_entry_param &e, yfs_client::inum parent, const char *name)
+{
+  e.entry_timeout = kernel_cache_timeout;
+  if (invalidator && !invalidator->entered(parent, name))
+    e.entry_timeout = yfs->lease_seconds();
+}
+
 int id() { 
   return myid;
 }
 
+// timeout, if given, is how long the kernel may cache the attributes
 yfs_client::status
-getattr(yfs_client::inum inum, struct stat &st)
+getattr(yfs_client::inum inum, struct stat &st, double *timeout = NULL)
 {
   yfs_client::status ret;
+  bool under_lock;
 
   bzero(&st, sizeof(st));
 
@@ -45,6 +148,7 @@ getattr(yfs_client::inum inum, struct stat &st)
      st.st_mtime = info.mtime;
      st.st_ctime = info.ctime;
      st.st_size = info.size;
+     under_lock = info.under_lock;
      printf("   getattr -> %llu\n", info.size);
    } else {
      yfs_client::dirinfo info;
@@ -56,8 +160,11 @@ getattr(yfs_client::inum inum, struct stat &st)
      st.st_atime = info.atime;
      st.st_mtime = info.mtime;
      st.st_ctime = info.ctime;
+     under_lock = info.under_lock;
      printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
    }
+   if (timeout)
+     *timeout = under_lock ? kernel_cache_timeout : yfs->lease_seconds();
    return yfs_client::OK;
 }
 
@@ -70,12 +177,13 @@ fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
     yfs_client::inum inum = ino; // req->in.h.nodeid;
     yfs_client::status ret;
 
-    ret = getattr(inum, st);
+    double timeout;
+    ret = getattr(inum, st, &timeout);
     if(ret != yfs_client::OK){
       fuse_reply_err(req, ENOENT);
       return;
     }
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, timeout);
 }
 
 void
@@ -86,11 +194,12 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set
     printf("fuseserver_setattr set size to %zu\n", attr->st_size);
     yfs->resize(ino, attr->st_size);
     struct stat st;
-    if (getattr(ino, st)) {
+    double timeout;
+    if (getattr(ino, st, &timeout)) {
       printf("ERROR! fuseserver_setattr getattr() failed! inum = %016llx\n\n", ino);
       fuse_reply_err(req, ENOSYS);
     } else {
-      fuse_reply_attr(req, &st, 0);
+      fuse_reply_attr(req, &st, timeout);
     }
   } else {
     fuse_reply_err(req, ENOSYS);
@@ -101,9 +210,15 @@ void
 fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
       off_t off, struct fuse_file_info *fi)
 {
-  std::string data;
+  // the cached blocks go to the kernel as they are, in one writev
+  std::vector<shared_buf> data;
   if (yfs->read(ino, off, size, data) == yfs_client::OK) {
-    fuse_reply_buf(req, data.c_str(), data.size());
+    std::vector<struct iovec> iov(data.size());
+    for (size_t i = 0; i < data.size(); i++) {
+      iov[i].iov_base = (void *) data[i].data();
+      iov[i].iov_len = data[i].size();
+    }
+    fuse_reply_iov(req, iov.empty() ? NULL : &iov[0], iov.size());
   } else {
     fuse_reply_err(req, ENOSYS);
   }
@@ -115,7 +230,7 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
   struct fuse_file_info *fi)
 {
   printf("\n\n\n fuseserver_write ---- \n");
-  if (yfs->write(ino, off, size, buf) != yfs_client::OK) {
+  if (yfs->write(ino, off, size, std::string(buf, size)) != yfs_client::OK) {
     fuse_reply_err(req, ENOSYS);
   } else {
     fuse_reply_write(req, size);
@@ -127,12 +242,14 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
      mode_t mode, struct fuse_entry_param *e)
 {
   yfs_client::inum inum;
+  memset(e, 0, sizeof(*e));
   auto retval = yfs->create(parent, name, S_IFDIR & mode, inum);
   if (retval == yfs_client::OK) {
     e->ino = inum;
     struct stat st;
-    if(getattr(inum, st) == yfs_client::OK)
+    if(getattr(inum, st, &e->attr_timeout) == yfs_client::OK)
       e->attr = st;
+    entry_reply(*e, parent, name);
   }
   return retval;
 }
@@ -166,8 +283,7 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
   struct fuse_entry_param e;
   bool found = false;
 
-  e.attr_timeout = 0.0;
-  e.entry_timeout = 0.0;
+  memset(&e, 0, sizeof(e));
 
   yfs_client::status retval;
   yfs_client::inum inum;
@@ -175,8 +291,9 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
   if (retval == yfs_client::OK) {
     e.ino = inum;
     struct stat _stat;
-    if(getattr(inum, _stat) == yfs_client::OK)
+    if(getattr(inum, _stat, &e.attr_timeout) == yfs_client::OK)
       e.attr = _stat;
+    entry_reply(e, parent, name);
     found = true;
   }
 
@@ -187,9 +304,12 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 }
 
 
+// an encoded listing, grown geometrically so building it stays linear
 struct dirbuf {
     char *p;
     size_t size;
+    size_t cap;
+    bool served;  // some of it went to the kernel already
 };
 
 void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
@@ -197,7 +317,10 @@ void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
     struct stat stbuf;
     size_t oldsize = b->size;
     b->size += fuse_dirent_size(strlen(name));
-    b->p = (char *) realloc(b->p, b->size);
+    if (b->size > b->cap) {
+      b->cap = b->size > 2 * b->cap ? b->size : 2 * b->cap;
+      b->p = (char *) realloc(b->p, b->cap);
+    }
     memset(&stbuf, 0, sizeof(stbuf));
     stbuf.st_ino = ino;
     fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
@@ -214,36 +337,75 @@ int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
     return fuse_reply_buf(req, NULL, 0);
 }
 
+// list the directory with attributes into b, so the lookups and getattrs
+// of an ls -l that follow are answered by yfs_client without locks or RPCs
+yfs_client::status
+dirbuf_fill(struct dirbuf *b, yfs_client::inum inum)
+{
+  yfs_client::direntplus_lst_t lst;
+  auto ret = yfs->readdirplus(inum, lst);
+  if (ret != yfs_client::OK)
+    return ret;
+  b->size = 0;
+  b->served = false;
+  for (auto &dirent : lst)
+    dirbuf_add(b, dirent.name.c_str(), dirent.inum);
+  return yfs_client::OK;
+}
+
+// the listing is built once per open handle and kept in fi->fh, so paging
+// through a large directory does not list it again for every chunk
+void
+fuseserver_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  if (!yfs->isdir(ino)) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+  struct dirbuf *b = (struct dirbuf *) calloc(1, sizeof(*b));
+  if (dirbuf_fill(b, ino) != yfs_client::OK) {
+    free(b->p);
+    free(b);
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  fi->fh = (uintptr_t) b;
+  fuse_reply_open(req, fi);
+}
+
 void
 fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
           off_t off, struct fuse_file_info *fi)
 {
   yfs_client::inum inum = ino; // req->in.h.nodeid;
-  struct dirbuf b;
-  yfs_client::dirent e;
+  struct dirbuf *b = (struct dirbuf *) (uintptr_t) fi->fh;
 
   printf("fuseserver_readdir\n");
 
-  if(!yfs->isdir(inum)){
+  if(!yfs->isdir(inum) || b == NULL){
     fuse_reply_err(req, ENOTDIR);
     return;
   }
 
-  memset(&b, 0, sizeof(b));
-
-  // fill in the b data structure using dirbuf_add
-  yfs_client::dirent_lst_t dirent_lst;
-  auto ret = yfs->readdir(inum, dirent_lst);
-  if (ret != yfs_client::OK) {
-    fuse_reply_err(req, ENOTDIR);
+  // a rewinddir starts over with a fresh listing
+  if (off == 0 && b->served && dirbuf_fill(b, inum) != yfs_client::OK) {
+    fuse_reply_err(req, EIO);
     return;
   }
-  for (auto dirent : dirent_lst)
-    dirbuf_add(&b, dirent.name.c_str(), dirent.inum);
+  b->served = true;
+  reply_buf_limited(req, b->p, b->size, off, size);
+}
 
-  reply_buf_limited(req, b.p, b.size, off, size);
-  free(b.p);
- }
+void
+fuseserver_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct dirbuf *b = (struct dirbuf *) (uintptr_t) fi->fh;
+  if (b) {
+    free(b->p);
+    free(b);
+  }
+  fuse_reply_err(req, 0);
+}
 
 
 void
@@ -261,14 +423,17 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
   auto ret = yfs->create(parent, name, true, dir_inum);
   if (ret == yfs_client::OK) {
     struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
     e.ino = dir_inum;
 
     struct stat dir_stat;
-    if (getattr(dir_inum, dir_stat) == yfs_client::OK) {
+    if (getattr(dir_inum, dir_stat, &e.attr_timeout) == yfs_client::OK) {
       e.attr = dir_stat;
     } else {
       fuse_reply_err(req, ENOSYS);
+      return;
     }
+    entry_reply(e, parent, name);
     fuse_reply_entry(req, &e);
   } else {
     fuse_reply_err(req, ENOSYS);
@@ -309,6 +474,36 @@ fuseserver_statfs(fuse_req_t req)
 
 struct fuse_lowlevel_ops fuseserver_oper;
 
+// workers of the multithreaded dispatcher, each reading requests off the
+// channel and running them to completion. operations on different inodes
+// proceed in parallel; yfs_client's locks order those on the same one.
+struct worker_args {
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+};
+
+void *
+fuseserver_worker(void *x)
+{
+  worker_args *w = (worker_args *) x;
+  size_t bufsize = fuse_chan_bufsize(w->ch);
+  char *buf = (char *) malloc(bufsize);
+  assert(buf != NULL);
+  while (!fuse_session_exited(w->se)) {
+    struct fuse_chan *ch = w->ch;
+    int res = fuse_chan_recv(&ch, buf, bufsize);
+    if (res == -EINTR)
+      continue;
+    if (res <= 0)
+      break;
+    fuse_session_process(w->se, buf, res, ch);
+  }
+  // unmounted or failed, the other workers stop on their next request
+  fuse_session_exit(w->se);
+  free(buf);
+  return NULL;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -319,7 +514,7 @@ main(int argc, char *argv[])
   setvbuf(stdout, NULL, _IONBF, 0);
 
   if(argc != 4){
-    fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server> <port-lock-server>\n");
+    fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server>[,<port-extent-server>...] <port-lock-server>\n");
     exit(1);
   }
   mountpoint = argv[1];
@@ -332,7 +527,9 @@ main(int argc, char *argv[])
 
   fuseserver_oper.getattr    = fuseserver_getattr;
   fuseserver_oper.statfs     = fuseserver_statfs;
+  fuseserver_oper.opendir    = fuseserver_opendir;
   fuseserver_oper.readdir    = fuseserver_readdir;
+  fuseserver_oper.releasedir = fuseserver_releasedir;
   fuseserver_oper.lookup     = fuseserver_lookup;
   fuseserver_oper.create     = fuseserver_create;
   fuseserver_oper.mknod      = fuseserver_mknod;
@@ -347,8 +544,8 @@ main(int argc, char *argv[])
   int fuse_argc = 0;
   fuse_argv[fuse_argc++] = argv[0];
 #ifdef __APPLE__
-  fuse_argv[fuse_argc++] = "-o";
-  fuse_argv[fuse_argc++] = "nolocalcaches"; // no dir entry caching
+  // entries and attributes are cached, the kernel is told when a lock
+  // revocation makes them stale
   fuse_argv[fuse_argc++] = "-o";
   fuse_argv[fuse_argc++] = "daemon_timeout=86400";
 #endif
@@ -393,9 +590,30 @@ main(int argc, char *argv[])
   }
 
   fuse_session_add_chan(se, ch);
-  // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-  err = fuse_session_loop(se);
-    
+  invalidator = new kernel_invalidator(ch);
+  yfs->set_invalidator(invalidator);
+
+  // YFS_THREADS workers serve requests, 1 runs the plain session loop
+  int nthreads = 8;
+  char *threads_env = getenv("YFS_THREADS");
+  if (threads_env != NULL && atoi(threads_env) > 0)
+    nthreads = atoi(threads_env);
+  if (nthreads == 1) {
+    err = fuse_session_loop(se);
+  } else {
+    worker_args w = { se, ch };
+    std::vector<pthread_t> workers(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+      if (pthread_create(&workers[i], NULL, fuseserver_worker, &w) != 0) {
+        fprintf(stderr, "could not start fuse worker\n");
+        exit(1);
+      }
+    }
+    for (int i = 0; i < nthreads; i++)
+      pthread_join(workers[i], NULL);
+    err = 0;
+  }
+
   fuse_session_destroy(se);
   close(fd);
   fuse_unmount(mountpoint);
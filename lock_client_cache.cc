@@ -54,20 +54,28 @@ lock_client_cache::releaser() {
   // freed locks that have been revoked by the server, so that it can
   // send a release RPC.
   while (true) {
-    auto req = release_queue.consume();
+    // revocations that piled up while the last batch was being released
+    // are released together
+    auto reqs = release_queue.consume_all();
+    std::vector<lock_protocol::lockid_t> lids;
     pthread_mutex_lock(&cache_mutex);
-    Lock &lock = cache[req.lid];
-    lock.status = Lock::RELEASING;
+    for (auto &req : reqs) {
+      cache[req.lid].status = Lock::RELEASING;
+      lids.push_back(req.lid);
+    }
     pthread_mutex_unlock(&cache_mutex);
 
     // call dorelease from lock_release_user
-    lu->dorelease(req.lid);
+    if (lu)
+      lu->dorelease(lids);
 
-    int r; assert(rsmc->call(lock_protocol::release, id, req.lid, req.seq, r) == lock_protocol::OK);
+    for (auto &req : reqs) {
+      int r; assert(rsmc->call(lock_protocol::release, id, req.lid, req.seq, r) == lock_protocol::OK);
 
-    pthread_mutex_lock(&cache_mutex);
-    lock.status = Lock::NONE;
-    pthread_mutex_unlock(&cache_mutex);
+      pthread_mutex_lock(&cache_mutex);
+      cache[req.lid].status = Lock::NONE;
+      pthread_mutex_unlock(&cache_mutex);
+    }
     pthread_cond_broadcast(&acquire_signal);
   }
 }
@@ -137,6 +145,20 @@ lock_client_cache::release(lock_protocol::lockid_t lid) {
 
 
 
+bool
+lock_client_cache::owned(lock_protocol::lockid_t lid) {
+  ScopedLock guard(&cache_mutex);
+
+  auto it = cache.find(lid);
+  if (it == cache.end())
+    return false;
+  Lock& lock = it->second;
+  return (lock.status == Lock::FREE || lock.status == Lock::LOCKED)
+    && lock.seqnum_at_revoke < lock.seqnum;
+}
+
+
+
 rlock_protocol::status
 lock_client_cache::revoke_handler(lock_protocol::lockid_t lid, unsigned int seq, int& r) {
   ScopedLock guard(&cache_mutex);
@@ -6,6 +6,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include "slock.h"
 #include "lock_protocol.h"
 #include "rpc.h"
@@ -18,6 +19,12 @@
 class lock_release_user {
  public:
   virtual void dorelease(lock_protocol::lockid_t) = 0;
+  // locks revoked together are handed over at once, so their data can be
+  // written back in batches
+  virtual void dorelease(const std::vector<lock_protocol::lockid_t> &lids) {
+    for (size_t i = 0; i < lids.size(); i++)
+      dorelease(lids[i]);
+  }
   virtual ~lock_release_user() {};
 };
 
@@ -93,6 +100,16 @@ public:
       queue.pop_front();
       return retval;
     }
+    // waits like consume, then takes everything queued
+    std::list<T> consume_all() {
+      ScopedLock guard(&queue_mutex);
+      while (queue.empty()) {
+        pthread_cond_wait(&consume_signal, &queue_mutex);
+      }
+      std::list<T> retval;
+      retval.swap(queue);
+      return retval;
+    }
 };
 
 
@@ -145,6 +162,9 @@ public:
   virtual ~lock_client_cache() {};
   lock_protocol::status acquire(lock_protocol::lockid_t);
   virtual lock_protocol::status release(lock_protocol::lockid_t);
+  // whether this client has the lock and keeps it past the next release,
+  // so acquiring it takes no RPC
+  bool owned(lock_protocol::lockid_t);
   void releaser();
 };
 #endif
@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
+#include <limits.h>
 
 #include "method_thread.h"
 #include "connection.h"
@@ -40,7 +41,7 @@ connection::~connection()
 	assert(pthread_cond_destroy(&send_complete_) == 0);
 	if (rpdu_.buf)
 		free(rpdu_.buf);
-	assert(!wpdu_.buf);
+	assert(wpdu_.iov.empty());
 	close(fd_);
 }
 
@@ -103,18 +104,29 @@ connection::ref()
 
 bool
 connection::send(char *b, int sz)
+{
+	struct iovec iov;
+	iov.iov_base = b;
+	iov.iov_len = sz;
+	return send(&iov, 1);
+}
+
+bool
+connection::send(const struct iovec *iov, int iovcnt)
 {
 	ScopedLock ml(&m_);
 	waiters_++;
-	while (!dead_ && wpdu_.buf) {
+	while (!dead_ && !wpdu_.iov.empty()) {
 		assert(pthread_cond_wait(&send_wait_, &m_)==0);
 	}
 	waiters_--;
 	if (dead_) {
 		return false;
 	}
-	wpdu_.buf = b;
-	wpdu_.sz = sz;
+	wpdu_.iov.assign(iov, iov + iovcnt);
+	wpdu_.sz = 0;
+	for (int i = 0; i < iovcnt; i++)
+		wpdu_.sz += iov[i].iov_len;
 	wpdu_.solong = 0;
 
 	if (lossy_) {
@@ -141,7 +153,7 @@ connection::send(char *b, int sz)
 	}
 	bool ret = (!dead_ && wpdu_.solong == wpdu_.sz);
 	wpdu_.solong = wpdu_.sz = 0;
-	wpdu_.buf = NULL;
+	wpdu_.iov.clear();
 	if (waiters_ > 0)
 		pthread_cond_broadcast(&send_wait_);
 	return ret;
@@ -209,9 +221,25 @@ connection::writepdu()
 
 	if (wpdu_.solong == 0) {
 		int sz = htonl(wpdu_.sz);
-		bcopy(&sz,wpdu_.buf,sizeof(sz));
+		assert(wpdu_.iov[0].iov_len >= sizeof(sz));
+		bcopy(&sz,wpdu_.iov[0].iov_base,sizeof(sz));
+	}
+
+	//skip what previous calls already wrote
+	struct iovec iov[IOV_MAX];
+	int cnt = 0;
+	size_t skip = wpdu_.solong;
+	for (size_t i = 0; i < wpdu_.iov.size() && cnt < IOV_MAX; i++) {
+		if (skip >= wpdu_.iov[i].iov_len) {
+			skip -= wpdu_.iov[i].iov_len;
+			continue;
+		}
+		iov[cnt].iov_base = (char *) wpdu_.iov[i].iov_base + skip;
+		iov[cnt].iov_len = wpdu_.iov[i].iov_len - skip;
+		skip = 0;
+		cnt++;
 	}
-	int n = write(fd_, wpdu_.buf + wpdu_.solong, (wpdu_.sz-wpdu_.solong));
+	int n = writev(fd_, iov, cnt);
 	if (n < 0) {
 		if (errno != EAGAIN) {
 			jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, errno);
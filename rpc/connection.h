@@ -5,8 +5,10 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 
 #include <map>
+#include <vector>
 #include <stdexcept>
 
 #include "pollmgr.h"
@@ -33,6 +35,14 @@ class connection : public aio_callback {
 			int solong; //amount of bytes written or read so far
 		};
 
+		// an outgoing pdu, possibly gathered from several buffers
+		struct iovbuf {
+			iovbuf(): sz(0), solong(0) {}
+			std::vector<struct iovec> iov;
+			int sz;
+			int solong; //amount of bytes written so far
+		};
+
 		connection(chanmgr *m1, int f1, int lossytest=0);
 		~connection();
 
@@ -41,6 +51,9 @@ class connection : public aio_callback {
 		void closeconn();
 
 		bool send(char *b, int sz);
+		// the first buffer starts with the header space, the caller
+		// keeps all of them alive until send returns
+		bool send(const struct iovec *iov, int iovcnt);
 		void write_cb(int s);
 		void read_cb(int s);
 
@@ -57,7 +70,7 @@ class connection : public aio_callback {
 		const int fd_;
 		bool dead_;
 
-		charbuf wpdu_;
+		iovbuf wpdu_;
 		charbuf rpdu_;
 
 		int waiters_;
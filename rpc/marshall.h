@@ -7,9 +7,12 @@
 #include <vector>
 #include <map>
 #include <algorithm>
+#include <atomic>
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include "shared_buf.h"
 
 struct req_header {
 	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0):
@@ -33,6 +36,16 @@ typedef int rpc_sz_t;
 //size of initial buffer allocation 
 const int DEFAULT_RPC_SZ = 1024;
 
+//shared_buf payloads of at least this many bytes are not copied into the
+//marshall buffer but referenced and sent with writev
+extern unsigned int rpc_splice_min;
+
+//payload bytes copied in or out of marshall buffers, for benchmarks
+extern std::atomic<unsigned long long> rpc_bytes_copied;
+
+//bytes of rpc requests and replies handed to connections, for benchmarks
+extern std::atomic<unsigned long long> rpc_bytes_sent;
+
 #if RPC_CHECKSUMMING
 	//size of rpc_header includes a 4-byte int to be filled by tcpchan and uint64_t checksum
 	const int RPC_HEADER_SZ = std::max(sizeof(req_header), sizeof(reply_header)) + sizeof(rpc_sz_t) + sizeof(rpc_checksum_t);
@@ -45,6 +58,8 @@ class marshall {
 		char *_buf;     // Base of the raw bytes buffer (dynamically readjusted)
 		int _capa;      // Capacity of the buffer
 		int _ind;       // Read/write head position
+		// payloads sent by reference, each goes in front of _buf[offset]
+		std::vector<std::pair<int, shared_buf> > _spliced;
 
 	public:
 		marshall() {
@@ -64,10 +79,22 @@ class marshall {
 
 		void rawbyte(unsigned char);
 		void rawbytes(const char *, int);
+		void splice(const shared_buf &);
+
+		// the whole pdu, including spliced payloads, for connection::send
+		void iovecs(std::vector<struct iovec> &);
 
 		// Return the current content (excluding header) as a string
 		std::string get_content() { 
-			return std::string(_buf+RPC_HEADER_SZ,_ind-RPC_HEADER_SZ);
+			std::string s;
+			int pos = RPC_HEADER_SZ;
+			for (size_t i = 0; i < _spliced.size(); i++) {
+				s.append(_buf+pos, _spliced[i].first-pos);
+				s.append(_spliced[i].second.data(), _spliced[i].second.size());
+				pos = _spliced[i].first;
+			}
+			s.append(_buf+pos, _ind-pos);
+			return s;
 		}
 
 		// Return the current content (excluding header) as a string
@@ -105,6 +132,7 @@ class marshall {
 		}
 
 		void take_buf(char **b, int *s) {
+			assert(_spliced.empty());
 			*b = _buf;
 			*s = _ind;
 			_buf = NULL;
@@ -120,6 +148,7 @@ marshall& operator<<(marshall &, unsigned short);
 marshall& operator<<(marshall &, short);
 marshall& operator<<(marshall &, unsigned long long);
 marshall& operator<<(marshall &, const std::string &);
+marshall& operator<<(marshall &, const shared_buf &);
 
 class unmarshall {
 	private:
@@ -202,6 +231,7 @@ unmarshall& operator>>(unmarshall &, unsigned int &);
 unmarshall& operator>>(unmarshall &, int &);
 unmarshall& operator>>(unmarshall &, unsigned long long &);
 unmarshall& operator>>(unmarshall &, std::string &);
+unmarshall& operator>>(unmarshall &, shared_buf &);
 
 template <class C> marshall &
 operator<<(marshall &m, std::vector<C> v)
@@ -76,6 +76,20 @@
 const rpcc::TO rpcc::to_max = { 120000 };
 const rpcc::TO rpcc::to_min = { 1000 };
 
+unsigned int rpc_splice_min = 2048;
+std::atomic<unsigned long long> rpc_bytes_copied(0);
+std::atomic<unsigned long long> rpc_bytes_sent(0);
+
+static bool
+send_pdu(connection *c, marshall &m)
+{
+	std::vector<struct iovec> iov;
+	m.iovecs(iov);
+	for (size_t i = 0; i < iov.size(); i++)
+		rpc_bytes_sent += iov[i].iov_len;
+	return c->send(&iov[0], iov.size());
+}
+
 rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
 : xid(xxid), un(xun), done(false)
 {
@@ -226,7 +240,7 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		if (transmit) {
 			get_refconn(&ch);
 			if (ch) {
-			        if (reachable_) ch->send(req.cstr(), req.size());
+			        if (reachable_) send_pdu(ch, req);
 				else jsl_log(JSL_DBG_1, "not reachable\n");
 				jsl_log(JSL_DBG_2, 
 						"rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n", 
@@ -498,7 +512,7 @@ rpcs::dispatch(djob_t *j)
 				h.srv_nonce, nonce_, h.proc);
 		rh.ret = rpc_const::oldsrv_failure;
 		rep.pack_reply_header(rh);
-		c->send(rep.cstr(),rep.size());
+		send_pdu(c, rep);
 		return;
 	}
 
@@ -517,8 +531,7 @@ rpcs::dispatch(djob_t *j)
 	}
 
 	rpcs::rpcstate_t stat;
-	char *b1;
-	int sz1;
+	marshall *rep1 = NULL;
 
 	if (h.clt_nonce) {
 		//have i seen this client before?
@@ -546,7 +559,7 @@ rpcs::dispatch(djob_t *j)
 			}
 		}
 
-		stat = checkduplicate_and_update(h.clt_nonce, h.xid, h.xid_rep, &b1, &sz1);
+		stat = checkduplicate_and_update(h.clt_nonce, h.xid, h.xid_rep, &rep1);
 	} else {
 		//this client does not require at most once logic
 		stat = NEW;
@@ -558,20 +571,22 @@ rpcs::dispatch(djob_t *j)
 				updatestat(proc);
 			}
 
-			rh.ret = f->fn(req, rep);
+			// the reply may reference payloads the handler returned, so
+			// it is kept as a marshall rather than flattened to bytes
+			rep1 = new marshall;
+			rh.ret = f->fn(req, *rep1);
 			assert(rh.ret >= 0 || 
 					rh.ret == rpc_const::unmarshal_args_failure);
 
-			rep.pack_reply_header(rh);
-			rep.take_buf(&b1,&sz1);
+			rep1->pack_reply_header(rh);
 
 			jsl_log(JSL_DBG_2,
 					"rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
-					sz1, h.xid, proc, rh.ret, h.clt_nonce);
+					rep1->size(), h.xid, proc, rh.ret, h.clt_nonce);
 
 			if (h.clt_nonce > 0) {
 				//only record replies for clients that require at-most-once logic
-				add_reply(h.clt_nonce, h.xid, b1, sz1);
+				add_reply(h.clt_nonce, h.xid, rep1);
 			}
 
 			// get the latest connection to the client
@@ -584,23 +599,23 @@ rpcs::dispatch(djob_t *j)
 				}
 			}
 
-			c->send(b1, sz1);
+			send_pdu(c, *rep1);
 			if (h.clt_nonce == 0) {
 				//reply is not added to at-most-once window, free it
-				free(b1);
+				delete rep1;
 			}
 			break;
 		case INPROGRESS: //server is working on this request
 			break;
 		case DONE: //duplicate and we still have the response
-			c->send(b1, sz1);
+			send_pdu(c, *rep1);
 			break;
 		case FORGOTTEN: //very old request and we don't have the response anymore
 			jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n", 
 					h.xid, h.clt_nonce);
 			rh.ret = rpc_const::atmostonce_failure;
 			rep.pack_reply_header(rh);
-			c->send(rep.cstr(),rep.size());
+			send_pdu(c, rep);
 			break;
 	}
 	c->decref();
@@ -608,13 +623,12 @@ rpcs::dispatch(djob_t *j)
 
 void
 rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
-		char *b, int sz)
+		marshall *rep)
 {
 	ScopedLock rwl(&reply_window_m_);
   for (reply_t& data: reply_window_[clt_nonce]) {
     if (data.xid == xid) {
-      data.buf = b;
-      data.sz = sz;
+      data.rep = rep;
       data.cb_present = true;
       return;
     }
@@ -631,7 +645,7 @@ rpcs::free_reply_window(void)
 	ScopedLock rwl(&reply_window_m_);
 	for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++) {
 		for (it = clt->second.begin(); it != clt->second.end(); it++) {
-			free((*it).buf);
+			delete (*it).rep;
 		}
 		clt->second.clear();
 	}
@@ -640,7 +654,7 @@ rpcs::free_reply_window(void)
 
 rpcs::rpcstate_t 
 rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
-		unsigned int xid_rep, char **b, int *sz)
+		unsigned int xid_rep, marshall **rep)
 {
 	ScopedLock rwl(&reply_window_m_);
 
@@ -653,7 +667,7 @@ rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
     // so the old transaction can't be in-progress
     assert(reply_window_[clt_nonce].front().cb_present = true);
     //printf("-- deleting record for client %u & xid %u\n", clt_nonce, reply_window_[clt_nonce].front().xid);
-    free(reply_window_[clt_nonce].front().buf);
+    delete reply_window_[clt_nonce].front().rep;
     reply_window_[clt_nonce].pop_front();
   }
 
@@ -682,8 +696,7 @@ rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
       } else {
         // duplicate done request
         //printf("-- DONE request from client: %u xid: %u ack: %u\n", clt_nonce, xid, xid_rep);
-        *sz = it.sz;
-        *b = it.buf;
+        *rep = it.rep;
         return DONE;
       }
     }
@@ -731,6 +744,34 @@ marshall::rawbytes(const char *p, int n)
 	}
 	memcpy(_buf+_ind, p, n);
 	_ind += n;
+	rpc_bytes_copied += n;
+}
+
+void
+marshall::splice(const shared_buf &b)
+{
+	_spliced.push_back(std::make_pair(_ind, b));
+}
+
+void
+marshall::iovecs(std::vector<struct iovec> &iov)
+{
+	int pos = 0;
+	iov.clear();
+	for (size_t i = 0; i < _spliced.size(); i++) {
+		struct iovec v;
+		v.iov_base = _buf + pos;
+		v.iov_len = _spliced[i].first - pos;
+		iov.push_back(v);
+		v.iov_base = (void *) _spliced[i].second.data();
+		v.iov_len = _spliced[i].second.size();
+		iov.push_back(v);
+		pos = _spliced[i].first;
+	}
+	struct iovec v;
+	v.iov_base = _buf + pos;
+	v.iov_len = _ind - pos;
+	iov.push_back(v);
 }
 
 marshall &
@@ -789,6 +830,18 @@ operator<<(marshall &m, const std::string &s)
 	return m;
 }
 
+// same wire format as a std::string
+marshall &
+operator<<(marshall &m, const shared_buf &b)
+{
+	m << (unsigned int) b.size();
+	if (b.size() >= rpc_splice_min)
+		m.splice(b);
+	else
+		m.rawbytes(b.data(), b.size());
+	return m;
+}
+
 marshall &
 operator<<(marshall &m, unsigned long long x)
 {
@@ -927,6 +980,15 @@ operator>>(unmarshall &u, std::string &s)
 	return u;
 }
 
+unmarshall &
+operator>>(unmarshall &u, shared_buf &b)
+{
+	std::string s;
+	u >> s;
+	b = shared_buf(std::move(s));
+	return u;
+}
+
 void
 unmarshall::rawbytes(std::string &ss, unsigned int n)
 {
@@ -937,6 +999,7 @@ unmarshall::rawbytes(std::string &ss, unsigned int n)
 		swap(ss, tmps);
 		assert(ss.size() == n);
 		_ind += n;
+		rpc_bytes_copied += n;
 	}
 }
 
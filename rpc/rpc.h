@@ -263,13 +263,11 @@ class rpcs : public chanmgr {
 		reply_t (unsigned int _xid) {
 			xid = _xid;
 			cb_present = false;
-			buf = NULL;
-			sz = 0;
+			rep = NULL;
 		}
 		unsigned int xid;
 		bool cb_present;
-		char *buf;
-		int sz;
+		marshall *rep;
 	};
 
 	int port_;
@@ -285,11 +283,11 @@ class rpcs : public chanmgr {
 	std::vector<std::pair<unsigned int, unsigned int>> forgotten_history;
 
 	void free_reply_window(void);
-	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
+	void add_reply(unsigned int clt_nonce, unsigned int xid, marshall *rep);
 
 	rpcstate_t checkduplicate_and_update(unsigned int clt_nonce, 
 			unsigned int xid, unsigned int rep_xid,
-			char **b, int *sz);
+			marshall **rep);
 
 	void updatestat(unsigned int proc);
 
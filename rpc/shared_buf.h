@@ -0,0 +1,44 @@
+#ifndef shared_buf_h
+#define shared_buf_h
+
+#include <memory>
+#include <string>
+#include <assert.h>
+
+// immutable, reference counted bytes. copies and slices share the
+// underlying storage, so a buffer filled by the extent store can be handed
+// to the rpc layer and written to the socket without being copied again.
+class shared_buf {
+	private:
+		std::shared_ptr<const std::string> _s;
+		size_t _off;
+		size_t _len;
+
+	public:
+		shared_buf() : _off(0), _len(0) {}
+
+		// takes over the string's storage, does not copy it
+		explicit shared_buf(std::string &&s)
+			: _s(std::make_shared<const std::string>(std::move(s))),
+			  _off(0), _len(_s->size()) {}
+
+		shared_buf(const char *p, size_t n)
+			: _s(std::make_shared<const std::string>(p, n)), _off(0), _len(n) {}
+
+		const char *data() const { return _s ? _s->data() + _off : ""; }
+		size_t size() const { return _len; }
+		bool empty() const { return _len == 0; }
+
+		shared_buf slice(size_t off, size_t len) const {
+			assert(off + len <= _len);
+			shared_buf b(*this);
+			b._off += off;
+			b._len = len;
+			return b;
+		}
+
+		// a private copy, for callers that need a mutable string
+		std::string str() const { return std::string(data(), _len); }
+};
+
+#endif
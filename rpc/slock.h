@@ -14,4 +14,28 @@ struct ScopedLock {
 			assert(pthread_mutex_unlock(m_)==0);
 		}
 };
+
+struct ScopedReadLock {
+	private:
+		pthread_rwlock_t *l_;
+	public:
+		ScopedReadLock(pthread_rwlock_t *l): l_(l) {
+			assert(pthread_rwlock_rdlock(l_)==0);
+		}
+		~ScopedReadLock() {
+			assert(pthread_rwlock_unlock(l_)==0);
+		}
+};
+
+struct ScopedWriteLock {
+	private:
+		pthread_rwlock_t *l_;
+	public:
+		ScopedWriteLock(pthread_rwlock_t *l): l_(l) {
+			assert(pthread_rwlock_wrlock(l_)==0);
+		}
+		~ScopedWriteLock() {
+			assert(pthread_rwlock_unlock(l_)==0);
+		}
+};
 #endif  /*__SCOPED_LOCK__*/
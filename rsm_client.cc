@@ -2,6 +2,8 @@
 #include <vector>
 #include <arpa/inet.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include "jsl_log.h"
 
 
 rsm_client::rsm_client(std::string dst)
@@ -54,7 +56,8 @@ rsm_client::invoke(int proc, std::string req, std::string &rep)
   rpcc *cl;
   assert(pthread_mutex_lock(&rsm_client_mutex)==0);
   while (1) {
-    printf("rsm_client::invoke proc %x primary %s\n", proc, primary.id.c_str());
+    jsl_log(JSL_DBG_4, "rsm_client::invoke proc %x primary %s\n", proc,
+            primary.id.c_str());
     cl = primary.cl;
     primary.nref++;
     assert(pthread_mutex_unlock(&rsm_client_mutex)==0);
@@ -62,8 +65,8 @@ rsm_client::invoke(int proc, std::string req, std::string &rep)
         rep, rpcc::to(5000));
     assert(pthread_mutex_lock(&rsm_client_mutex)==0);
     primary.nref--;
-    printf("rsm_client::invoke proc %x primary %s ret %d\n", proc, 
-     primary.id.c_str(), ret);
+    jsl_log(JSL_DBG_4, "rsm_client::invoke proc %x primary %s ret %d\n", proc,
+            primary.id.c_str(), ret);
     if (ret == rsm_client_protocol::OK) {
       break;
     }
@@ -51,6 +51,21 @@ echo "starting ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &"
 ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &
 sleep 1
 
+# NUM_ES=n shards the extents over n extent servers
+if [ -n "$NUM_ES" ] && [ $NUM_ES -gt 1 ]; then
+    EXTENT_PORTS=$EXTENT_PORT
+    x=1
+    while [ $x -lt $NUM_ES ]; do
+      port=$[BASE_PORT+20+2*x]
+      echo "starting ./extent_server $port > extent_server$x.log 2>&1 &"
+      ./extent_server $port > extent_server$x.log 2>&1 &
+      EXTENT_PORTS=$EXTENT_PORTS,$port
+      x=$[x+1]
+    done
+    EXTENT_PORT=$EXTENT_PORTS
+    sleep 1
+fi
+
 mkdir -p $YFSDIR1
 sleep 1
 echo "starting ./yfs_client $YFSDIR1 $EXTENT_PORT $LOCK_PORT > yfs_client1.log 2>&1 &"
@@ -2,9 +2,11 @@
 #include "yfs_client.h"
 #include "extent_client.h"
 #include "lock_client_cache.h"
+#include "yfs_dir.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -13,78 +15,355 @@
 #include <thread>
 #include <chrono>
 
+// a flush only fails while its extents cannot be moved to their server.
+// the release waits for it, backing off up to a second between attempts.
+template<class T>
+static void
+flush_retry(extent_client *ec, const T &what) {
+    std::chrono::milliseconds delay(1);
+    while (ec->flush(what) != extent_protocol::OK) {
+        std::this_thread::sleep_for(delay);
+        delay = std::min(delay * 2, std::chrono::milliseconds(1000));
+    }
+}
+
 void
 custom_lock_release_user::dorelease(lock_protocol::lockid_t lid) {
-    int ret;
-    while ((ret = ec->flush(lid)) != extent_protocol::OK);
+    yfs->revoked(lid);
+    flush_retry(ec, (extent_protocol::extentid_t) lid);
+}
+
+void
+custom_lock_release_user::dorelease(const std::vector<lock_protocol::lockid_t> &lids) {
+    std::vector<extent_protocol::extentid_t> eids(lids.begin(), lids.end());
+    for (size_t i = 0; i < lids.size(); i++)
+        yfs->revoked(lids[i]);
+    flush_retry(ec, eids);
 }
 
+const int yfs_client::default_lease_ms;
+
 yfs_client::yfs_client(std::string extent_dst, std::string lock_dst)
+  : invalidator(NULL), lease(default_lease_ms), unlocked_getattrs(0), leases(0),
+    dir_lookups(0), absent_hits(0), filter_hits(0), dentry_hits(0),
+    dentry_limit(max_dentries)
 {
   ec = new extent_client(extent_dst);
+  pthread_mutex_init(&listing_lock, NULL);
+  const char *ms = getenv("YFS_LEASE_MS");
+  if (ms)
+    lease = std::chrono::milliseconds(atoi(ms));
   
-  custom_lock_release_user *newlc = new custom_lock_release_user(ec);
+  custom_lock_release_user *newlc = new custom_lock_release_user(ec, this);
   
   lc = new lock_client_cache(lock_dst, newlc);
 }
 
-yfs_client::inum
-yfs_client::n2i(std::string n)
+void
+yfs_client::set_invalidator(cache_invalidator *inv)
 {
-  std::istringstream ist(n);
-  unsigned long long finum;
-  ist >> finum;
-  return finum;
+  ScopedLock ll(&listing_lock);
+  invalidator = inv;
 }
 
-std::string
-yfs_client::filename(inum inum)
+void
+yfs_client::set_lease(std::chrono::milliseconds ms)
 {
-  std::ostringstream ost;
-  ost << inum;
-  return ost.str();
+  ScopedLock ll(&listing_lock);
+  lease = ms;
 }
 
+void
+yfs_client::set_dentry_limit(size_t n)
+{
+  ScopedLock ll(&listing_lock);
+  dentry_limit = n;
+  while (dentries.size() > dentry_limit)
+    erase_dentry(dentry_lru.back());
+}
 
-std::string yfs_client::serialize(dirent_lst_t lst) {
-  // encode as 'inum:folder1/folder2/../filename' separated by \n
-  std::string retval;
-  for (auto it: lst) {
-    retval += "" + filename(it.inum) + ":" + it.name + "\n";
-  }
-  return retval;
+double
+yfs_client::lease_seconds()
+{
+  ScopedLock ll(&listing_lock);
+  return lease.count() / 1000.0;
+}
+
+void
+yfs_client::get_stats(stats &st)
+{
+  ScopedLock ll(&listing_lock);
+  st.unlocked_getattrs = unlocked_getattrs;
+  st.leases = leases;
+  st.dir_lookups = dir_lookups;
+  st.absent_hits = absent_hits;
+  st.filter_hits = filter_hits;
+  st.dentry_hits = dentry_hits;
 }
 
-yfs_client::dirent_lst_t yfs_client::unserialize(std::string serialized) {
-  yfs_client::dirent_lst_t retval;
-  std::stringstream ss(serialized);
-  std::string part;
-  while (getline(ss, part, '\n')) {
-    // id:filename
-    int pos_of_delim;
-    for (int i=0; i<((int)part.size()); i++) {
-      if (part[i] == ':') {
-        pos_of_delim = i;
-        break;
-      }
+void
+yfs_client::revoked(inum inum)
+{
+  cache_invalidator *inv;
+  {
+    ScopedLock ll(&listing_lock);
+    listings.erase(inum);
+    listed.erase(inum);
+    absent.erase(inum);
+    auto d = dentry_names.find(inum);
+    if (d != dentry_names.end()) {
+      std::unordered_set<std::string> names;
+      names.swap(d->second);
+      for (auto &name : names)
+        erase_dentry(dentry_key(inum, name));
     }
-    unsigned long long inum = n2i(part.substr(0, pos_of_delim));
-    std::string name = part.substr(pos_of_delim+1, part.size());
-    dirent ent = dirent(name, inum);
-    retval.push_back(ent);
+    inv = invalidator;
   }
-  return retval;
+  if (inv)
+    inv->invalidate(inum);
 }
 
+bool
+yfs_client::listed_lookup(inum parent, const std::string &name, inum &inum)
+{
+  ScopedLock ll(&listing_lock);
+  auto it = listings.find(parent);
+  if (it == listings.end() || it->second.expires < std::chrono::steady_clock::now())
+    return false;
+  auto n = it->second.names.find(name);
+  if (n == it->second.names.end())
+    return false;
+  inum = n->second;
+  return true;
+}
 
 bool
-yfs_client::isfile(inum inum)
+yfs_client::listed_info(inum inum, fileinfo &info)
+{
+  ScopedLock ll(&listing_lock);
+  auto it = listed.find(inum);
+  if (it == listed.end())
+    return false;
+  if (it->second.expires < std::chrono::steady_clock::now()) {
+    listed.erase(it);
+    return false;
+  }
+  info = it->second.info;
+  return true;
+}
+
+// stat storms over files other clients work on would otherwise pull each
+// lock over here and have it revoked again right after. the extent server
+// has the attributes as of the last release, and they are believed for
+// the lease, like those of a listing.
+bool
+yfs_client::leased_info(inum inum, fileinfo &info)
+{
+  std::vector<extent_protocol::extentid_t> eids(1, inum);
+  std::map<extent_protocol::extentid_t, extent_protocol::attr> attrs;
+  if (ec->peek_attrs(eids, attrs) != extent_protocol::OK || !attrs.count(inum))
+    return false;
+  extent_protocol::attr &a = attrs[inum];
+  info.size = a.size;
+  info.atime = a.atime;
+  info.mtime = a.mtime;
+  info.ctime = a.ctime;
+  info.under_lock = false;
+
+  ScopedLock ll(&listing_lock);
+  if (listed.size() >= max_listed && !listed.count(inum))
+    listed.clear();
+  listed_attr &la = listed[inum];
+  la.expires = std::chrono::steady_clock::now() + lease;
+  la.info = info;
+  leases++;
+  return true;
+}
+
+// with the lock, what the extent cache has is as cheap and never stale,
+// so listings and leases are only believed while another client may
+// have it, and not at all without a lease
+bool
+yfs_client::unlocked_info(inum inum, fileinfo &info)
+{
+  {
+    ScopedLock ll(&listing_lock);
+    if (lease.count() == 0)
+      return false;
+  }
+  if (lc->owned(inum))
+    return false;
+  if (!listed_info(inum, info) && !leased_info(inum, info))
+    return false;
+  ScopedLock ll(&listing_lock);
+  unlocked_getattrs++;
+  return true;
+}
+
+void
+yfs_client::name_filter::build(const std::vector<std::string> &names)
+{
+  // about ten bits a name, seven probes: under 1% false positives
+  size_t n = 8;
+  while (n * 64 < names.size() * 10)
+    n *= 2;
+  bits.assign(n, 0);
+  for (auto &name : names)
+    add(name);
+}
+
+void
+yfs_client::name_filter::add(const std::string &name)
+{
+  if (bits.empty())
+    return;
+  uint64_t mask = bits.size() * 64 - 1;
+  uint64_t h1 = dir_bucket::hash(name);
+  uint64_t h2 = std::hash<std::string>()(name) | 1;
+  for (int i = 0; i < 7; i++) {
+    uint64_t b = (h1 + i * h2) & mask;
+    bits[b / 64] |= 1ULL << (b % 64);
+  }
+}
+
+bool
+yfs_client::name_filter::may_contain(const std::string &name) const
 {
-  if(inum & 0x80000000)
+  if (bits.empty())
     return true;
+  uint64_t mask = bits.size() * 64 - 1;
+  uint64_t h1 = dir_bucket::hash(name);
+  uint64_t h2 = std::hash<std::string>()(name) | 1;
+  for (int i = 0; i < 7; i++) {
+    uint64_t b = (h1 + i * h2) & mask;
+    if (!(bits[b / 64] & (1ULL << (b % 64))))
+      return false;
+  }
+  return true;
+}
+
+bool
+yfs_client::cached_dentry(inum parent, const std::string &name, inum &ino)
+{
+  ScopedLock ll(&listing_lock);
+  auto it = dentries.find(dentry_key(parent, name));
+  if (it == dentries.end())
+    return false;
+  dentry_lru.splice(dentry_lru.begin(), dentry_lru, it->second.lru_pos);
+  ino = it->second.ino;
+  dentry_hits++;
+  return true;
+}
+
+void
+yfs_client::add_dentry(inum parent, const std::string &name, inum ino)
+{
+  ScopedLock ll(&listing_lock);
+  dentry_key key(parent, name);
+  auto it = dentries.find(key);
+  if (it != dentries.end()) {
+    it->second.ino = ino;
+    dentry_lru.splice(dentry_lru.begin(), dentry_lru, it->second.lru_pos);
+    return;
+  }
+  if (dentry_limit == 0)
+    return;
+  while (dentries.size() >= dentry_limit)
+    erase_dentry(dentry_lru.back());
+  dentry_lru.push_front(key);
+  dentry &d = dentries[key];
+  d.ino = ino;
+  d.lru_pos = dentry_lru.begin();
+  dentry_names[parent].insert(name);
+}
+
+void
+yfs_client::drop_dentry(inum parent, const std::string &name)
+{
+  ScopedLock ll(&listing_lock);
+  erase_dentry(dentry_key(parent, name));
+}
+
+void
+yfs_client::erase_dentry(const dentry_key &key)
+{
+  auto it = dentries.find(key);
+  if (it == dentries.end())
+    return;
+  inum parent = key.first;
+  auto n = dentry_names.find(parent);
+  if (n != dentry_names.end()) {
+    n->second.erase(key.second);
+    if (n->second.empty())
+      dentry_names.erase(n);
+  }
+  // key may be the list node itself
+  auto pos = it->second.lru_pos;
+  dentries.erase(it);
+  dentry_lru.erase(pos);
+}
+
+bool
+yfs_client::known_absent(inum parent, const std::string &name)
+{
+  ScopedLock ll(&listing_lock);
+  auto it = absent.find(parent);
+  if (it == absent.end())
+    return false;
+  if (it->second.names.count(name)) {
+    absent_hits++;
+    return true;
+  }
+  if (!it->second.filter.may_contain(name)) {
+    filter_hits++;
+    return true;
+  }
   return false;
 }
 
+bool
+yfs_client::note_absent(inum parent, const std::string &name)
+{
+  ScopedLock ll(&listing_lock);
+  absent_names &a = absent[parent];
+  if (a.names.size() >= max_absent)
+    a.names.clear();
+  a.names.insert(name);
+  return ++a.misses == bloom_after && a.filter.bits.empty();
+}
+
+void
+yfs_client::note_present(inum parent, const std::string &name)
+{
+  ScopedLock ll(&listing_lock);
+  auto it = absent.find(parent);
+  if (it == absent.end())
+    return;
+  it->second.names.erase(name);
+  it->second.filter.add(name);
+}
+
+void
+yfs_client::filter_names(inum parent, const std::vector<std::string> &names)
+{
+  ScopedLock ll(&listing_lock);
+  absent[parent].filter.build(names);
+}
+
+void
+yfs_client::unlist(inum inum)
+{
+  ScopedLock ll(&listing_lock);
+  listings.erase(inum);
+  listed.erase(inum);
+}
+
+bool
+yfs_client::isfile(inum inum)
+{
+  return extent_protocol::isfile(inum);
+}
+
 bool
 yfs_client::isdir(inum inum)
 {
@@ -94,6 +373,8 @@ yfs_client::isdir(inum inum)
 int
 yfs_client::getfile(inum inum, fileinfo &fin)
 {
+  if (unlocked_info(inum, fin))
+    return OK;
   acquire_lock(inum);
   printf("getfile %016llx\n", inum);
   extent_protocol::attr a;
@@ -105,6 +386,7 @@ yfs_client::getfile(inum inum, fileinfo &fin)
   fin.mtime = a.mtime;
   fin.ctime = a.ctime;
   fin.size = a.size;
+  fin.under_lock = true;
   printf("getfile %016llx -> sz %llu\n", inum, fin.size);
   release_lock(inum);
   return OK;
@@ -113,6 +395,14 @@ yfs_client::getfile(inum inum, fileinfo &fin)
 int
 yfs_client::getdir(inum inum, dirinfo &din)
 {
+  fileinfo info;
+  if (unlocked_info(inum, info)) {
+    din.atime = info.atime;
+    din.mtime = info.mtime;
+    din.ctime = info.ctime;
+    din.under_lock = false;
+    return OK;
+  }
   acquire_lock(inum);
   printf("getdir %016llx\n", inum);
   extent_protocol::attr a;
@@ -123,73 +413,58 @@ yfs_client::getdir(inum inum, dirinfo &din)
   din.atime = a.atime;
   din.mtime = a.mtime;
   din.ctime = a.ctime;
+  din.under_lock = true;
   release_lock(inum);
   return OK;
 }
 
 
-int yfs_client::get_all_in_dir(yfs_client::inum parent, dirent_lst_t& dirent_lst) {
-  if (!isdir(parent))
-    return IOERR;
-  std::string serialized;
-  if (ec->get(parent, serialized) != OK) {
-    return NOENT;
-  }
-  dirent_lst = yfs_client::unserialize(serialized);
-  return OK;
-}
-
-
-int yfs_client::put_all_in_dir(inum parent, dirent_lst_t dirent_lst) {
-  if (!isdir(parent))
-    return IOERR;
-  std::string serialized = yfs_client::serialize(dirent_lst);
-  return ec->put(parent, serialized);
-}
-
-
-yfs_client::inum yfs_client::create_random_inum(bool is_dir) {
-  unsigned long long upper32bits = rand();
-  unsigned long long lower32bits = rand();
-  unsigned long long random64bits = ((upper32bits << 32) | lower32bits);
+yfs_client::status yfs_client::new_inum(bool is_dir, inum &inum) {
+  auto ret = ec->alloc(inum);
+  if (ret != extent_protocol::OK)
+    return ret;
   if (!is_dir) {
     // file: set the 32nd bit to 1
-    return random64bits | 0x80000000;
+    inum |= 0x80000000;
   }
-  // dir: set the 32nd bit to 0
-  return random64bits & (~(1L << 31));
+  // dir: the 32nd bit is left 0
+  return OK;
 }
 
 
 int yfs_client::create(inum parent, const char *name, int is_dir, inum &inum) {
   acquire_lock(parent);
+  unlist(parent);
+  note_present(parent, name);
 
   if(isfile(parent)){
     release_lock(parent);
     return IOERR;
   }
-  // 0. check if file/folder already exists
-  dirent_lst_t dirent_lst_check;
-  auto get_ret = get_all_in_dir(parent, dirent_lst_check);
-  if (get_ret != OK) {
-    printf("ERROR! yfs_client::create get_ret failed! inum = %016llx name = %s\n\n", inum, name);
+  // 1. enter the name, unless it exists already. this is a single round
+  // trip when the bucket is changed in place on the extent server.
+  yfs_dir dir(ec, parent);
+  auto add_ret = new_inum(is_dir, inum);
+  if (add_ret != OK) {
+    printf("ERROR! yfs_client::create no inum! parent = %016llx\n\n", parent);
     release_lock(parent);
-    return get_ret;
-  }
-  for (auto it: dirent_lst_check) {
-    if (it.name == name) {
-      if (is_dir){
-        release_lock(parent);
-        return NOENT;
-      } else {
-        inum = it.inum;
-        release_lock(parent);
-        return OK;
-      }
-    }
+    return add_ret;
+  }
+  yfs_client::inum fresh = inum;
+  add_ret = dir.insert(name, inum);
+  if (add_ret != OK) {
+    printf("ERROR! yfs_client::create add failed! parent = %016llx\n\n", parent);
+    release_lock(parent);
+    return add_ret;
+  }
+  add_dentry(parent, name, inum);
+  if (inum != fresh) {
+    release_lock(parent);
+    return is_dir ? NOENT : OK;
   }
-  // 1. save new file/folder as a node
-  inum = create_random_inum(is_dir);
+
+  // 2. save new file/folder as a node. nobody can look the name up before
+  // the parent's lock is released.
   acquire_lock(inum);
   auto put_ret = ec->put(inum, "");
   release_lock(inum);
@@ -199,103 +474,164 @@ int yfs_client::create(inum parent, const char *name, int is_dir, inum &inum) {
     return put_ret;
   }
 
-  // 2. update the parent directory to reflect the new file
-  dirent_lst_t dirent_lst;
-  auto all_dir_ret = get_all_in_dir(parent, dirent_lst);
-  if (all_dir_ret != OK) {
-    printf("ERROR! yfs_client::create get_all_in_dir failed! parent = %016llx\n\n", parent);
-    release_lock(parent);
-    return all_dir_ret;
-  }
-  dirent_lst.push_back(dirent(name, inum));
-  auto put_all_ret = put_all_in_dir(parent, dirent_lst);
-  if (put_all_ret != OK) {
-    printf("ERROR! yfs_client::create put_all_in_dir failed! parent = %016llx\n\n", parent);
-    release_lock(parent);
-    return put_all_ret;
-  }
-
   release_lock(parent);
   return OK;
 }
 
 
 int yfs_client::lookup(inum parent, const char *name, inum &inum) {
+  if (cached_dentry(parent, name, inum) || listed_lookup(parent, name, inum))
+    return OK;
+  if (known_absent(parent, name))
+    return NOENT;
   acquire_lock(parent);
-  dirent_lst_t dirent_lst;
-  auto ret = get_all_in_dir(parent, dirent_lst);
-  if (ret != OK) {
-    printf("ERROR! yfs_client::lookup get_all_in_dir failed! parent = %016llx\n\n", parent);
+  if (isfile(parent)) {
     release_lock(parent);
-    return ret;
+    return IOERR;
   }
-  for (auto it: dirent_lst) {
-    if (it.name == name) {
-      inum = it.inum;
-      release_lock(parent);
-      return OK;
-    }
+  yfs_dir dir(ec, parent);
+  auto ret = dir.lookup(name, inum);
+  if (ret != OK && ret != NOENT)
+    printf("ERROR! yfs_client::lookup failed! parent = %016llx\n\n", parent);
+  {
+    ScopedLock ll(&listing_lock);
+    dir_lookups++;
+  }
+  if (ret == OK)
+    add_dentry(parent, name, inum);
+  // a directory probed this often is read whole once, for its filter,
+  // unless it is too large to read on every round trip of its lock
+  std::vector<yfs_dir::entry> entries;
+  uint32_t buckets;
+  if (ret == NOENT && note_absent(parent, name) && dir.buckets(buckets) == OK
+      && buckets <= filter_max_buckets && dir.list(entries) == OK) {
+    std::vector<std::string> names;
+    names.reserve(entries.size());
+    for (auto &e : entries)
+      names.push_back(e.name);
+    filter_names(parent, names);
   }
   release_lock(parent);
-  return NOENT;
+  return ret;
 }
 
 
 int yfs_client::readdir(inum parent, dirent_lst_t& dirent_lst) {
   acquire_lock(parent);
-  auto ret = get_all_in_dir(parent, dirent_lst);
+  if (isfile(parent)) {
+    release_lock(parent);
+    return IOERR;
+  }
+  yfs_dir dir(ec, parent);
+  std::vector<yfs_dir::entry> entries;
+  auto ret = dir.list(entries);
   if (ret != OK) {
-    printf("ERROR! yfs_client::readdir get_all_in_dir failed! parent = %016llx\n\n", parent);
+    printf("ERROR! yfs_client::readdir list failed! parent = %016llx\n\n", parent);
     release_lock(parent);
     return ret;
   }
+  dirent_lst.clear();
+  dirent_lst.reserve(entries.size());
+  std::vector<std::string> names;
+  names.reserve(entries.size());
+  for (auto &e : entries) {
+    dirent_lst.push_back(dirent(e.name, e.inum));
+    names.push_back(e.name);
+  }
+  filter_names(parent, names);
   release_lock(parent);
   return OK;
 }
 
 
-int yfs_client::read(inum inum, off_t offset, size_t size, std::string& data) {
-  acquire_lock(inum);
-  std::string content;
-  auto ret = ec->get(inum, content);
+int yfs_client::readdirplus(inum parent, direntplus_lst_t& lst) {
+  dirent_lst_t dirents;
+  auto ret = readdir(parent, dirents);
+  if (ret != OK)
+    return ret;
+
+  // the entries' attributes in batches, without taking their locks
+  std::vector<extent_protocol::extentid_t> eids;
+  eids.reserve(dirents.size());
+  for (auto &d : dirents)
+    eids.push_back(d.inum);
+  std::map<extent_protocol::extentid_t, extent_protocol::attr> attrs;
+  ret = ec->peek_attrs(eids, attrs);
   if (ret != OK) {
-    printf("ERROR! yfs_client::read ec->get failed! inum = %016llx\n\n", inum);
-    release_lock(inum);
+    printf("ERROR! yfs_client::readdirplus peek_attrs failed! parent = %016llx\n\n", parent);
     return ret;
   }
-  if (offset + size <= content.size()) {
-    data = content.substr(offset, size);
-  } else {
-    data = content;
-    data.resize(size, '\0');
+
+  auto now = std::chrono::steady_clock::now();
+  ScopedLock ll(&listing_lock);
+  auto expires = now + lease;
+  for (auto it = listings.begin(); it != listings.end(); ) {
+    if (it->second.expires < now)
+      listings.erase(it++);
+    else
+      ++it;
+  }
+  for (auto it = listed.begin(); it != listed.end(); ) {
+    if (it->second.expires < now)
+      listed.erase(it++);
+    else
+      ++it;
+  }
+  listing &l = listings[parent];
+  l.expires = expires;
+  l.names.clear();
+  lst.clear();
+  lst.reserve(dirents.size());
+  for (auto &d : dirents) {
+    direntplus e;
+    e.name = d.name;
+    e.inum = d.inum;
+    memset(&e.info, 0, sizeof(e.info));
+    auto a = attrs.find(d.inum);
+    // removed since the directory was read: listed as readdir would, but
+    // nothing is remembered about it
+    if (a == attrs.end()) {
+      lst.push_back(e);
+      continue;
+    }
+    e.info.size = a->second.size;
+    e.info.atime = a->second.atime;
+    e.info.mtime = a->second.mtime;
+    e.info.ctime = a->second.ctime;
+    lst.push_back(e);
+    l.names[e.name] = e.inum;
+    listed_attr &la = listed[e.inum];
+    la.expires = expires;
+    la.info = e.info;
   }
-  release_lock(inum);
   return OK;
 }
 
 
-int yfs_client::write(inum inum, off_t offset, size_t size, std::string data) {
+int yfs_client::read(inum inum, off_t offset, size_t size, std::vector<shared_buf>& data) {
   acquire_lock(inum);
-  std::string content;
-  auto ret = ec->get(inum, content);
+  auto ret = ec->read(inum, offset, size, data);
   if (ret != OK) {
-    printf("ERROR! yfs_client::write ec->get failed! inum = %016llx\n\n", inum);
+    printf("ERROR! yfs_client::read ec->read failed! inum = %016llx\n\n", inum);
     release_lock(inum);
     return ret;
   }
-  if (content.size() < offset + size) {
-    content.resize(offset + size);
-  }
-  content.replace(offset, size, data.substr(0, std::min(data.size(), size)));
-  // replace messes up the earlier resize
-  if (content.size() < offset + size) {
-    content.resize(offset + size);
+  release_lock(inum);
+  return OK;
+}
+
+
+int yfs_client::write(inum inum, off_t offset, size_t size, std::string data) {
+  acquire_lock(inum);
+  unlist(inum);
+  if (data.size() != size) {
+    data.resize(size, '\0');
   }
-  auto put_ret = ec->put(inum, content);
-  if (put_ret != OK) {
-    printf("ERROR! yfs_client::write ec->put failed! inum = %016llx\n\n", inum);
+  auto ret = ec->write(inum, offset, data);
+  if (ret != OK) {
+    printf("ERROR! yfs_client::write ec->write failed! inum = %016llx\n\n", inum);
     release_lock(inum);
-    return put_ret;
+    return ret;
   }
   release_lock(inum);
   return OK;
@@ -304,20 +640,13 @@ int yfs_client::write(inum inum, off_t offset, size_t size, std::string data) {
 
 int yfs_client::resize(inum inum, int size) {
   acquire_lock(inum);
-  std::string content;
-  auto ret = ec->get(inum, content);
+  unlist(inum);
+  auto ret = ec->resize(inum, size);
   if (ret != OK) {
-    printf("ERROR! yfs_client::resize ec->get failed! inum = %016llx\n\n", inum);
+    printf("ERROR! yfs_client::resize ec->resize failed! inum = %016llx\n\n", inum);
     release_lock(inum);
     return ret;
   }
-  content.resize(size, '\0');
-  auto put_ret = ec->put(inum, content);
-  if (put_ret != OK) {
-    printf("ERROR! yfs_client::resize ec->put failed! inum = %016llx\n\n", inum);
-    release_lock(inum);
-    return put_ret;
-  }
   release_lock(inum);
   return OK;
 }
@@ -325,36 +654,33 @@ int yfs_client::resize(inum inum, int size) {
 
 int yfs_client::unlink(yfs_client::inum parent, const char *name) {
   acquire_lock(parent);
-  std::string buffer;
-  auto get_ret = ec->get(parent, buffer);
-  if (get_ret != extent_protocol::OK) {
+  unlist(parent);
+  drop_dentry(parent, name);
+  yfs_dir dir(ec, parent);
+  inum file_inum;
+  auto remove_ret = dir.remove(name, file_inum);
+  if (remove_ret == OK)
+    unlist(file_inum);
+  if (remove_ret == NOENT) {
     release_lock(parent);
-    return get_ret;
-  }
-  yfs_client::dirent_lst_t folder_contents = unserialize(buffer);
-  for (auto it = folder_contents.begin(); it != folder_contents.end(); it++) {
-    if (it->name == name) {
-      auto file_inum = it->inum;
-      folder_contents.erase(it);
-      // delete file
-      acquire_lock(file_inum);
-      auto remove_ret = ec->remove(file_inum);
-      release_lock(file_inum);
-      if (remove_ret != extent_protocol::OK) {
-        printf("ERROR! yfs_client::unlink ec->remove failed! inum = %016llx\n\n", file_inum);
-        release_lock(parent);
-        return remove_ret;
-      }
-      // update parent folder
-      std::string serialized = serialize(folder_contents);
-      auto put_ret = ec->put(parent, serialized);
-      if (put_ret != extent_protocol::OK) {
-        printf("ERROR! yfs_client::unlink ec->put failed! inum = %016llx\n\n", parent);
-        release_lock(parent);
-        return put_ret;
-      }
-      break;
-    }
+    return OK;
+  }
+  if (remove_ret != OK) {
+    printf("ERROR! yfs_client::unlink remove failed! parent = %016llx\n\n", parent);
+    release_lock(parent);
+    return remove_ret;
+  }
+  // delete file, or a directory with its bucket extents
+  acquire_lock(file_inum);
+  if (isdir(file_inum))
+    remove_ret = yfs_dir(ec, file_inum).destroy();
+  if (remove_ret == extent_protocol::OK)
+    remove_ret = ec->remove(file_inum);
+  release_lock(file_inum);
+  if (remove_ret != extent_protocol::OK) {
+    printf("ERROR! yfs_client::unlink ec->remove failed! inum = %016llx\n\n", file_inum);
+    release_lock(parent);
+    return remove_ret;
   }
   release_lock(parent);
   return OK;
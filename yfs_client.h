@@ -6,18 +6,38 @@
 #include "extent_client.h"
 #include "lock_client_cache.h"
 #include <vector>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <pthread.h>
+
+class yfs_client;
 
 class custom_lock_release_user : public lock_release_user {
   private:
     extent_client *ec;
+    yfs_client *yfs;
     void dorelease(lock_protocol::lockid_t);
+    void dorelease(const std::vector<lock_protocol::lockid_t> &);
 
   public:
-    custom_lock_release_user(extent_client *ec) {
+    custom_lock_release_user(extent_client *ec, yfs_client *yfs) {
         this->ec = ec;
+        this->yfs = yfs;
     }
 };
 
+// told when what was read about an inode under its lock may go stale,
+// because this client is giving the lock back. fuse.cc drops the kernel's
+// cached attributes and directory entries for it.
+class cache_invalidator {
+ public:
+  virtual void invalidate(unsigned long long inum) = 0;
+  virtual ~cache_invalidator() {}
+};
+
 class yfs_client {
   extent_client *ec;
   lock_client_cache *lc;
@@ -27,16 +47,21 @@ class yfs_client {
   enum xxstatus { OK, RPCERR, NOENT, IOERR, FBIG };
   typedef int status;
 
+  // under_lock: read while holding the inode's lock, which this client
+  // keeps cached. it stays valid until the cache_invalidator hears of the
+  // lock's revocation. otherwise it came from a readdirplus listing.
   struct fileinfo {
     unsigned long long size;
     unsigned long atime;
     unsigned long mtime;
     unsigned long ctime;
+    bool under_lock;
   };
   struct dirinfo {
     unsigned long atime;
     unsigned long mtime;
     unsigned long ctime;
+    bool under_lock;
   };
   struct dirent {
     std::string name;
@@ -48,18 +73,137 @@ class yfs_client {
     }
   };
   typedef std::vector<dirent> dirent_lst_t;
+  // a directory entry with the attributes of what it names
+  struct direntplus {
+    std::string name;
+    unsigned long long inum;
+    fileinfo info;
+  };
+  typedef std::vector<direntplus> direntplus_lst_t;
+
+  // how long what did not come under a lock may be believed, unless
+  // set_lease says otherwise
+  static const int default_lease_ms = 1000;
+
+  struct stats {
+    // getattrs answered without the inode's lock, from a listing or a
+    // lease, and the getattrs sent to the extent server for leases
+    unsigned long long unlocked_getattrs;
+    unsigned long long leases;
+    // lookups that looked in the directory, and misses answered from the
+    // names known not to be there or from the directory's filter instead
+    unsigned long long dir_lookups;
+    unsigned long long absent_hits;
+    unsigned long long filter_hits;
+    // lookups answered from the dentry cache
+    unsigned long long dentry_hits;
+  };
 
  private:
-  static std::string filename(inum);
-  static inum n2i(std::string);
-
-  std::string serialize(dirent_lst_t lst);
-  dirent_lst_t unserialize(std::string serialized);
-
-  int get_all_in_dir(inum parent, dirent_lst_t& dirent_lst);
-  int put_all_in_dir(inum parent, dirent_lst_t dirent_lst);
-
-  inum create_random_inum(bool is_dir);
+  cache_invalidator *invalidator;
+
+  // what the last readdirplus of each directory returned. ls -l follows a
+  // readdir with a lookup and a getattr per entry, which are answered from
+  // here for the lease without taking locks or making RPCs. getattr of an
+  // inode whose lock this client does not have leases its attributes here
+  // too, from one getattr on the extent server, rather than taking the
+  // lock away from whoever has it. local changes drop what they touch;
+  // changes by other clients may be missed for up to the lease, as with
+  // the kernel's attribute timeouts. expired attributes go when they are
+  // next looked for, and leases start over past max_listed.
+  struct listing {
+    std::chrono::steady_clock::time_point expires;
+    std::map<std::string, inum> names;
+  };
+  struct listed_attr {
+    std::chrono::steady_clock::time_point expires;
+    fileinfo info;
+  };
+  pthread_mutex_t listing_lock;
+  std::map<inum, listing> listings;
+  static const size_t max_listed = 65536;
+  std::map<inum, listed_attr> listed;
+  std::chrono::milliseconds lease;
+  unsigned long long unlocked_getattrs;
+  unsigned long long leases;
+  unsigned long long dir_lookups;
+  unsigned long long absent_hits;
+  unsigned long long filter_hits;
+  unsigned long long dentry_hits;
+
+  bool listed_lookup(inum parent, const std::string &name, inum &);
+  bool listed_info(inum, fileinfo &);
+  bool leased_info(inum, fileinfo &);
+  // attributes from either, if this client does not have the lock
+  bool unlocked_info(inum, fileinfo &);
+  // forget a listing of inum and its listed attributes
+  void unlist(inum);
+
+  // names known not to be in a directory, while this client keeps its
+  // lock. build systems probe many paths that do not exist; a probe found
+  // here returns NOENT without taking the lock or looking in a bucket.
+  // what was not found is remembered, and once a directory has had
+  // bloom_after misses, or is listed anyway, a Bloom filter of all its
+  // names answers for the rest. both are only added to under the lock and
+  // dropped by revoked() before the lock goes back, so no other client
+  // can have added a name meanwhile. creates take their name out; unlinks
+  // leave the filter alone, a stale bit only costs a real lookup.
+  struct name_filter {
+    std::vector<uint64_t> bits;  // a power of two of them, empty if unbuilt
+    void build(const std::vector<std::string> &names);
+    void add(const std::string &name);
+    bool may_contain(const std::string &name) const;
+  };
+  struct absent_names {
+    std::unordered_set<std::string> names;
+    name_filter filter;
+    unsigned int misses;
+    absent_names() : misses(0) {}
+  };
+  static const unsigned int bloom_after = 8;
+  // directories of more buckets get a filter only from a listing they get
+  // anyway: reading them whole on every round trip of their lock would
+  // cost more than the misses it saves
+  static const uint32_t filter_max_buckets = 64;
+  static const size_t max_absent = 4096;
+  std::map<inum, absent_names> absent;
+
+  // what names in a directory resolve to, while this client keeps the
+  // directory's lock, so a warm path is one probe a component. filled by
+  // lookups and creates under the lock, not by listings, which would push
+  // the hot path prefixes out of the LRU; unlinks take their name out, and
+  // revoked() drops a directory's names before its lock goes back. the
+  // least recently used go past max_dentries.
+  typedef std::pair<inum, std::string> dentry_key;
+  struct dentry_hash {
+    size_t operator()(const dentry_key &k) const {
+      return std::hash<std::string>()(k.second) ^ (k.first * 0x9e3779b97f4a7c15ULL);
+    }
+  };
+  struct dentry {
+    inum ino;
+    std::list<dentry_key>::iterator lru_pos;
+  };
+  static const size_t max_dentries = 65536;
+  size_t dentry_limit;
+  std::unordered_map<dentry_key, dentry, dentry_hash> dentries;
+  std::unordered_map<inum, std::unordered_set<std::string>> dentry_names;
+  std::list<dentry_key> dentry_lru;  // most recently used first
+
+  bool cached_dentry(inum parent, const std::string &name, inum &);
+  void add_dentry(inum parent, const std::string &name, inum);
+  void drop_dentry(inum parent, const std::string &name);
+  // the caller holds listing_lock
+  void erase_dentry(const dentry_key &);
+
+  bool known_absent(inum parent, const std::string &name);
+  // record a miss; true if the directory should now get its filter
+  bool note_absent(inum parent, const std::string &name);
+  void note_present(inum parent, const std::string &name);
+  void filter_names(inum parent, const std::vector<std::string> &names);
+
+  // a new inum from the extent client's block of allocated ids
+  status new_inum(bool is_dir, inum &);
 
 public:
 
@@ -75,11 +219,27 @@ public:
   int create(inum parent, const char *name, int is_dir, inum& inum);
   int lookup(inum parent, const char *name, inum& inum);
   int readdir(inum parent, dirent_lst_t& dirent_lst);
-  int read(inum inum, off_t offset, size_t size, std::string& data);
+  // readdir plus the attributes of every entry, fetched in batches
+  int readdirplus(inum parent, direntplus_lst_t& lst);
+  // the data comes as slices of the cached blocks, not copied out of them
+  int read(inum inum, off_t offset, size_t size, std::vector<shared_buf>& data);
   int write(inum inum, off_t offset, size_t size, std::string data);
   int resize(inum inum, int size);
   int unlink(inum parent, const char *name);
 
+  void set_invalidator(cache_invalidator *);
+  // how long listings and leased attributes are believed. YFS_LEASE_MS
+  // sets it at startup; 0 takes the lock for every getattr.
+  void set_lease(std::chrono::milliseconds);
+  // the same in seconds, for the kernel's attribute timeout
+  double lease_seconds();
+  // how many names the dentry cache holds, max_dentries unless set; 0
+  // turns it off
+  void set_dentry_limit(size_t);
+  void get_stats(stats &);
+  // called by the lock releaser before the inode's lock goes back
+  void revoked(inum);
+
   void acquire_lock(inum inum);
   void release_lock(inum inum);
 };
@@ -0,0 +1,472 @@
+// extendible hashing directories, see yfs_dir.h
+
+#include "yfs_dir.h"
+#include <sstream>
+#include <set>
+#include <map>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+bool yfs_dir::in_place = true;
+
+yfs_dir::yfs_dir(extent_client *_ec, extent_protocol::extentid_t _id)
+  : ec(_ec), id(_id)
+{
+}
+
+extent_protocol::status
+yfs_dir::read_at(extent_protocol::extentid_t eid, uint64_t off, void *dst, unsigned int n)
+{
+  std::string buf;
+  extent_protocol::status ret = ec->read(eid, off, n, buf);
+  if (ret != extent_protocol::OK)
+    return ret;
+  if (buf.size() != n) {
+    printf("yfs_dir: %016llx truncated at %llu\n", eid, (unsigned long long) off);
+    return extent_protocol::IOERR;
+  }
+  memcpy(dst, buf.data(), n);
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+yfs_dir::write_at(extent_protocol::extentid_t eid, uint64_t off, const void *src, unsigned int n)
+{
+  return ec->write(eid, off, std::string((const char *) src, n));
+}
+
+// the directory's times change with its entries, as they did when every
+// change rewrote the directory. a change that only lands in a bucket
+// extent rewrites the root header to move them along.
+extent_protocol::status
+yfs_dir::touch(const root_header &h)
+{
+  return write_at(id, 0, &h, sizeof(h));
+}
+
+// the root header, with magic 0 for an empty directory. directories in an
+// older format are converted here.
+extent_protocol::status
+yfs_dir::load(root_header &h)
+{
+  memset(&h, 0, sizeof(h));
+  extent_protocol::attr a;
+  extent_protocol::status ret = ec->getattr(id, a);
+  if (ret != extent_protocol::OK || a.size == 0)
+    return ret;
+
+  if (a.size >= sizeof(h)) {
+    ret = read_at(id, 0, &h, sizeof(h));
+    if (ret != extent_protocol::OK)
+      return ret;
+    if (h.magic == root_magic)
+      return extent_protocol::OK;
+  }
+
+  std::string content;
+  ret = ec->get(id, content);
+  if (ret == extent_protocol::OK)
+    ret = convert(content);
+  if (ret == extent_protocol::OK)
+    ret = read_at(id, 0, &h, sizeof(h));
+  return ret;
+}
+
+// rewrite a directory in one of the earlier formats
+extent_protocol::status
+yfs_dir::convert(const std::string &content)
+{
+  std::vector<entry> entries;
+  uint32_t magic;
+  if (content.size() >= 32 && (memcpy(&magic, content.data(), 4), magic == 0x52494459)) {
+    // single extent hash table: 32 byte header with the bucket count at 4
+    // and the heap end at 16, the buckets, then records of next (8),
+    // inum (8), hash (4), name length (2), live (2) and the name
+    uint32_t nbuckets;
+    uint64_t heap_end;
+    memcpy(&nbuckets, content.data() + 4, 4);
+    memcpy(&heap_end, content.data() + 16, 8);
+    size_t pos = 32 + 8ULL * nbuckets;
+    while (pos + 24 <= std::min((size_t) heap_end, content.size())) {
+      uint64_t inum;
+      uint16_t namelen, live;
+      memcpy(&inum, content.data() + pos + 8, 8);
+      memcpy(&namelen, content.data() + pos + 20, 2);
+      memcpy(&live, content.data() + pos + 22, 2);
+      if (live)
+        entries.push_back(entry(content.substr(pos + 24, namelen), inum));
+      pos += 24 + namelen;
+    }
+  } else {
+    // 'inum:name' separated by \n
+    std::istringstream ist(content);
+    std::string line;
+    while (std::getline(ist, line)) {
+      size_t colon = line.find(':');
+      if (colon == std::string::npos)
+        continue;
+      entry e;
+      std::istringstream(line.substr(0, colon)) >> e.inum;
+      e.name = line.substr(colon + 1);
+      entries.push_back(e);
+    }
+  }
+
+  // an empty inline bucket, then the entries one by one
+  root_header h;
+  memset(&h, 0, sizeof(h));
+  h.magic = root_magic;
+  std::string root((const char *) &h, sizeof(h));
+  root.append(8, '\0');
+  root += dir_bucket::encode(std::vector<entry>(), 0);
+  extent_protocol::status ret = ec->put(id, root);
+  for (size_t i = 0; i < entries.size() && ret == extent_protocol::OK; i++)
+    ret = add(entries[i].name, entries[i].inum);
+  return ret;
+}
+
+// where the bucket for a hash is, without reading it
+extent_protocol::status
+yfs_dir::locate(const root_header &h, uint32_t hv, uint32_t &slot, bucket &b)
+{
+  slot = hv & ((1U << h.depth) - 1);
+  uint64_t eid;
+  extent_protocol::status ret = read_at(id, sizeof(h) + 8ULL * slot, &eid, sizeof(eid));
+  if (ret != extent_protocol::OK)
+    return ret;
+  b.eid = eid ? eid : id;
+  b.base = eid ? 0 : inline_base();
+  return extent_protocol::OK;
+}
+
+// left to the server: a bucket extent the client has no copy of. a kept
+// copy is revalidated instead, which costs as little when it is unchanged
+// and keeps the next operations on the bucket local.
+bool
+yfs_dir::remote(const bucket &b)
+{
+  return in_place && b.eid != id && !ec->cached(b.eid);
+}
+
+extent_protocol::status
+yfs_dir::read_bucket(bucket &b)
+{
+  if (b.eid != id)
+    ec->tie(b.eid, id);
+  extent_protocol::status ret = ec->read(b.eid, b.base, ~0U, b.data);
+  if (ret != extent_protocol::OK)
+    return ret;
+  if (!dir_bucket::read_header(b.data, b.h)) {
+    printf("yfs_dir: bad bucket %016llx in %016llx\n", b.eid, id);
+    return extent_protocol::IOERR;
+  }
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+yfs_dir::lookup(const std::string &name, extent_protocol::extentid_t &inum)
+{
+  root_header h;
+  extent_protocol::status ret = load(h);
+  if (ret != extent_protocol::OK)
+    return ret;
+  if (h.magic != root_magic)
+    return extent_protocol::NOENT;
+
+  uint32_t slot;
+  bucket b;
+  ret = locate(h, dir_bucket::hash(name), slot, b);
+  if (ret != extent_protocol::OK)
+    return ret;
+  if (remote(b))
+    return ec->lookup_entry(b.eid, name, inum);
+
+  ret = read_bucket(b);
+  if (ret != extent_protocol::OK)
+    return ret;
+  size_t pos;
+  dir_bucket::record r;
+  if (!dir_bucket::find(b.data, b.h, name, pos, r))
+    return extent_protocol::NOENT;
+  inum = r.inum;
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+yfs_dir::add(const std::string &name, extent_protocol::extentid_t inum)
+{
+  return insert(name, inum);
+}
+
+extent_protocol::status
+yfs_dir::insert(const std::string &name, extent_protocol::extentid_t &inum)
+{
+  uint32_t hv = dir_bucket::hash(name);
+  while (true) {
+    root_header h;
+    extent_protocol::status ret = load(h);
+    if (ret != extent_protocol::OK)
+      return ret;
+    if (h.magic != root_magic) {
+      h.magic = root_magic;
+      std::string root((const char *) &h, sizeof(h));
+      root.append(8, '\0');
+      root += dir_bucket::encode(std::vector<entry>(1, entry(name, inum)), 0);
+      return ec->put(id, root);
+    }
+
+    uint32_t slot;
+    bucket b;
+    ret = locate(h, hv, slot, b);
+    if (ret != extent_protocol::OK)
+      return ret;
+    if (remote(b)) {
+      // FBIG: the bucket is full, fetch it and split it here
+      extent_protocol::extentid_t found;
+      ret = ec->add_entry(b.eid, name, inum, found);
+      if (ret == extent_protocol::OK && found == inum)
+        ret = touch(h);
+      if (ret == extent_protocol::OK)
+        inum = found;
+      if (ret != extent_protocol::FBIG)
+        return ret;
+    }
+    ret = read_bucket(b);
+    if (ret != extent_protocol::OK)
+      return ret;
+    size_t pos;
+    dir_bucket::record r;
+    if (dir_bucket::find(b.data, b.h, name, pos, r)) {
+      inum = r.inum;
+      return extent_protocol::OK;
+    }
+
+    std::string rec = dir_bucket::encode_record(name, inum);
+    if (b.h.end + rec.size() <= dir_bucket::max_bytes || b.h.depth >= dir_bucket::max_depth) {
+      ret = write_at(b.eid, b.base + b.h.end, rec.data(), rec.size());
+      b.h.end += rec.size();
+      b.h.nentries++;
+      if (ret == extent_protocol::OK)
+        ret = write_at(b.eid, b.base, &b.h, sizeof(b.h));
+      if (ret == extent_protocol::OK && b.eid != id)
+        ret = touch(h);
+      return ret;
+    }
+
+    // make room and try again
+    ret = b.h.dead ? compact(b) : split(h, slot, b);
+    if (ret != extent_protocol::OK)
+      return ret;
+  }
+}
+
+extent_protocol::status
+yfs_dir::remove(const std::string &name, extent_protocol::extentid_t &inum)
+{
+  root_header h;
+  extent_protocol::status ret = load(h);
+  if (ret != extent_protocol::OK)
+    return ret;
+  if (h.magic != root_magic)
+    return extent_protocol::NOENT;
+
+  uint32_t slot;
+  bucket b;
+  ret = locate(h, dir_bucket::hash(name), slot, b);
+  if (ret != extent_protocol::OK)
+    return ret;
+  if (remote(b)) {
+    ret = ec->remove_entry(b.eid, name, inum);
+    if (ret == extent_protocol::OK)
+      ret = touch(h);
+    return ret;
+  }
+
+  ret = read_bucket(b);
+  if (ret != extent_protocol::OK)
+    return ret;
+  size_t pos;
+  dir_bucket::record r;
+  if (!dir_bucket::find(b.data, b.h, name, pos, r))
+    return extent_protocol::NOENT;
+  inum = r.inum;
+
+  uint16_t dead = 0;
+  b.h.nentries--;
+  b.h.dead += sizeof(r) + r.namelen;
+  ret = write_at(b.eid, b.base + pos + offsetof(dir_bucket::record, live), &dead, sizeof(dead));
+  if (ret == extent_protocol::OK)
+    ret = write_at(b.eid, b.base, &b.h, sizeof(b.h));
+  if (ret == extent_protocol::OK && b.h.dead * 2 > dir_bucket::max_bytes) {
+    ret = read_bucket(b);
+    if (ret == extent_protocol::OK)
+      ret = compact(b);
+  }
+  if (ret == extent_protocol::OK && b.eid != id)
+    ret = touch(h);
+  return ret;
+}
+
+// rewrite a bucket without its dead records
+extent_protocol::status
+yfs_dir::compact(bucket &b)
+{
+  std::vector<entry> entries;
+  dir_bucket::parse(b.data, entries);
+  std::string content = dir_bucket::encode(entries, b.h.depth);
+  if (b.eid != id)
+    return ec->put(b.eid, content);
+  extent_protocol::status ret = ec->write(id, b.base, content);
+  if (ret == extent_protocol::OK)
+    ret = ec->resize(id, b.base + content.size());
+  return ret;
+}
+
+// split a full bucket on the next bit of the hash, doubling the table
+// first if the bucket already uses every bit the table has
+extent_protocol::status
+yfs_dir::split(root_header &h, uint32_t slot, bucket &b)
+{
+  std::vector<entry> entries, halves[2];
+  dir_bucket::parse(b.data, entries);
+  uint32_t d = b.h.depth;
+  for (size_t i = 0; i < entries.size(); i++)
+    halves[(dir_bucket::hash(entries[i].name) >> d) & 1].push_back(entries[i]);
+
+  extent_protocol::status ret;
+  if (b.eid == id) {
+    // the inline bucket moves out into two bucket extents
+    extent_protocol::extentid_t ids[2];
+    for (int k = 0; k < 2; k++) {
+      ret = ec->alloc(ids[k]);
+      if (ret != extent_protocol::OK)
+        return ret;
+      ec->tie(ids[k], id);
+      ret = ec->put(ids[k], dir_bucket::encode(halves[k], 1));
+      if (ret != extent_protocol::OK)
+        return ret;
+    }
+    h.depth = 1;
+    std::string root((const char *) &h, sizeof(h));
+    root.append((const char *) ids, sizeof(ids));
+    return ec->put(id, root);
+  }
+
+  extent_protocol::extentid_t nb;
+  ret = ec->alloc(nb);
+  if (ret != extent_protocol::OK)
+    return ret;
+  ec->tie(nb, id);
+  ret = ec->put(b.eid, dir_bucket::encode(halves[0], d + 1));
+  if (ret == extent_protocol::OK)
+    ret = ec->put(nb, dir_bucket::encode(halves[1], d + 1));
+  if (ret != extent_protocol::OK)
+    return ret;
+
+  if (d == h.depth) {
+    std::string table;
+    ret = ec->read(id, sizeof(h), 8U << h.depth, table);
+    if (ret != extent_protocol::OK)
+      return ret;
+    table += table;
+    h.depth++;
+    memcpy(&table[8ULL * (slot | (1U << d))], &nb, sizeof(nb));
+    std::string root((const char *) &h, sizeof(h));
+    return ec->put(id, root + table);
+  }
+
+  // every slot ending in the bucket's d bits pointed at it, those with
+  // bit d set now point at the new one
+  uint32_t low = (slot & ((1U << d) - 1)) | (1U << d);
+  for (uint32_t j = low; j < (1U << h.depth) && ret == extent_protocol::OK; j += 1U << (d + 1))
+    ret = write_at(id, sizeof(h) + 8ULL * j, &nb, sizeof(nb));
+  if (ret == extent_protocol::OK)
+    ret = write_at(id, 0, &h, sizeof(h));
+  return ret;
+}
+
+// the distinct bucket extents in table order, none for an inline bucket
+extent_protocol::status
+yfs_dir::bucket_ids(const root_header &h, std::vector<extent_protocol::extentid_t> &ids)
+{
+  std::string table;
+  extent_protocol::status ret = ec->read(id, sizeof(h), 8U << h.depth, table);
+  if (ret != extent_protocol::OK)
+    return ret;
+  std::set<extent_protocol::extentid_t> seen;
+  for (size_t i = 0; i + 8 <= table.size(); i += 8) {
+    extent_protocol::extentid_t eid;
+    memcpy(&eid, table.data() + i, sizeof(eid));
+    if (eid && seen.insert(eid).second)
+      ids.push_back(eid);
+  }
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+yfs_dir::list(std::vector<entry> &entries)
+{
+  entries.clear();
+  root_header h;
+  extent_protocol::status ret = load(h);
+  if (ret != extent_protocol::OK || h.magic != root_magic)
+    return ret;
+
+  std::vector<extent_protocol::extentid_t> ids;
+  ret = bucket_ids(h, ids);
+  if (ret != extent_protocol::OK)
+    return ret;
+  if (ids.empty()) {
+    bucket b;
+    b.eid = id;
+    b.base = inline_base();
+    ret = read_bucket(b);
+    if (ret == extent_protocol::OK)
+      dir_bucket::parse(b.data, entries);
+    return ret;
+  }
+
+  // all buckets in one batch, a cold listing is a round trip per server
+  for (size_t i = 0; i < ids.size(); i++)
+    ec->tie(ids[i], id);
+  std::map<extent_protocol::extentid_t, std::string> buckets;
+  ret = ec->get(ids, buckets);
+  if (ret != extent_protocol::OK)
+    return ret;
+  for (size_t i = 0; i < ids.size(); i++) {
+    auto it = buckets.find(ids[i]);
+    if (it == buckets.end() || it->second.size() < sizeof(dir_bucket::header)) {
+      printf("yfs_dir: bucket %016llx of %016llx missing\n", ids[i], id);
+      return extent_protocol::IOERR;
+    }
+    dir_bucket::parse(it->second, entries);
+  }
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+yfs_dir::buckets(uint32_t &n)
+{
+  root_header h;
+  extent_protocol::status ret = load(h);
+  if (ret == extent_protocol::OK)
+    n = h.magic == root_magic ? 1U << h.depth : 0;
+  return ret;
+}
+
+extent_protocol::status
+yfs_dir::destroy()
+{
+  root_header h;
+  extent_protocol::status ret = load(h);
+  if (ret != extent_protocol::OK || h.magic != root_magic)
+    return ret;
+  std::vector<extent_protocol::extentid_t> ids;
+  ret = bucket_ids(h, ids);
+  for (size_t i = 0; i < ids.size() && ret == extent_protocol::OK; i++) {
+    ec->tie(ids[i], id);
+    ret = ec->remove(ids[i]);
+  }
+  return ret;
+}
@@ -0,0 +1,106 @@
+// directory content, kept in the directory's extent and its bucket extents
+
+#ifndef yfs_dir_h
+#define yfs_dir_h
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "extent_protocol.h"
+#include "extent_client.h"
+#include "dir_bucket.h"
+
+// Directories are extendible hash tables. The directory's own extent holds
+// a small header and the table: 2^depth slots, each the id of the bucket
+// extent that holds the names whose hash ends in the slot's bits.
+//
+//   root:   header | bucket id x 2^depth
+//   bucket: header | records (inum, name hash, name) ...
+//
+// Buckets are laid out as in dir_bucket.h and hold at most
+// dir_bucket::max_bytes. Adding a name appends a record to its bucket,
+// removing one marks the record dead, so either dirties just that bucket's
+// extent and the root's header, which moves the directory's times. A full
+// bucket is split in two on the next bit of the hash, which rewrites two
+// buckets and the slots pointing to them, and doubles the table when the
+// bucket already used all of its bits. Lookups read one slot and one bucket
+// however large the directory is.
+//
+// A bucket the client has no copy of is not fetched to look up or change
+// one name in it: the server does that in place through its entry RPCs, so
+// the bytes sent are in proportion to the name rather than to the directory.
+// The root header is still rewritten after such a change, for the times.
+//
+// Small directories keep their single bucket inline in the root extent,
+// right after a one-slot table, until it first splits. An empty extent is
+// an empty directory. Directories in the earlier single-extent hashed
+// format and in the old "inum:name\n" text format are converted the first
+// time they are opened.
+//
+// The caller holds the directory's lock. Bucket extents are tied to the
+// directory in extent_client, so they are written back and revalidated
+// with it.
+class yfs_dir {
+ public:
+  typedef dir_bucket::entry entry;
+
+  // change buckets the client has not cached through the server's entry
+  // RPCs instead of fetching them. on by default, benchmarks turn it off.
+  static bool in_place;
+
+  yfs_dir(extent_client *ec, extent_protocol::extentid_t id);
+
+  extent_protocol::status lookup(const std::string &name, extent_protocol::extentid_t &inum);
+  // the name must not be in the directory yet
+  extent_protocol::status add(const std::string &name, extent_protocol::extentid_t inum);
+  // add unless the name is there already, in which case inum is set to the
+  // one it has. a create is then one round trip for a bucket left remote.
+  extent_protocol::status insert(const std::string &name, extent_protocol::extentid_t &inum);
+  extent_protocol::status remove(const std::string &name, extent_protocol::extentid_t &inum);
+  extent_protocol::status list(std::vector<entry> &);
+  // the most bucket extents a listing reads, 2^depth, from the root header
+  // alone. 1 for a directory that has not split, 0 for an empty one.
+  extent_protocol::status buckets(uint32_t &n);
+  // remove the bucket extents, the directory's own extent is left alone
+  extent_protocol::status destroy();
+
+ private:
+  static const uint32_t root_magic = 0x32584459;  // "YDX2"
+
+  struct root_header {
+    uint32_t magic;
+    uint32_t depth;
+    // serial that earlier versions named bucket extents by. buckets now get
+    // ids from the allocator like inodes do; the table holds them either way.
+    uint64_t next_bucket;
+    uint64_t reserved[2];
+  };
+
+  // where a bucket lives: its own extent at offset 0, or inline in the root
+  struct bucket {
+    extent_protocol::extentid_t eid;
+    uint64_t base;
+    dir_bucket::header h;
+    std::string data;  // the whole bucket, header included
+  };
+
+  extent_client *ec;
+  extent_protocol::extentid_t id;
+
+  static uint64_t inline_base() { return sizeof(root_header) + 8; }
+
+  extent_protocol::status load(root_header &);
+  extent_protocol::status convert(const std::string &content);
+  extent_protocol::status read_at(extent_protocol::extentid_t eid, uint64_t off, void *dst, unsigned int n);
+  extent_protocol::status write_at(extent_protocol::extentid_t eid, uint64_t off, const void *src, unsigned int n);
+  extent_protocol::status touch(const root_header &);
+
+  extent_protocol::status locate(const root_header &, uint32_t hash, uint32_t &slot, bucket &);
+  bool remote(const bucket &);
+  extent_protocol::status read_bucket(bucket &);
+  extent_protocol::status compact(bucket &);
+  extent_protocol::status split(root_header &, uint32_t slot, bucket &);
+  extent_protocol::status bucket_ids(const root_header &, std::vector<extent_protocol::extentid_t> &);
+};
+
+#endif